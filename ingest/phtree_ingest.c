@@ -0,0 +1,808 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "phtree_ingest.h"
+
+#if defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define INGEST_SSE2
+#endif
+
+#define SIGN32 UINT32_C(0x80000000)
+#define SIGN64 UINT64_C(0x8000000000000000)
+
+/*
+ * the conversions
+ *
+ * these give the same keys as phtree_int32_to_key and phtree_float_to_key
+ * 	in source/reference_to_key_functions.c
+ * 		and the same thing widened to 64 bits for doubles
+ * but they are written without branches
+ * 	so a whole array can be done a few values at a time with SIMD
+ *
+ * for floating point values
+ * 	negative values become (-bits) with the sign bit cleared
+ * 	positive values get their sign bit set
+ * negative is all 1 bits for negative values and all 0 bits for positive values
+ * 	and picks between the two
+ */
+static uint32_t float_bits_to_key32 (uint32_t bits)
+{
+	uint32_t negative = (uint32_t) ((int32_t) bits >> 31);
+
+	return (negative & ((0U - bits) & ~SIGN32)) | (~negative & (bits | SIGN32));
+}
+
+static uint64_t double_bits_to_key64 (uint64_t bits)
+{
+	uint64_t negative = (uint64_t) ((int64_t) bits >> 63);
+
+	return (negative & ((0U - bits) & ~SIGN64)) | (~negative & (bits | SIGN64));
+}
+
+static uint64_t double_to_key64 (double value)
+{
+	uint64_t bits;
+	memcpy (&bits, &value, sizeof (bits));
+
+	return double_bits_to_key64 (bits);
+}
+
+#ifdef INGEST_SSE2
+static __m128i float_bits_to_key32_sse2 (__m128i bits)
+{
+	__m128i negative = _mm_srai_epi32 (bits, 31);
+	__m128i magnitude = _mm_and_si128 (_mm_sub_epi32 (_mm_setzero_si128 (), bits), _mm_set1_epi32 (INT32_MAX));
+	__m128i positive = _mm_or_si128 (bits, _mm_set1_epi32 (INT32_MIN));
+
+	return _mm_or_si128 (_mm_and_si128 (negative, magnitude), _mm_andnot_si128 (negative, positive));
+}
+
+static __m128i double_bits_to_key64_sse2 (__m128i bits)
+{
+	// SSE2 has no 64 bit arithmetic shift, so the sign of the high half is copied over both halves
+	__m128i negative = _mm_shuffle_epi32 (_mm_srai_epi32 (bits, 31), _MM_SHUFFLE (3, 3, 1, 1));
+	__m128i magnitude = _mm_and_si128 (_mm_sub_epi64 (_mm_setzero_si128 (), bits), _mm_set1_epi64x (INT64_MAX));
+	__m128i positive = _mm_or_si128 (bits, _mm_set1_epi64x (INT64_MIN));
+
+	return _mm_or_si128 (_mm_and_si128 (negative, magnitude), _mm_andnot_si128 (negative, positive));
+}
+#endif
+
+void phtree_ingest_int32_to_key32 (const int32_t* values, uint32_t* keys, size_t count)
+{
+	size_t iter = 0;
+
+#ifdef INGEST_SSE2
+	for (; iter + 4 <= count; iter += 4)
+	{
+		__m128i value = _mm_loadu_si128 ((const __m128i*) (values + iter));
+		_mm_storeu_si128 ((__m128i*) (keys + iter), _mm_xor_si128 (value, _mm_set1_epi32 (INT32_MIN)));
+	}
+#endif
+
+	for (; iter < count; iter++)
+	{
+		keys[iter] = (uint32_t) values[iter] ^ SIGN32;
+	}
+}
+
+void phtree_ingest_float_to_key32 (const float* values, uint32_t* keys, size_t count)
+{
+	size_t iter = 0;
+
+#ifdef INGEST_SSE2
+	for (; iter + 4 <= count; iter += 4)
+	{
+		__m128i bits = _mm_loadu_si128 ((const __m128i*) (values + iter));
+		_mm_storeu_si128 ((__m128i*) (keys + iter), float_bits_to_key32_sse2 (bits));
+	}
+#endif
+
+	for (; iter < count; iter++)
+	{
+		uint32_t bits;
+		memcpy (&bits, &values[iter], sizeof (bits));
+		keys[iter] = float_bits_to_key32 (bits);
+	}
+}
+
+void phtree_ingest_double_to_key32 (const double* values, uint32_t* keys, size_t count)
+{
+	size_t iter = 0;
+
+#ifdef INGEST_SSE2
+	for (; iter + 2 <= count; iter += 2)
+	{
+		__m128i key = double_bits_to_key64_sse2 (_mm_loadu_si128 ((const __m128i*) (values + iter)));
+		// the high halves of both keys, next to each other in the low 64 bits
+		key = _mm_shuffle_epi32 (key, _MM_SHUFFLE (3, 1, 3, 1));
+		_mm_storel_epi64 ((__m128i*) (keys + iter), key);
+	}
+#endif
+
+	for (; iter < count; iter++)
+	{
+		keys[iter] = (uint32_t) (double_to_key64 (values[iter]) >> 32);
+	}
+}
+
+void phtree_ingest_int32_to_key64 (const int32_t* values, uint64_t* keys, size_t count)
+{
+	size_t iter = 0;
+
+#ifdef INGEST_SSE2
+	for (; iter + 2 <= count; iter += 2)
+	{
+		__m128i value = _mm_loadl_epi64 ((const __m128i*) (values + iter));
+		// sign extend to 64 bits
+		value = _mm_unpacklo_epi32 (value, _mm_srai_epi32 (value, 31));
+		_mm_storeu_si128 ((__m128i*) (keys + iter), _mm_xor_si128 (value, _mm_set1_epi64x (INT64_MIN)));
+	}
+#endif
+
+	for (; iter < count; iter++)
+	{
+		keys[iter] = (uint64_t) (int64_t) values[iter] ^ SIGN64;
+	}
+}
+
+void phtree_ingest_float_to_key64 (const float* values, uint64_t* keys, size_t count)
+{
+	size_t iter = 0;
+
+	// floats are widened to doubles first, which is exact and keeps their order
+#ifdef INGEST_SSE2
+	for (; iter + 2 <= count; iter += 2)
+	{
+		__m128d value = _mm_cvtps_pd (_mm_castsi128_ps (_mm_loadl_epi64 ((const __m128i*) (values + iter))));
+		_mm_storeu_si128 ((__m128i*) (keys + iter), double_bits_to_key64_sse2 (_mm_castpd_si128 (value)));
+	}
+#endif
+
+	for (; iter < count; iter++)
+	{
+		keys[iter] = double_to_key64 (values[iter]);
+	}
+}
+
+void phtree_ingest_double_to_key64 (const double* values, uint64_t* keys, size_t count)
+{
+	size_t iter = 0;
+
+#ifdef INGEST_SSE2
+	for (; iter + 2 <= count; iter += 2)
+	{
+		__m128i bits = _mm_loadu_si128 ((const __m128i*) (values + iter));
+		_mm_storeu_si128 ((__m128i*) (keys + iter), double_bits_to_key64_sse2 (bits));
+	}
+#endif
+
+	for (; iter < count; iter++)
+	{
+		keys[iter] = double_to_key64 (values[iter]);
+	}
+}
+
+/*
+ * the pipeline
+ *
+ * a fixed set of chunks goes around
+ * 	free -> filling (reader) -> read -> converting (a converter) -> converted -> free (batch function)
+ * chunks are numbered as they are read
+ * 	and the batch function takes them in that order, whichever converter finished first
+ */
+enum
+{
+	CHUNK_FREE,
+	CHUNK_FILLING,
+	CHUNK_READ,
+	CHUNK_CONVERTING,
+	CHUNK_CONVERTED,
+};
+
+// chunks per converter thread, so a converter always has the next chunk ready
+#define INGEST_CHUNKS_PER_THREAD 2
+
+// the average number of bytes a csv value is expected to take, used to size csv reads
+#define INGEST_CSV_VALUE_BYTES 12
+
+typedef struct ingest_chunk_t
+{
+	int state;
+	uint64_t sequence;
+
+	// what was read from the file, with room for a terminating 0 for csv
+	char* raw;
+	size_t raw_size;
+	size_t raw_capacity;
+
+	// csv values once they are parsed
+	void* values;
+	size_t values_capacity;
+
+	void* keys;
+	size_t keys_capacity;
+	size_t count;
+	uint64_t skipped_lines;
+} ingest_chunk_t;
+
+typedef struct ingest_t
+{
+	phtree_ingest_options_t options;
+	FILE* file;
+	size_t value_size;
+	size_t key_size;
+	size_t read_size;
+	// the largest a csv chunk has had to grow to, only the reader uses it
+	size_t read_capacity;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	ingest_chunk_t* chunks;
+	int chunk_count;
+	uint64_t sequence_read;
+	uint64_t sequence_consumed;
+	bool read_done;
+	bool stopping;
+	bool failed;
+
+	// the part of the last csv line of a chunk which goes in to the next chunk
+	char* carry;
+	size_t carry_size;
+	uint64_t bytes;
+} ingest_t;
+
+static bool buffer_reserve (void** buffer, size_t* capacity, size_t needed, size_t element_size)
+{
+	if (*capacity >= needed)
+	{
+		return true;
+	}
+
+	size_t new_capacity = *capacity ? *capacity : 1;
+
+	while (new_capacity < needed)
+	{
+		new_capacity *= 2;
+	}
+
+	void* new_buffer = realloc (*buffer, new_capacity * element_size);
+
+	if (!new_buffer)
+	{
+		return false;
+	}
+
+	*buffer = new_buffer;
+	*capacity = new_capacity;
+
+	return true;
+}
+
+static bool ingest_read_binary (ingest_t* ingest, ingest_chunk_t* chunk)
+{
+	size_t point_size = ingest->value_size * ingest->options.dimensions;
+
+	chunk->raw_size = fread (chunk->raw, 1, ingest->read_size, ingest->file);
+	ingest->bytes += chunk->raw_size;
+
+	if (ferror (ingest->file))
+	{
+		return false;
+	}
+
+	// a short read is the end of the file, which has to be the end of a point
+	return chunk->raw_size % point_size == 0;
+}
+
+/*
+ * read whole lines in to the chunk
+ * 	the chunk grows if a single line is bigger than it
+ */
+static bool ingest_read_csv (ingest_t* ingest, ingest_chunk_t* chunk)
+{
+	memcpy (chunk->raw, ingest->carry, ingest->carry_size);
+	chunk->raw_size = ingest->carry_size;
+	ingest->carry_size = 0;
+
+	for (;;)
+	{
+		size_t searched = chunk->raw_size;
+		size_t got = fread (chunk->raw + chunk->raw_size, 1, chunk->raw_capacity - chunk->raw_size, ingest->file);
+		chunk->raw_size += got;
+		ingest->bytes += got;
+
+		if (ferror (ingest->file))
+		{
+			return false;
+		}
+
+		if (got == 0 && feof (ingest->file))
+		{
+			// the last line does not need a newline
+			return true;
+		}
+
+		for (size_t iter = chunk->raw_size; iter > searched; iter--)
+		{
+			if (chunk->raw[iter - 1] == '\n')
+			{
+				ingest->carry_size = chunk->raw_size - iter;
+				memcpy (ingest->carry, chunk->raw + iter, ingest->carry_size);
+				chunk->raw_size = iter;
+
+				return true;
+			}
+		}
+
+		if (chunk->raw_size < chunk->raw_capacity)
+		{
+			continue;
+		}
+
+		// one line filled the whole chunk
+		size_t capacity = chunk->raw_capacity * 2;
+		char* raw = realloc (chunk->raw, capacity + 1);
+		char* carry = realloc (ingest->carry, capacity);
+
+		if (raw)
+		{
+			chunk->raw = raw;
+		}
+
+		if (carry)
+		{
+			ingest->carry = carry;
+		}
+
+		if (!raw || !carry)
+		{
+			return false;
+		}
+
+		// every chunk has to be able to take the carry, the others grow when the reader next uses them
+		chunk->raw_capacity = capacity;
+		ingest->read_capacity = capacity;
+	}
+}
+
+static ingest_chunk_t* ingest_find (ingest_t* ingest, int state)
+{
+	ingest_chunk_t* found = NULL;
+
+	for (int iter = 0; iter < ingest->chunk_count; iter++)
+	{
+		ingest_chunk_t* chunk = &ingest->chunks[iter];
+
+		if (chunk->state == state && (!found || chunk->sequence < found->sequence))
+		{
+			found = chunk;
+		}
+	}
+
+	return found;
+}
+
+static void* ingest_reader (void* argument)
+{
+	ingest_t* ingest = argument;
+
+	pthread_mutex_lock (&ingest->lock);
+
+	while (!ingest->stopping && !ingest->read_done)
+	{
+		ingest_chunk_t* chunk = ingest_find (ingest, CHUNK_FREE);
+
+		if (!chunk)
+		{
+			pthread_cond_wait (&ingest->changed, &ingest->lock);
+			continue;
+		}
+
+		if (chunk->raw_capacity < ingest->read_capacity)
+		{
+			char* raw = realloc (chunk->raw, ingest->read_capacity + 1);
+
+			if (!raw)
+			{
+				ingest->failed = true;
+				break;
+			}
+
+			chunk->raw = raw;
+			chunk->raw_capacity = ingest->read_capacity;
+		}
+
+		chunk->state = CHUNK_FILLING;
+		pthread_mutex_unlock (&ingest->lock);
+
+		bool read = ingest->options.format == PHTREE_INGEST_CSV ? ingest_read_csv (ingest, chunk) : ingest_read_binary (ingest, chunk);
+
+		pthread_mutex_lock (&ingest->lock);
+
+		if (!read)
+		{
+			ingest->failed = true;
+		}
+
+		if (!read || chunk->raw_size == 0)
+		{
+			chunk->state = CHUNK_FREE;
+			ingest->read_done = true;
+		}
+		else
+		{
+			chunk->sequence = ingest->sequence_read++;
+			chunk->state = CHUNK_READ;
+		}
+
+		pthread_cond_broadcast (&ingest->changed);
+	}
+
+	ingest->read_done = true;
+	pthread_cond_broadcast (&ingest->changed);
+	pthread_mutex_unlock (&ingest->lock);
+
+	return NULL;
+}
+
+static bool csv_separator (char character)
+{
+	return character == ',' || character == ' ' || character == '\t' || character == '\r' || character == ';';
+}
+
+/*
+ * parse one value at cursor, which is not a separator
+ * 	returns false if there is no number there
+ */
+static bool csv_parse_value (phtree_ingest_type_t type, char** cursor, void* value)
+{
+	char* next = *cursor;
+	errno = 0;
+
+	if (type == PHTREE_INGEST_INT32)
+	{
+		long parsed = strtol (*cursor, &next, 10);
+
+		if (parsed < INT32_MIN || parsed > INT32_MAX || errno == ERANGE)
+		{
+			return false;
+		}
+
+		*(int32_t*) value = (int32_t) parsed;
+	}
+	else if (type == PHTREE_INGEST_FLOAT)
+	{
+		*(float*) value = strtof (*cursor, &next);
+	}
+	else
+	{
+		*(double*) value = strtod (*cursor, &next);
+	}
+
+	if (next == *cursor)
+	{
+		return false;
+	}
+
+	*cursor = next;
+
+	return true;
+}
+
+static bool ingest_parse_csv (ingest_t* ingest, ingest_chunk_t* chunk)
+{
+	int dimensions = ingest->options.dimensions;
+	char* cursor = chunk->raw;
+	char* end = chunk->raw + chunk->raw_size;
+
+	// stops strtod and friends at the end of the last line
+	*end = '\0';
+
+	while (cursor < end)
+	{
+		char* line_end = memchr (cursor, '\n', end - cursor);
+		line_end = line_end ? line_end : end;
+
+		// leave the line's terminator where it is, numbers can not run in to the next line
+		while (cursor < line_end && csv_separator (*cursor))
+		{
+			cursor++;
+		}
+
+		if (cursor == line_end || *cursor == '#')
+		{
+			cursor = line_end + 1;
+			continue;
+		}
+
+		if (!buffer_reserve (&chunk->values, &chunk->values_capacity, (chunk->count + 1) * dimensions, ingest->value_size))
+		{
+			return false;
+		}
+
+		uint8_t* point = (uint8_t*) chunk->values + chunk->count * dimensions * ingest->value_size;
+		bool parsed = true;
+
+		for (int dimension = 0; dimension < dimensions && parsed; dimension++)
+		{
+			while (cursor < line_end && csv_separator (*cursor))
+			{
+				cursor++;
+			}
+
+			parsed = cursor < line_end && csv_parse_value (ingest->options.type, &cursor, point + dimension * ingest->value_size) && cursor <= line_end;
+		}
+
+		while (parsed && cursor < line_end && csv_separator (*cursor))
+		{
+			cursor++;
+		}
+
+		if (parsed && cursor == line_end)
+		{
+			chunk->count++;
+		}
+		else
+		{
+			chunk->skipped_lines++;
+		}
+
+		cursor = line_end + 1;
+	}
+
+	return true;
+}
+
+static void ingest_convert_values (ingest_t* ingest, void* values, void* keys, size_t count)
+{
+	phtree_ingest_type_t type = ingest->options.type;
+
+	if (ingest->options.key_width == 32)
+	{
+		if (type == PHTREE_INGEST_INT32)
+		{
+			phtree_ingest_int32_to_key32 (values, keys, count);
+		}
+		else if (type == PHTREE_INGEST_FLOAT)
+		{
+			phtree_ingest_float_to_key32 (values, keys, count);
+		}
+		else
+		{
+			phtree_ingest_double_to_key32 (values, keys, count);
+		}
+	}
+	else
+	{
+		if (type == PHTREE_INGEST_INT32)
+		{
+			phtree_ingest_int32_to_key64 (values, keys, count);
+		}
+		else if (type == PHTREE_INGEST_FLOAT)
+		{
+			phtree_ingest_float_to_key64 (values, keys, count);
+		}
+		else
+		{
+			phtree_ingest_double_to_key64 (values, keys, count);
+		}
+	}
+}
+
+static bool ingest_convert (ingest_t* ingest, ingest_chunk_t* chunk)
+{
+	size_t dimensions = ingest->options.dimensions;
+	void* values = chunk->raw;
+
+	chunk->count = 0;
+	chunk->skipped_lines = 0;
+
+	if (ingest->options.format == PHTREE_INGEST_CSV)
+	{
+		if (!ingest_parse_csv (ingest, chunk))
+		{
+			return false;
+		}
+
+		values = chunk->values;
+	}
+	else
+	{
+		chunk->count = chunk->raw_size / (ingest->value_size * dimensions);
+	}
+
+	if (!buffer_reserve (&chunk->keys, &chunk->keys_capacity, chunk->count * dimensions, ingest->key_size))
+	{
+		return false;
+	}
+
+	ingest_convert_values (ingest, values, chunk->keys, chunk->count * dimensions);
+
+	return true;
+}
+
+static void* ingest_converter (void* argument)
+{
+	ingest_t* ingest = argument;
+
+	pthread_mutex_lock (&ingest->lock);
+
+	while (!ingest->stopping)
+	{
+		ingest_chunk_t* chunk = ingest_find (ingest, CHUNK_READ);
+
+		if (!chunk)
+		{
+			if (ingest->read_done)
+			{
+				break;
+			}
+
+			pthread_cond_wait (&ingest->changed, &ingest->lock);
+			continue;
+		}
+
+		chunk->state = CHUNK_CONVERTING;
+		pthread_mutex_unlock (&ingest->lock);
+
+		bool converted = ingest_convert (ingest, chunk);
+
+		pthread_mutex_lock (&ingest->lock);
+		chunk->state = CHUNK_CONVERTED;
+		ingest->failed |= !converted;
+		pthread_cond_broadcast (&ingest->changed);
+	}
+
+	pthread_mutex_unlock (&ingest->lock);
+
+	return NULL;
+}
+
+static void ingest_free (ingest_t* ingest)
+{
+	for (int iter = 0; iter < ingest->chunk_count; iter++)
+	{
+		free (ingest->chunks[iter].raw);
+		free (ingest->chunks[iter].values);
+		free (ingest->chunks[iter].keys);
+	}
+
+	free (ingest->chunks);
+	free (ingest->carry);
+}
+
+bool phtree_ingest_file (const char* path, phtree_ingest_options_t* options, phtree_ingest_batch_function_t batch, void* data, phtree_ingest_stats_t* stats)
+{
+	if (!path || !options || !batch
+		|| options->dimensions < 1 || options->dimensions > 6
+		|| (options->key_width != 32 && options->key_width != 64))
+	{
+		return false;
+	}
+
+	ingest_t ingest = {0};
+	ingest.options = *options;
+	ingest.options.batch_size = options->batch_size ? options->batch_size : PHTREE_INGEST_BATCH;
+	ingest.options.convert_threads = options->convert_threads > 0 ? options->convert_threads : 1;
+	ingest.value_size = options->type == PHTREE_INGEST_DOUBLE ? sizeof (double) : sizeof (int32_t);
+	ingest.key_size = options->key_width / 8;
+	ingest.read_size = ingest.options.batch_size * options->dimensions
+		* (options->format == PHTREE_INGEST_CSV ? INGEST_CSV_VALUE_BYTES : ingest.value_size);
+	ingest.read_capacity = ingest.read_size;
+	ingest.chunk_count = ingest.options.convert_threads * INGEST_CHUNKS_PER_THREAD + 1;
+	ingest.chunks = calloc (ingest.chunk_count, sizeof (ingest_chunk_t));
+	ingest.carry = malloc (ingest.read_size);
+	ingest.file = fopen (path, "rb");
+
+	bool allocated = ingest.chunks && ingest.carry;
+
+	for (int iter = 0; allocated && iter < ingest.chunk_count; iter++)
+	{
+		ingest.chunks[iter].raw = malloc (ingest.read_size + 1);
+		ingest.chunks[iter].raw_capacity = ingest.read_size;
+		allocated = ingest.chunks[iter].raw != NULL;
+	}
+
+	if (!allocated || !ingest.file)
+	{
+		if (ingest.file)
+		{
+			fclose (ingest.file);
+		}
+
+		if (ingest.chunks)
+		{
+			ingest_free (&ingest);
+		}
+		else
+		{
+			free (ingest.carry);
+		}
+
+		return false;
+	}
+
+	pthread_mutex_init (&ingest.lock, NULL);
+	pthread_cond_init (&ingest.changed, NULL);
+
+	pthread_t reader;
+	pthread_t* converters = malloc (ingest.options.convert_threads * sizeof (pthread_t));
+	int converters_started = 0;
+	bool reader_started = converters && pthread_create (&reader, NULL, ingest_reader, &ingest) == 0;
+
+	while (reader_started && converters_started < ingest.options.convert_threads
+		&& pthread_create (&converters[converters_started], NULL, ingest_converter, &ingest) == 0)
+	{
+		converters_started++;
+	}
+
+	bool running = reader_started && converters_started == ingest.options.convert_threads;
+	uint64_t records = 0;
+	uint64_t skipped_lines = 0;
+
+	pthread_mutex_lock (&ingest.lock);
+
+	while (running && !ingest.failed)
+	{
+		ingest_chunk_t* chunk = ingest_find (&ingest, CHUNK_CONVERTED);
+
+		if (!chunk || chunk->sequence != ingest.sequence_consumed)
+		{
+			if (ingest.read_done && ingest.sequence_consumed == ingest.sequence_read)
+			{
+				break;
+			}
+
+			pthread_cond_wait (&ingest.changed, &ingest.lock);
+			continue;
+		}
+
+		pthread_mutex_unlock (&ingest.lock);
+
+		bool more = chunk->count == 0 || batch (chunk->keys, chunk->count, records, data);
+		records += chunk->count;
+		skipped_lines += chunk->skipped_lines;
+
+		pthread_mutex_lock (&ingest.lock);
+		chunk->state = CHUNK_FREE;
+		ingest.sequence_consumed++;
+		ingest.failed |= !more;
+		pthread_cond_broadcast (&ingest.changed);
+	}
+
+	bool finished = running && !ingest.failed;
+	ingest.stopping = true;
+	pthread_cond_broadcast (&ingest.changed);
+	pthread_mutex_unlock (&ingest.lock);
+
+	if (reader_started)
+	{
+		pthread_join (reader, NULL);
+	}
+
+	for (int iter = 0; iter < converters_started; iter++)
+	{
+		pthread_join (converters[iter], NULL);
+	}
+
+	if (stats)
+	{
+		stats->records = records;
+		stats->bytes = ingest.bytes;
+		stats->skipped_lines = skipped_lines;
+	}
+
+	fclose (ingest.file);
+	free (converters);
+	pthread_mutex_destroy (&ingest.lock);
+	pthread_cond_destroy (&ingest.changed);
+	ingest_free (&ingest);
+
+	return finished;
+}
@@ -0,0 +1,108 @@
+#ifndef _phtree_ingest_h_
+#define _phtree_ingest_h_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * streaming point file importer
+ *
+ * reads files of points, converts every coordinate to a phtree key
+ * 	and hands the keys to a function in batches, in file order
+ * 		which would usually put them in a tree with _insert_batch or collect them for _build
+ *
+ * reading, converting and the batch function run at the same time
+ * 	one thread reads the file
+ * 	convert_threads threads parse (for csv) and convert batches
+ * 	the thread calling phtree_ingest_file runs the batch function
+ *
+ * the conversions are the order preserving ones from source/reference_to_key_functions.c
+ * 	done on whole arrays at a time, with SSE2 where it is available
+ *
+ * needs to be linked with pthreads
+ */
+
+typedef enum phtree_ingest_type_t
+{
+	PHTREE_INGEST_INT32,
+	PHTREE_INGEST_FLOAT,
+	PHTREE_INGEST_DOUBLE,
+} phtree_ingest_type_t;
+
+typedef enum phtree_ingest_format_t
+{
+	/*
+	 * points stored one after another as dimensions values of the type
+	 * 	in the byte order of the machine reading them
+	 */
+	PHTREE_INGEST_BINARY,
+	/*
+	 * one point per line, values separated by commas and/or whitespace
+	 * 	blank lines and lines starting with # are skipped
+	 * 	lines which are not dimensions numbers (like a header) are skipped and counted
+	 */
+	PHTREE_INGEST_CSV,
+} phtree_ingest_format_t;
+
+/*
+ * called with every batch of points, in the order they are in the file
+ * 	keys holds count points, each of dimensions keys of key_width bits
+ * 		which is the layout of an array of the tree's point type
+ * 	first_record is the number of points before this batch
+ * the keys are only valid until the function returns
+ * return false to stop reading the file
+ */
+typedef bool (*phtree_ingest_batch_function_t) (void* keys, size_t count, uint64_t first_record, void* data);
+
+typedef struct phtree_ingest_options_t
+{
+	phtree_ingest_format_t format;
+	phtree_ingest_type_t type;
+	// 1 to 6
+	int dimensions;
+	/*
+	 * 32 or 64, the bit width of the tree being fed
+	 * 	double coordinates going in to 32 bit keys keep the top 32 bits of their 64 bit key
+	 * 		which still preserves order, but values which are very close can get the same key
+	 */
+	int key_width;
+	// how many points are converted at a time, 0 for PHTREE_INGEST_BATCH
+	size_t batch_size;
+	// how many threads convert batches, 0 for 1
+	int convert_threads;
+} phtree_ingest_options_t;
+
+typedef struct phtree_ingest_stats_t
+{
+	uint64_t records;
+	uint64_t bytes;
+	// csv lines which could not be read as a point
+	uint64_t skipped_lines;
+} phtree_ingest_stats_t;
+
+#ifndef PHTREE_INGEST_BATCH
+#define PHTREE_INGEST_BATCH 65536
+#endif
+
+/*
+ * stream the file at path through batch
+ * 	stats can be NULL
+ *
+ * returns false if the file could not be read, a binary file ends part way through a point,
+ * 	memory or threads could not be allocated, or batch returned false
+ */
+bool phtree_ingest_file (const char* path, phtree_ingest_options_t* options, phtree_ingest_batch_function_t batch, void* data, phtree_ingest_stats_t* stats);
+
+/*
+ * the conversions phtree_ingest_file uses
+ * 	keys[i] is the key for values[i]
+ */
+void phtree_ingest_int32_to_key32 (const int32_t* values, uint32_t* keys, size_t count);
+void phtree_ingest_float_to_key32 (const float* values, uint32_t* keys, size_t count);
+void phtree_ingest_double_to_key32 (const double* values, uint32_t* keys, size_t count);
+void phtree_ingest_int32_to_key64 (const int32_t* values, uint64_t* keys, size_t count);
+void phtree_ingest_float_to_key64 (const float* values, uint64_t* keys, size_t count);
+void phtree_ingest_double_to_key64 (const double* values, uint64_t* keys, size_t count);
+
+#endif
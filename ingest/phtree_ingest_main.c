@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ingest/phtree_ingest.h"
+
+#include "source/64bit/phtree64_1d.h"
+#include "source/64bit/phtree64_2d.h"
+#include "source/64bit/phtree64_3d.h"
+#include "source/64bit/phtree64_4d.h"
+#include "source/64bit/phtree64_5d.h"
+#include "source/64bit/phtree64_6d.h"
+
+/*
+ * ingest
+ * 	loads a file of points in to a phtree with phtree_ingest_file
+ * 	and optionally saves it with _save_file, _mapped_write_file or _paged_write_file
+ *
+ * the element for each point is its record number + 1
+ * 	the first point in the file is element 1, so no element is NULL
+ *
+ * every type goes in to a 64 bit tree
+ * 	the trees of one dimension share their function names across bit widths
+ * 		so only one width can be linked in to a program
+ */
+
+static void usage (void)
+{
+	fprintf (stderr,
+		"usage: ingest [options] file\n"
+		"	-d dimensions	1 to 6, default 2\n"
+		"	-t type	int32, float or double, default double\n"
+		"	-f format	binary or csv, default from the file extension\n"
+		"	-m mode	insert (_insert_batch every batch) or build (_build once at the end), default build\n"
+		"	-b batch	points per batch, default %d\n"
+		"	-j threads	conversion threads, default 2\n"
+		"	-o file	save the tree with _save_file\n"
+		"	-M file	write the tree with _mapped_write_file\n"
+		"	-P file	write the tree with _paged_write_file, with the default page size and pinned depth\n",
+		PHTREE_INGEST_BATCH);
+}
+
+typedef struct ingest_tree_t
+{
+	void* tree;
+	void (*insert_batch) (void* tree, void* points, void** inputs, size_t count);
+	void (*build) (void* tree, void* points, void** inputs, size_t count);
+	bool (*save_file) (void* tree, const char* path);
+	bool (*mapped_write_file) (void* tree, const char* path);
+	bool (*paged_write_file) (void* tree, const char* path);
+	void (*destroy) (void* tree);
+} ingest_tree_t;
+
+static void* element_create (void* input)
+{
+	return input;
+}
+
+static bool element_save (void* element, phtree_write_function_t write, void* stream, void* data)
+{
+	(void) data;
+	uint64_t record = (uint64_t) (uintptr_t) element;
+
+	return write (stream, &record, sizeof (record));
+}
+
+#define INGEST_TREE(d) \
+	static void insert_batch_##d (void* tree, void* points, void** inputs, size_t count) \
+	{ \
+		ph##d##_insert_batch (tree, points, inputs, count, NULL); \
+	} \
+	static void build_##d (void* tree, void* points, void** inputs, size_t count) \
+	{ \
+		ph##d##_build (tree, points, inputs, count); \
+	} \
+	static bool save_file_##d (void* tree, const char* path) \
+	{ \
+		return ph##d##_save_file (tree, path, element_save, NULL); \
+	} \
+	static bool mapped_write_file_##d (void* tree, const char* path) \
+	{ \
+		return ph##d##_mapped_write_file (tree, path, element_save, NULL); \
+	} \
+	static bool paged_write_file_##d (void* tree, const char* path) \
+	{ \
+		return ph##d##_paged_write_file (tree, path, element_save, NULL, 0, -1); \
+	} \
+	static void destroy_##d (void* tree) \
+	{ \
+		ph##d##_clear (tree); \
+		free (tree); \
+	} \
+	static bool create_##d (ingest_tree_t* tree) \
+	{ \
+		ph##d##_t* created = malloc (sizeof (ph##d##_t)); \
+		if (!created) \
+		{ \
+			return false; \
+		} \
+		ph##d##_initialize (created, element_create, NULL, NULL, NULL, NULL, NULL); \
+		*tree = (ingest_tree_t) {created, insert_batch_##d, build_##d, save_file_##d, mapped_write_file_##d, paged_write_file_##d, destroy_##d}; \
+		return true; \
+	}
+
+INGEST_TREE (1)
+INGEST_TREE (2)
+INGEST_TREE (3)
+INGEST_TREE (4)
+INGEST_TREE (5)
+INGEST_TREE (6)
+
+static bool (*tree_create[]) (ingest_tree_t* tree) = {create_1, create_2, create_3, create_4, create_5, create_6};
+
+typedef struct ingest_state_t
+{
+	ingest_tree_t tree;
+	int dimensions;
+	bool build;
+
+	// the keys and inputs waiting for _build, or the inputs of one batch for _insert_batch
+	uint64_t* keys;
+	void** inputs;
+	size_t count;
+	size_t capacity;
+} ingest_state_t;
+
+static bool state_reserve (ingest_state_t* state, size_t count)
+{
+	if (count <= state->capacity)
+	{
+		return true;
+	}
+
+	size_t capacity = state->capacity ? state->capacity : PHTREE_INGEST_BATCH;
+
+	while (capacity < count)
+	{
+		capacity *= 2;
+	}
+
+	void** inputs = realloc (state->inputs, capacity * sizeof (void*));
+
+	if (inputs)
+	{
+		state->inputs = inputs;
+	}
+
+	if (state->build)
+	{
+		uint64_t* keys = realloc (state->keys, capacity * state->dimensions * sizeof (uint64_t));
+
+		if (keys)
+		{
+			state->keys = keys;
+		}
+
+		if (!keys)
+		{
+			return false;
+		}
+	}
+
+	if (!inputs)
+	{
+		return false;
+	}
+
+	state->capacity = capacity;
+
+	return true;
+}
+
+static bool ingest_batch (void* keys, size_t count, uint64_t first_record, void* data)
+{
+	ingest_state_t* state = data;
+	size_t start = state->build ? state->count : 0;
+
+	if (!state_reserve (state, start + count))
+	{
+		fprintf (stderr, "ingest: out of memory\n");
+		return false;
+	}
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		state->inputs[start + iter] = (void*) (uintptr_t) (first_record + iter + 1);
+	}
+
+	if (state->build)
+	{
+		memcpy (state->keys + start * state->dimensions, keys, count * state->dimensions * sizeof (uint64_t));
+		state->count += count;
+	}
+	else
+	{
+		state->tree.insert_batch (state->tree.tree, keys, state->inputs, count);
+	}
+
+	return true;
+}
+
+static double seconds_since (struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool ends_with (const char* string, const char* suffix)
+{
+	size_t length = strlen (string);
+	size_t suffix_length = strlen (suffix);
+
+	return length >= suffix_length && strcmp (string + length - suffix_length, suffix) == 0;
+}
+
+int main (int argc, char** argv)
+{
+	phtree_ingest_options_t options = {PHTREE_INGEST_BINARY, PHTREE_INGEST_DOUBLE, 2, 64, PHTREE_INGEST_BATCH, 2};
+	bool format_given = false;
+	bool build = true;
+	const char* save_path = NULL;
+	const char* mapped_path = NULL;
+	const char* paged_path = NULL;
+	const char* path = NULL;
+
+	for (int iter = 1; iter < argc; iter++)
+	{
+		const char* argument = argv[iter];
+		const char* value = iter + 1 < argc ? argv[iter + 1] : NULL;
+
+		if (argument[0] != '-')
+		{
+			path = argument;
+			continue;
+		}
+
+		if (!value || strlen (argument) != 2)
+		{
+			usage ();
+			return 1;
+		}
+
+		iter++;
+
+		switch (argument[1])
+		{
+			case 'd':
+				options.dimensions = atoi (value);
+				break;
+			case 't':
+				if (strcmp (value, "int32") == 0)
+				{
+					options.type = PHTREE_INGEST_INT32;
+				}
+				else if (strcmp (value, "float") == 0)
+				{
+					options.type = PHTREE_INGEST_FLOAT;
+				}
+				else if (strcmp (value, "double") == 0)
+				{
+					options.type = PHTREE_INGEST_DOUBLE;
+				}
+				else
+				{
+					usage ();
+					return 1;
+				}
+				break;
+			case 'f':
+				options.format = strcmp (value, "csv") == 0 ? PHTREE_INGEST_CSV : PHTREE_INGEST_BINARY;
+				format_given = true;
+				break;
+			case 'm':
+				build = strcmp (value, "insert") != 0;
+				break;
+			case 'b':
+				options.batch_size = (size_t) strtoull (value, NULL, 10);
+				break;
+			case 'j':
+				options.convert_threads = atoi (value);
+				break;
+			case 'o':
+				save_path = value;
+				break;
+			case 'M':
+				mapped_path = value;
+				break;
+			case 'P':
+				paged_path = value;
+				break;
+			default:
+				usage ();
+				return 1;
+		}
+	}
+
+	if (!path || options.dimensions < 1 || options.dimensions > 6)
+	{
+		usage ();
+		return 1;
+	}
+
+	if (!format_given && (ends_with (path, ".csv") || ends_with (path, ".txt")))
+	{
+		options.format = PHTREE_INGEST_CSV;
+	}
+
+	ingest_state_t state = {0};
+	state.dimensions = options.dimensions;
+	state.build = build;
+
+	if (!tree_create[options.dimensions - 1] (&state.tree))
+	{
+		fprintf (stderr, "ingest: out of memory\n");
+		return 1;
+	}
+
+	struct timespec start;
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	phtree_ingest_stats_t stats = {0};
+	bool ingested = phtree_ingest_file (path, &options, ingest_batch, &state, &stats);
+	double read_seconds = seconds_since (&start);
+
+	if (ingested && build)
+	{
+		state.tree.build (state.tree.tree, state.keys, state.inputs, state.count);
+	}
+
+	double seconds = seconds_since (&start);
+
+	free (state.keys);
+	free (state.inputs);
+
+	if (!ingested)
+	{
+		fprintf (stderr, "ingest: could not read %s (stopped after %llu points)\n", path, (unsigned long long) stats.records);
+		state.tree.destroy (state.tree.tree);
+		return 1;
+	}
+
+	printf ("%llu points, %llu bytes, %llu skipped lines\n",
+		(unsigned long long) stats.records, (unsigned long long) stats.bytes, (unsigned long long) stats.skipped_lines);
+	printf ("read %.3fs, total %.3fs, %.0f points/s\n",
+		read_seconds, seconds, seconds > 0 ? (double) stats.records / seconds : 0.0);
+
+	int result = 0;
+
+	if (save_path && !state.tree.save_file (state.tree.tree, save_path))
+	{
+		fprintf (stderr, "ingest: could not save %s\n", save_path);
+		result = 1;
+	}
+
+	if (mapped_path && !state.tree.mapped_write_file (state.tree.tree, mapped_path))
+	{
+		fprintf (stderr, "ingest: could not write %s\n", mapped_path);
+		result = 1;
+	}
+
+	if (paged_path && !state.tree.paged_write_file (state.tree.tree, paged_path))
+	{
+		fprintf (stderr, "ingest: could not write %s\n", paged_path);
+		result = 1;
+	}
+
+	state.tree.destroy (state.tree.tree);
+
+	return result;
+}
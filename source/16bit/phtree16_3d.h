@@ -5,6 +5,11 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#ifdef PHTREE_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
 /*
  * begin common section
  *
@@ -31,6 +36,69 @@ typedef uint16_t phtree_key_t;
  */
 typedef void (*phtree_iteration_function_t) (void* element, void* data);
 
+/*
+ * functions to be run on elements when deciding whether to remove them
+ * return true to remove the element
+ * data is any outside data you want to pass in to the function
+ */
+typedef bool (*phtree_predicate_function_t) (void* element, void* data);
+
+/*
+ * functions to be run when two trees being merged both have an element at the same point
+ * return the element to keep, the other one will be destroyed
+ * data is any outside data you want to pass in to the function
+ */
+typedef void* (*phtree_merge_function_t) (void* destination_element, void* source_element, void* data);
+
+/*
+ * functions run by _diff on each entry which differs between two trees
+ * 	point is the entry's point
+ * 	old_element is NULL for added entries, new_element is NULL for removed entries
+ * data is any outside data you want to pass in to the function
+ */
+typedef void (*phtree_diff_function_t) (void* point, void* old_element, void* new_element, void* data);
+
+/*
+ * functions to decide whether two elements hold the same thing
+ * data is any outside data you want to pass in to the function
+ */
+typedef bool (*phtree_equal_function_t) (void* element_a, void* element_b, void* data);
+
+/*
+ * functions run on regions of the tree
+ * 	a region is every point which shares the first prefix_length bits of every dimension with point
+ * 		the same as a ph3_query_prefix_set window
+ * data is any outside data you want to pass in to the function
+ */
+typedef void (*phtree_region_function_t) (void* point, int prefix_length, void* data);
+
+/*
+ * functions used by ph3_save and ph3_load to move bytes in and out of a stream
+ * 	stream is whatever was passed in to ph3_save/ph3_load
+ * return false if size bytes could not be written/read
+ */
+typedef bool (*phtree_write_function_t) (void* stream, const void* bytes, size_t size);
+typedef bool (*phtree_read_function_t) (void* stream, void* bytes, size_t size);
+
+/*
+ * functions to write an element when saving a tree
+ * 	use write/stream to write however many bytes the element needs
+ * return false if the element could not be written
+ * data is any outside data you want to pass in to the function
+ */
+typedef bool (*phtree_element_save_function_t) (void* element, phtree_write_function_t write, void* stream, void* data);
+
+/*
+ * functions to read an element back when loading a tree
+ * 	use read/stream to read the bytes the save function wrote
+ * return the new element, or NULL if it could not be read
+ * data is any outside data you want to pass in to the function
+ */
+typedef void* (*phtree_element_load_function_t) (phtree_read_function_t read, void* stream, void* data);
+
+// the version of the format written by _save, _load only reads this version
+#define PHTREE_FILE_VERSION 1
+
 /*
  * end common section
  */
@@ -86,6 +154,14 @@ typedef struct ph3_node_t
 	int8_t infix_length;
 	// counts how many nodes/layers are below this node
 	int8_t postfix_length;
+#ifdef PHTREE_HASHES
+	/*
+	 * for entries, the hash of the point and the element's fingerprint
+	 * for nodes, the sum of the hashes of every entry under the node
+	 * 	not kept for the root
+	 */
+	uint64_t hash;
+#endif
 } ph3_node_t;
 
 /*
@@ -151,6 +227,21 @@ typedef struct ph3_t
 	 * DO NOT free the node being passed in
 	 */
 	void (*node_children_free) (ph3_node_t* node);
+
+	/*
+	 * children arrays kept by ph3_reset to be reused
+	 * 	new nodes take their children arrays from here before calling node_children_malloc
+	 * 	ph3_clear frees everything in here with node_children_free
+	 */
+	ph3_node_t* recycled_children;
+#ifdef PHTREE_HASHES
+	/*
+	 * optional, set with ph3_hash_enable
+	 * 	a fingerprint of an element's contents
+	 * while this is set every node's hash is kept up to date as the tree changes
+	 */
+	uint64_t (*element_hash) (void* element);
+#endif
 } ph3_t;
 
 typedef struct ph3_query_t
@@ -217,6 +308,19 @@ ph3_t ph3_create (
  */
 void ph3_clear (ph3_t* tree);
 
+/*
+ * remove all entries/elements from the tree
+ * 	elements are destroyed with element_destroy
+ * 	but the children arrays of the tree's nodes are kept in a recycle pool
+ * 		which nodes created afterwards take their children arrays from
+ *
+ * when a tree is rebuilt from scratch over and over (every frame for example)
+ * 	use ph3_reset instead of ph3_clear
+ * 		and rebuilding the tree will stop allocating once the pool is big enough
+ * ph3_clear frees the recycle pool
+ */
+void ph3_reset (ph3_t* tree);
+
 /*
  * run function on every element in the tree
  *
@@ -232,6 +336,39 @@ void ph3_for_each (ph3_t* tree, phtree_iteration_function_t function, void* data
  * index is whatever you are using to determine the spatial index of what you are inserting
  */
 void* ph3_insert (ph3_t* tree, ph3_point_t* point, void* element);
+/*
+ * insert count elements into the tree
+ * 	the same as calling ph3_insert on every point
+ * 		but much faster for large batches
+ *
+ * inputs[i] is passed to element_create for points[i]
+ * 	inputs can be NULL, in which case element_create gets NULL
+ * out_elements[i] is set to the element at points[i]
+ * 	out_elements can be NULL
+ *
+ * if a point appears more than once in the batch
+ * 	only the first one creates an element
+ * 		and every duplicate gets that element in out_elements
+ *
+ * the batch is sorted in z-order and inserted in a single pass
+ * 	so the path through the tree is shared between consecutive points
+ * 		and each children array is grown at most once per batch
+ */
+void ph3_insert_batch (ph3_t* tree, ph3_point_t* points, void** inputs, size_t count, void** out_elements);
+/*
+ * build the tree from an array of points
+ * 	the resulting tree is the same as inserting every point with ph3_insert
+ *
+ * inputs[i] is passed to element_create for points[i]
+ * 	inputs can be NULL, in which case element_create gets NULL
+ * duplicate points only create an element for the first of the duplicates
+ *
+ * the points are sorted in z-order and the tree is built bottom up
+ * 	every children array is allocated once at its final size
+ * this only works on an empty tree
+ * 	if the tree already has entries this falls back to ph3_insert_batch
+ */
+void ph3_build (ph3_t* tree, ph3_point_t* points, void** inputs, size_t count);
 /*
  * find an element in the tree at index
  *
@@ -243,6 +380,141 @@ void* ph3_find (ph3_t* tree, ph3_point_t* index);
  * remove an element from the tree
  */
 void ph3_remove (ph3_t* tree, ph3_point_t* point);
+/*
+ * move the element at from to to
+ * 	the element is not destroyed and created again
+ *
+ * returns the element
+ * returns NULL if there is no element at from or there is already an element at to
+ * 	in which case nothing changes
+ */
+void* ph3_relocate (ph3_t* tree, ph3_point_t* from, ph3_point_t* to);
+/*
+ * remove every element for which predicate returns true
+ * 	removed elements are destroyed with element_destroy
+ *
+ * if query is not NULL only the elements inside of the query window are checked
+ * 	the query's iteration function is not used and can be NULL
+ * if query is NULL every element in the tree is checked
+ *
+ * this is a single pass over the tree
+ * 	each node's children are compacted once
+ * 		instead of once per removed element like with repeated ph3_remove
+ */
+void ph3_remove_if (ph3_t* tree, ph3_query_t* query, phtree_predicate_function_t predicate, void* data);
+/*
+ * remove every element inside of the query window
+ * 	removed elements are destroyed with element_destroy
+ * 	the query's iteration function is not used and can be NULL
+ *
+ * subtrees which are entirely inside of the window are detached and freed whole
+ * 	only the nodes on the border of the window are edited entry by entry
+ */
+void ph3_erase_window (ph3_t* tree, ph3_query_t* query);
+
+/*
+ * move every element of source in to destination
+ * 	source is left empty
+ *
+ * when both trees have an element at the same point
+ * 	conflict decides which element is kept
+ * 		the element which is not kept is destroyed by the tree it came from
+ * 	if conflict is NULL the destination's element is kept
+ * data is passed in to conflict
+ *
+ * the trees are walked together
+ * 	subtrees of source which do not overlap destination are moved over whole
+ * 		without copying or re-inserting anything under them
+ * this only works if both trees use the same node_children_* functions
+ * 	if they do not, the elements are moved over one at a time
+ *
+ * destination's element_destroy will be used on elements which came from source
+ * 	so both trees should store the same kind of element
+ */
+void ph3_merge (ph3_t* destination, ph3_t* source, phtree_merge_function_t conflict, void* data);
+
+/*
+ * move every element inside of the query window from tree in to out_tree
+ * 	the query's iteration function is not used and can be NULL
+ * 	use ph3_query_prefix_set to split off everything under a hypercube prefix
+ *
+ * out_tree must be initialized, it does not need to be empty
+ * 	if out_tree already has an element at a moved point, out_tree's element is kept
+ *
+ * subtrees which are entirely inside of the window are moved over whole
+ * 	only the nodes on the border of the window are rebuilt entry by entry
+ * this only works if both trees use the same node_children_* functions
+ * 	if they do not, the elements are moved over one at a time
+ */
+void ph3_split (ph3_t* tree, ph3_query_t* query, ph3_t* out_tree);
+
+/*
+ * report how new_tree differs from old_tree
+ * 	added is run on entries only in new_tree, removed on entries only in old_tree
+ * 	changed is run on entries in both whose elements are not equal
+ * 		if equal is NULL elements are equal when they are the same pointer
+ * 	any of the functions can be NULL
+ * data is passed in to every function
+ *
+ * the trees are walked together
+ * 	children arrays shared by both trees are skipped without looking inside of them
+ * 		so diffing two ph3_ts_snapshot_t of the same tree only visits the paths which changed between them
+ * 	subtrees found in only one of the trees are reported without comparing anything
+ * 	with PHTREE_HASHES, if both trees have hashes subtrees with the same hash are skipped too
+ * 		so entries whose elements have the same fingerprint are not reported as changed
+ * neither tree is changed
+ */
+void ph3_diff (ph3_t* old_tree, ph3_t* new_tree, phtree_diff_function_t added, phtree_diff_function_t removed, phtree_diff_function_t changed, phtree_equal_function_t equal, void* data);
+
+#ifdef PHTREE_HASHES
+/*
+ * hashes
+ * 	only available when compiled with PHTREE_HASHES
+ *
+ * every node keeps the sum of the hashes of the entries under it
+ * 	an entry's hash mixes its point with element_hash of its element
+ * 	so two subtrees holding the same points and elements have the same hash, whatever their shape
+ * inserts, removes and relocates update the hashes on their path
+ * 	batch inserts update the paths of their points
+ * 	remove_if, erase_window and split recompute the nodes which overlap their window
+ * 	build, merge and load recompute the whole tree
+ * elements changed in place need ph3_hash_update
+ * 	and trees changed through ph3_remove_child/_remove_entry or their nodes need ph3_hash_enable again
+ *
+ * the hashes are not cryptographic, they are for finding differences, not for trusting what is found
+ */
+
+/*
+ * start keeping hashes, with element_hash as the fingerprint of an element, and compute them for the whole tree
+ * 	NULL stops keeping them
+ */
+void ph3_hash_enable (ph3_t* tree, uint64_t (*element_hash) (void* element));
+/*
+ * recompute the hash of the entry at point, and of the nodes above it
+ * 	after its element was changed in place
+ */
+void ph3_hash_update (ph3_t* tree, ph3_point_t* point);
+/*
+ * the hash of every entry in the tree
+ * 	0 for an empty tree, or a tree without hashes
+ */
+uint64_t ph3_hash (ph3_t* tree);
+/*
+ * the hash of every entry which shares the first prefix_length bits of every dimension with point
+ * 	two trees agree inside of the region if these are the same
+ * 		so replicas in different processes can compare regions by exchanging these
+ */
+uint64_t ph3_hash_prefix (ph3_t* tree, ph3_point_t* point, int prefix_length);
+/*
+ * find the regions in which tree_a and tree_b differ
+ * 	function is run on each of them, regions never overlap
+ * 	copying the entries of every region from one tree to the other makes them agree
+ * only subtrees whose hashes differ are walked
+ * 	so the work is proportional to the differences, not to the size of the trees
+ * both trees need hashes, with element_hash functions which agree on equal elements
+ */
+void ph3_sync_plan (ph3_t* tree_a, ph3_t* tree_b, phtree_region_function_t function, void* data);
+#endif
 /*
  * check if the tree is empty
  *
@@ -250,6 +522,232 @@ void ph3_remove (ph3_t* tree, ph3_point_t* point);
  */
 bool ph3_empty (ph3_t* tree);
 
+/*
+ * write the whole tree to a stream
+ * 	the nodes are written depth first with their active_children, infix/postfix lengths and points
+ * 		then each element is written with element_save
+ * 	the format is versioned by PHTREE_FILE_VERSION
+ * 		and records the bit width, dimensions, depth and byte order of the tree
+ * 			so it can only be loaded by a tree of the same kind on a machine of the same byte order
+ *
+ * write is called many times with a few bytes, so the stream should be buffered
+ * returns false if write or element_save failed
+ */
+bool ph3_save (ph3_t* tree, phtree_write_function_t write, void* stream, phtree_element_save_function_t element_save, void* data);
+/*
+ * replace the contents of tree with a tree written by ph3_save
+ * 	tree must be initialized, anything already in it is cleared
+ *
+ * the nodes are rebuilt as they are read, without going through insert
+ * 	every children array is allocated once at exactly its number of children
+ * elements are created by element_load, not element_create
+ *
+ * read is only asked for the bytes that were written, nothing past the end of the tree
+ * returns false if the stream is not a tree of this kind, is corrupt, or element_load failed
+ * 	the tree is left empty in that case
+ */
+bool ph3_load (ph3_t* tree, phtree_read_function_t read, void* stream, phtree_element_load_function_t element_load, void* data);
+/*
+ * ph3_save/ph3_load to and from the file at path
+ * 	not available when compiled with PHTREE_NO_STDLIB
+ */
+bool ph3_save_file (ph3_t* tree, const char* path, phtree_element_save_function_t element_save, void* data);
+bool ph3_load_file (ph3_t* tree, const char* path, phtree_element_load_function_t element_load, void* data);
+
+/*
+ * the same as ph3_save/ph3_load, in a smaller format
+ * 	every node only stores the bits of its point which are not already given by its parent
+ * 		bit packed, with infix lengths in a variable length code
+ * 	entries only store their element
+ * 	the tree's shape goes first, then the elements in the same order ph3_save writes them
+ * loading builds the nodes straight from the bits, with every children array allocated at its final size
+ */
+bool ph3_save_compressed (ph3_t* tree, phtree_write_function_t write, void* stream, phtree_element_save_function_t element_save, void* data);
+bool ph3_load_compressed (ph3_t* tree, phtree_read_function_t read, void* stream, phtree_element_load_function_t element_load, void* data);
+bool ph3_save_compressed_file (ph3_t* tree, const char* path, phtree_element_save_function_t element_save, void* data);
+bool ph3_load_compressed_file (ph3_t* tree, const char* path, phtree_element_load_function_t element_load, void* data);
+
+/*
+ * mapped trees
+ *
+ * a ph3_mapped_t is a read only tree which is used straight from the bytes of a file
+ * 	so a file can be mmap'ed and queried without loading anything
+ * 		and every process mapping the same file shares one copy of it in the page cache
+ *
+ * the file is written by ph3_mapped_write
+ * 	every children array is a contiguous array of ph3_mapped_node_t
+ * 		laid out breadth first
+ * 	nodes point to their children, and entries to their elements, with offsets from the start of the file
+ * 		so the file works wherever it is mapped
+ * 	elements are the bytes element_save wrote, each starting on an 8 byte boundary
+ *
+ * the elements given to find/query/for_each point in to the file
+ * 	they are read only, a mapping made by ph3_mapped_open faults if they are written to
+ *
+ * like ph3_save, a file can only be used by a tree of the same kind on a machine of the same byte order
+ */
+typedef struct ph3_mapped_node_t
+{
+	ph3_point_t point;
+	/*
+	 * for nodes, where the children array starts
+	 * for entries, where the element starts
+	 * 	in bytes from the start of the file
+	 */
+	uint64_t offset;
+	uint8_t active_children;
+	int8_t child_count;
+	int8_t infix_length;
+	int8_t postfix_length;
+} ph3_mapped_node_t;
+
+typedef struct ph3_mapped_t
+{
+	// the whole file
+	uint8_t* base;
+	size_t size;
+
+	ph3_mapped_node_t* root;
+	uint64_t node_count;
+	uint64_t entry_count;
+
+	// how ph3_mapped_open got the file in to memory, so ph3_mapped_close can undo it
+	bool mapped;
+	bool allocated;
+} ph3_mapped_t;
+
+/*
+ * write tree in the mapped format
+ * 	write/element_save work like they do for ph3_save
+ * returns false if write or element_save failed, or memory for the layout could not be allocated
+ * 	not available when compiled with PHTREE_NO_STDLIB
+ */
+bool ph3_mapped_write (ph3_t* tree, phtree_write_function_t write, void* stream, phtree_element_save_function_t element_save, void* data);
+bool ph3_mapped_write_file (ph3_t* tree, const char* path, phtree_element_save_function_t element_save, void* data);
+
+/*
+ * use size bytes at bytes, written by ph3_mapped_write, as a tree
+ * 	bytes must be 8 byte aligned, and stay alive and unchanged while the tree is in use
+ * only the header is checked here, so this takes the same time for any size of file
+ * 	offsets are bounds checked as the tree is walked
+ * returns false if the bytes are not a mapped tree of this kind
+ */
+bool ph3_mapped_open_memory (ph3_mapped_t* mapped, void* bytes, size_t size);
+/*
+ * mmap the file at path read only and use it as a tree
+ * 	on systems without mmap the file is read in to memory instead
+ * 	not available when compiled with PHTREE_NO_STDLIB
+ */
+bool ph3_mapped_open (ph3_mapped_t* mapped, const char* path);
+/*
+ * unmap or free what ph3_mapped_open mapped or read
+ * 	does nothing else for trees from ph3_mapped_open_memory
+ */
+void ph3_mapped_close (ph3_mapped_t* mapped);
+
+/*
+ * the same as the ph3_ functions of the same name
+ */
+void* ph3_mapped_find (ph3_mapped_t* mapped, ph3_point_t* point);
+void ph3_mapped_query (ph3_mapped_t* mapped, ph3_query_t* query, void* data);
+void ph3_mapped_for_each (ph3_mapped_t* mapped, phtree_iteration_function_t function, void* data);
+
+/*
+ * paged trees
+ * 	not available when compiled with PHTREE_NO_STDLIB
+ *
+ * a ph3_paged_t is a read only tree for files bigger than memory
+ * 	the top pinned_depth levels are read in to memory when the file is opened
+ * 	the subtrees below them live in fixed size pages of the file
+ * 		which find/query/for_each read on demand in to a cache of cache_pages pages
+ * 		pages are evicted with the clock algorithm when the cache is full
+ *
+ * the file is written by ph3_paged_write
+ * 	nodes are ph3_mapped_node_t, with offsets from the start of the file like mapped trees
+ * 	children arrays are packed in to pages depth first, children before their parents
+ * 		so a subtree small enough for a page is read with one page
+ * 	a leaf's elements are in the same page as its entries
+ *
+ * the elements given to query/for_each functions point in to the cache
+ * 	and are only valid until the function returns
+ * 	the one returned by find is valid until the next call on the paged tree
+ *
+ * a ph3_paged_t is not thread safe, open the file once per thread instead
+ * like ph3_save, a file can only be used by a tree of the same kind on a machine of the same byte order
+ */
+typedef struct ph3_paged_t
+{
+	// the pinned levels, read in by ph3_paged_open
+	uint8_t* top;
+	uint64_t top_offset;
+	uint64_t top_size;
+	ph3_mapped_node_t root;
+
+	uint64_t node_count;
+	uint64_t entry_count;
+	uint32_t page_size;
+	uint64_t page_count;
+
+	// the cache
+	uint8_t* frames;
+	size_t frame_count;
+	size_t frames_used;
+	size_t hand;
+	uint64_t* frame_pages;
+	uint8_t* frame_referenced;
+	// the frame each page is in, or UINT32_MAX
+	uint32_t* page_frames;
+
+	// a file descriptor where pread is available, otherwise a FILE*
+	int descriptor;
+	void* file;
+
+	// page lookups served from the cache, and read from the file
+	uint64_t page_hits;
+	uint64_t page_reads;
+	// a page could not be read, so results since the last open may be missing points
+	bool failed;
+} ph3_paged_t;
+
+// the defaults for a page_size, pinned_depth or cache_pages of 0
+#ifndef PHTREE_PAGE_SIZE
+#define PHTREE_PAGE_SIZE 65536
+#endif
+#ifndef PHTREE_PAGED_DEPTH
+#define PHTREE_PAGED_DEPTH 2
+#endif
+#ifndef PHTREE_PAGED_CACHE
+#define PHTREE_PAGED_CACHE 1024
+#endif
+
+/*
+ * write tree in the paged format
+ * 	write/element_save work like they do for ph3_save
+ * 	page_size is in bytes, a multiple of 8
+ * 	the children arrays of nodes less than pinned_depth levels below the root are pinned in memory
+ * 		0 pages every level, the root's children included
+ * 		pass -1 for PHTREE_PAGED_DEPTH
+ * returns false if write or element_save failed, memory could not be allocated
+ * 	or a children array and its elements do not fit in one page
+ */
+bool ph3_paged_write (ph3_t* tree, phtree_write_function_t write, void* stream, phtree_element_save_function_t element_save, void* data, uint32_t page_size, int pinned_depth);
+bool ph3_paged_write_file (ph3_t* tree, const char* path, phtree_element_save_function_t element_save, void* data, uint32_t page_size, int pinned_depth);
+
+/*
+ * open the file at path, written by ph3_paged_write, with a cache of cache_pages pages
+ * 	reads the pinned levels, and nothing else
+ * returns false if the file could not be read, is not a paged tree of this kind, or memory could not be allocated
+ */
+bool ph3_paged_open (ph3_paged_t* paged, const char* path, size_t cache_pages);
+void ph3_paged_close (ph3_paged_t* paged);
+
+/*
+ * the same as the ph3_ functions of the same name
+ */
+void* ph3_paged_find (ph3_paged_t* paged, ph3_point_t* point);
+void ph3_paged_query (ph3_paged_t* paged, ph3_query_t* query, void* data);
+void ph3_paged_for_each (ph3_paged_t* paged, phtree_iteration_function_t function, void* data);
+
 /*
  * run a query on the tree
  *
@@ -268,6 +766,12 @@ void ph3_query (ph3_t* tree, ph3_query_t* query, void* data);
  */
 ph3_query_t ph3_query_create (void* min, void* max, phtree_iteration_function_t function);
 void ph3_query_set (ph3_query_t* query, ph3_point_t* min, ph3_point_t* max, phtree_iteration_function_t function);
+/*
+ * set up a query for every point which shares the first prefix_length bits of every dimension with point
+ * 	prefix_length 0 is the whole tree
+ * 	prefix_length 16 is only point
+ */
+void ph3_query_prefix_set (ph3_query_t* query, ph3_point_t* point, int prefix_length, phtree_iteration_function_t function);
 void ph3_query_clear (ph3_query_t* query);
 
 /*
@@ -275,4 +779,701 @@ void ph3_query_clear (ph3_query_t* query);
  */
 void ph3_point_set (ph3_point_t* point, phtree_key_t a, phtree_key_t b, phtree_key_t c);
 
+/*
+ * buffered trees
+ * 	not available when compiled with PHTREE_NO_STDLIB
+ *
+ * a ph3_buffered_t is a tree with a buffer of changes in front of it
+ * 	inserts and removes go in to a small unsorted log without looking at the tree
+ * 	a full log is sorted in z-order and merged in to a sorted run
+ * 	a full run is applied to the tree in z-order in one pass
+ * so consecutive changes in a flush go down the same paths of the tree
+ * 	instead of jumping around it with every write
+ *
+ * there is at most one change buffered for every point
+ * 	a change to a point which already has one is folded in to it
+ * an insert keeps its input until the change is flushed or looked at
+ * 	then the element is created, if the tree does not already have one at point
+ * 	so ph3_buffered_insert does not return the element, use ph3_buffered_find for that
+ *
+ * find/query/for_each look at the buffer as well as the tree
+ * 	they look up the tree's element at the point of each change they meet
+ * 		which is only done once per change
+ * 	elements in the buffer are visited after the tree's, so query results are not in z-order
+ * use ph3_buffered_flush before using the tree member directly
+ */
+typedef struct ph3_buffered_change_t
+{
+	ph3_point_t point;
+	// the input given to the insert, until its element is created
+	void* input;
+	// the element inserted at point, once it is created
+	void* element;
+	// the element the tree has at point, once the change is resolved
+	void* shadowed;
+	// the change inserts at point
+	bool insert;
+	// the change removes the tree's element at point, before any insert
+	bool remove;
+	// shadowed has been looked up
+	bool resolved;
+} ph3_buffered_change_t;
+
+typedef struct ph3_buffered_t
+{
+	ph3_t tree;
+
+	ph3_buffered_change_t* log;
+	size_t log_count;
+	size_t log_capacity;
+	/*
+	 * a hash of the points in the log, so a change does not look through the whole log
+	 * 	holds log positions + 1, 0 is empty
+	 * 	open addressing, log_index_capacity is a power of 2
+	 */
+	uint32_t* log_index;
+	size_t log_index_capacity;
+
+	// in z-order, merged with the sorted log when the log is full
+	ph3_buffered_change_t* run;
+	// the changes before run_first have been applied to the tree
+	size_t run_first;
+	size_t run_count;
+	size_t run_capacity;
+	ph3_buffered_change_t* merged;
+
+	/*
+	 * the tree's elements which resolved changes remove, so queries can skip them
+	 * 	open addressing, shadowed_capacity is a power of 2
+	 */
+	void** shadowed;
+	size_t shadowed_count;
+	size_t shadowed_capacity;
+
+	uint64_t flushes;
+} ph3_buffered_t;
+
+// the sizes ph3_buffered_initialize uses for a log_capacity or run_capacity of 0
+#ifndef PHTREE_BUFFER_LOG
+#define PHTREE_BUFFER_LOG 4096
+#endif
+#ifndef PHTREE_BUFFER_RUN
+#define PHTREE_BUFFER_RUN 16384
+#endif
+// how many changes from the run every buffered insert or remove applies to the tree, once the run is nearly full
+#ifndef PHTREE_BUFFER_STEP
+#define PHTREE_BUFFER_STEP 2
+#endif
+
+/*
+ * takes the same functions as ph3_initialize
+ * 	log_capacity is how many changes are kept unsorted
+ * 		every time the log is full it is merged in to the run
+ * 	run_capacity is how many changes are kept before they are applied to the tree
+ *
+ * the run is not applied all at once
+ * 	once it holds run_capacity - log_capacity changes, every new change applies PHTREE_BUFFER_STEP changes
+ * 		from the front of the run to the tree, in z-order, so a write costs at most that many tree changes
+ * 	the longest pause is the write which fills the log
+ * 		it sorts the log and merges it in to the run, copying up to log_capacity + run_capacity changes
+ * 		with the default sizes that is about 1 to 2 milliseconds once every log_capacity writes
+ * 		a log of 1024 changes pauses for under a millisecond, but merges four times as often
+ *
+ * returns false if the buffer could not be allocated
+ */
+bool ph3_buffered_initialize (
+	ph3_buffered_t* tree,
+	size_t log_capacity,
+	size_t run_capacity,
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void* element),
+	ph3_node_t* (*node_children_malloc) (ph3_node_t* node),
+	ph3_node_t* (*node_children_expand) (ph3_node_t* node),
+	ph3_node_t* (*node_children_shrink) (ph3_node_t* node),
+	void (*node_children_free) (ph3_node_t* node));
+/*
+ * destroy the tree and every element in it or its buffer
+ */
+void ph3_buffered_destroy (ph3_buffered_t* tree);
+
+/*
+ * apply every buffered change to the tree
+ * 	this pauses the caller for as long as inserting every buffered change in to the tree
+ * 		up to log_capacity + run_capacity changes, which with the default sizes is tens of milliseconds
+ */
+void ph3_buffered_flush (ph3_buffered_t* tree);
+
+/*
+ * buffer an insert of input at point
+ * 	which does nothing if point already has an element when the change is resolved
+ */
+void ph3_buffered_insert (ph3_buffered_t* tree, ph3_point_t* point, void* input);
+
+/*
+ * the same as the ph3_ functions of the same name
+ */
+void ph3_buffered_remove (ph3_buffered_t* tree, ph3_point_t* point);
+void* ph3_buffered_find (ph3_buffered_t* tree, ph3_point_t* point);
+void ph3_buffered_query (ph3_buffered_t* tree, ph3_query_t* query, void* data);
+void ph3_buffered_for_each (ph3_buffered_t* tree, phtree_iteration_function_t function, void* data);
+
+/*
+ * write ahead logs
+ * 	not available when compiled with PHTREE_NO_STDLIB
+ *
+ * a ph3_wal_t makes the changes to a tree durable without saving the whole tree every time
+ * 	ph3_wal_insert/_remove/_relocate change the tree and append a record of the change to the log file
+ * 	records are buffered and written with a single fsync for every group_size changes (group commit)
+ * 		a change is durable once a commit including it has returned
+ * 		ph3_wal_commit commits everything so far
+ *
+ * ph3_wal_checkpoint saves the whole tree as a snapshot and starts the log over
+ * ph3_wal_open loads the last snapshot and replays the log on top of it
+ * 	runs of inserts in the log are replayed with ph3_insert_batch
+ * 	a record which was only partly written when the process died ends the log and is cut off
+ *
+ * snapshots and logs carry a generation number, and a log is only replayed on the snapshot it follows
+ * 	so a crash part way through a checkpoint never replays changes twice
+ *
+ * elements are written with element_save and read back with element_load
+ * 	like ph3_save, the files only work for a tree of the same kind on a machine of the same byte order
+ */
+typedef struct ph3_wal_t
+{
+	ph3_t* tree;
+	// a FILE*
+	void* file;
+	char* path;
+	char* snapshot_path;
+
+	phtree_element_save_function_t element_save;
+	phtree_element_load_function_t element_load;
+	void* data;
+
+	// records which have not been written to the file yet
+	uint8_t* buffer;
+	size_t buffer_size;
+	size_t buffer_capacity;
+
+	size_t group_size;
+	// changes since the last commit
+	size_t pending;
+	uint64_t generation;
+	// records in the log, including the ones replayed by ph3_wal_open
+	uint64_t records;
+	uint64_t commits;
+
+	/*
+	 * a record could not be written, so the log no longer matches the tree
+	 * 	commits return false until a ph3_wal_checkpoint succeeds
+	 */
+	bool failed;
+} ph3_wal_t;
+
+// the group_size ph3_wal_open uses for a group_size of 0
+#ifndef PHTREE_WAL_GROUP
+#define PHTREE_WAL_GROUP 1024
+#endif
+
+/*
+ * clear tree, load it from the snapshot at snapshot_path and replay the log at path on top of it
+ * 	a missing snapshot is an empty tree, a missing log is created
+ * 	group_size is how many changes are committed together
+ *
+ * returns false if a file could not be read or created, or is not a snapshot/log of this kind of tree
+ * 	or element_load failed, in which case the tree is left with what could be loaded
+ */
+bool ph3_wal_open (
+	ph3_wal_t* wal,
+	ph3_t* tree,
+	const char* path,
+	const char* snapshot_path,
+	phtree_element_save_function_t element_save,
+	phtree_element_load_function_t element_load,
+	void* data,
+	size_t group_size);
+/*
+ * commit and close the log
+ * 	the tree is left as it is
+ * returns false if the last commit failed
+ */
+bool ph3_wal_close (ph3_wal_t* wal);
+
+/*
+ * the same as the ph3_ functions of the same name, with the change logged
+ * 	changes which do nothing are not logged
+ */
+void* ph3_wal_insert (ph3_wal_t* wal, ph3_point_t* point, void* input);
+void ph3_wal_remove (ph3_wal_t* wal, ph3_point_t* point);
+void* ph3_wal_relocate (ph3_wal_t* wal, ph3_point_t* from, ph3_point_t* to);
+
+/*
+ * write and fsync every buffered record
+ * returns false if that failed
+ */
+bool ph3_wal_commit (ph3_wal_t* wal);
+/*
+ * save the tree as the next snapshot and empty the log
+ * 	the snapshot is written next to snapshot_path and renamed over it
+ * returns false if the snapshot could not be written, the old snapshot and log are still valid then
+ * 	or if the log could not be started over, a later checkpoint tries again
+ */
+bool ph3_wal_checkpoint (ph3_wal_t* wal);
+
+#ifdef PHTREE_THREADS
+/*
+ * thread safe trees
+ * 	only available when compiled with PHTREE_THREADS defined
+ * 		and linked with pthreads
+ *
+ * a ph3_ts_t is a tree with a lock on the root
+ * 	and a lock for each child of the root (a partition)
+ * inserts and removes only lock the partition their point is in
+ * 	so writers in different partitions do not block each other
+ * 		unless they add or remove a child of the root
+ * everything else (clear/insert_batch/remove_if/...) locks the whole tree
+ *
+ * find and query do not lock anything
+ * 	every partition has a version which writers bump before and after changing it
+ * 	readers walk the tree optimistically and check the version at every step
+ * 		retrying if a writer got in the way
+ * 	after a few retries, or if a query finds too many elements, the partition is read locked instead
+ * for_each always read locks one partition at a time
+ *
+ * so that optimistic readers never touch freed memory
+ * 	children arrays and elements which are removed from the tree are not freed right away
+ * 		they are retired, and freed by a later write once no reader can still be looking at them
+ * 	readers announce themselves in one of PHTREE_TS_READERS reader slots
+ * 		if every slot is busy a reader takes the locks instead
+ *
+ * because several threads can be writing at once
+ * 	the tree's element and node_children_ functions need to be thread safe
+ * the tree's recycle pool is freed whenever the whole tree is unlocked
+ *
+ * a snapshot is a read only copy of the tree at the moment it was taken
+ * 	which stays the same while the tree keeps changing
+ * while any snapshot is alive
+ * 	inserts and removes copy the children arrays on the path from the root to their point
+ * 		instead of changing them in place (path copying)
+ * 	and the arrays and elements they replace are kept until the snapshots are released
+ * with no snapshots alive the tree is changed in place as usual
+ *
+ * elements returned by ph3_ts_find and ph3_ts_insert
+ * 	are only guaranteed to be alive while nothing removes them
+ * 		use ph3_ts_find_apply or the read_lock functions
+ * 			if another thread might be removing the element
+ *
+ * iteration/query functions run while the tree is locked
+ * 	they must not call the ph3_ts_ functions of the same tree
+ */
+
+/*
+ * contention counters for a thread safe tree
+ * 	only contended lock acquisitions are counted
+ * 		so reading the tree does not write to any shared cache line besides the locks
+ */
+typedef struct ph3_ts_stats_t
+{
+	// how many times a read or write had to wait for a lock
+	uint64_t reads_contended;
+	uint64_t writes_contended;
+	// total time spent waiting for locks, in nanoseconds
+	uint64_t read_wait_nanoseconds;
+	uint64_t write_wait_nanoseconds;
+	// how many writes have been done on the tree
+	uint64_t writes;
+	// how many of those writes had to lock the whole tree
+	uint64_t exclusive_writes;
+	// how many times an optimistic read saw a writer and had to start over
+	uint64_t reads_retried;
+	// how many removed elements and children arrays are waiting to be freed
+	uint64_t retired;
+} ph3_ts_stats_t;
+
+// how many threads can be reading a thread safe tree without locking it at the same time
+#ifndef PHTREE_TS_READERS
+#define PHTREE_TS_READERS 128
+#endif
+
+/*
+ * an element or children array which has been removed from the tree
+ * 	but might still be seen by an optimistic reader
+ */
+typedef struct ph3_ts_retired_t
+{
+	void* pointer;
+	// the capacity of a children array, -1 for an element
+	int capacity;
+	// the tree's epoch when this was retired
+	uint64_t epoch;
+} ph3_ts_retired_t;
+
+typedef struct ph3_ts_retire_list_t
+{
+	ph3_ts_retired_t* items;
+	size_t count;
+	size_t capacity;
+	/*
+	 * try to free retired things once count reaches this
+	 * 	grows while snapshots keep things from being freed
+	 * 		so a long lived snapshot does not make every write scan the whole list
+	 */
+	size_t reclaim_at;
+} ph3_ts_retire_list_t;
+
+/*
+ * the epoch a reader entered the tree at, 0 when the slot is free
+ * 	each slot gets its own cache line so readers do not share one
+ */
+typedef struct ph3_ts_reader_t
+{
+	_Alignas (64) atomic_uint_least64_t epoch;
+} ph3_ts_reader_t;
+
+/*
+ * everything under one child of the root
+ * 	each partition gets its own cache line so writers in different partitions do not share one
+ */
+typedef struct ph3_ts_partition_t
+{
+	_Alignas (64) pthread_rwlock_t lock;
+	// odd while a writer is changing the partition
+	atomic_uint_least64_t version;
+	// only written while lock is write locked
+	uint64_t writes;
+	ph3_ts_retire_list_t retired;
+} ph3_ts_partition_t;
+
+typedef struct ph3_ts_t ph3_ts_t;
+typedef struct ph3_ts_t
+{
+	ph3_t tree;
+
+	/*
+	 * every operation holds the root lock for reading
+	 * 	while it is looking at the root's children array
+	 * only adding or removing a child of the root write locks it
+	 */
+	pthread_rwlock_t lock;
+	// odd while the whole tree is locked for writing
+	atomic_uint_least64_t version;
+	ph3_ts_partition_t partitions[1 << 3];
+
+	// retired while the whole tree was locked
+	ph3_ts_retire_list_t retired;
+	atomic_uint_least64_t epoch;
+	ph3_ts_reader_t readers[PHTREE_TS_READERS];
+	// how many snapshots are alive, writes copy their path while this is not 0
+	atomic_int snapshots;
+
+	/*
+	 * the functions the tree was initialized with
+	 * 	the tree itself is given functions which retire instead of freeing
+	 */
+	void (*element_destroy) (void* element);
+	ph3_node_t* (*node_children_malloc) (ph3_node_t* node);
+	ph3_node_t* (*node_children_expand) (ph3_node_t* node);
+	void (*node_children_free) (ph3_node_t* node);
+
+	atomic_uint_least64_t reads_retried;
+	atomic_uint_least64_t reads_contended;
+	atomic_uint_least64_t writes_contended;
+	atomic_uint_least64_t read_wait_nanoseconds;
+	atomic_uint_least64_t write_wait_nanoseconds;
+	// only written while the whole tree is locked
+	uint64_t exclusive_writes;
+} ph3_ts_t;
+
+/*
+ * takes the same arguments as ph3_initialize
+ *
+ * returns false if the locks could not be created
+ */
+bool ph3_ts_initialize (
+	ph3_ts_t* tree,
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void* element),
+	ph3_node_t* (*node_children_malloc) (ph3_node_t* node),
+	ph3_node_t* (*node_children_expand) (ph3_node_t* node),
+	ph3_node_t* (*node_children_shrink) (ph3_node_t* node),
+	void (*node_children_free) (ph3_node_t* node));
+/*
+ * clear the tree and destroy its locks
+ * 	no other thread may be using the tree
+ */
+void ph3_ts_destroy (ph3_ts_t* tree);
+
+/*
+ * the same as the ph3_ functions of the same name
+ * 	but safe to call from multiple threads
+ */
+void ph3_ts_clear (ph3_ts_t* tree);
+void* ph3_ts_insert (ph3_ts_t* tree, ph3_point_t* point, void* element);
+void ph3_ts_insert_batch (ph3_ts_t* tree, ph3_point_t* points, void** inputs, size_t count, void** out_elements);
+void ph3_ts_remove (ph3_ts_t* tree, ph3_point_t* point);
+void ph3_ts_remove_if (ph3_ts_t* tree, ph3_query_t* query, phtree_predicate_function_t predicate, void* data);
+void* ph3_ts_find (ph3_ts_t* tree, ph3_point_t* point);
+bool ph3_ts_empty (ph3_ts_t* tree);
+void ph3_ts_for_each (ph3_ts_t* tree, phtree_iteration_function_t function, void* data);
+void ph3_ts_query (ph3_ts_t* tree, ph3_query_t* query, void* data);
+
+/*
+ * run function on the element at point
+ * 	the element is not destroyed while function is using it
+ * 		even if another thread removes it in the meantime
+ *
+ * returns false if there is no element at point
+ */
+bool ph3_ts_find_apply (ph3_ts_t* tree, ph3_point_t* point, phtree_iteration_function_t function, void* data);
+
+/*
+ * lock the whole tree for doing several things at once
+ * 	use the returned ph3_t with the regular ph3_ functions
+ * 		until calling the matching unlock
+ * only call reading functions (find/query/for_each/empty) while read locked
+ */
+ph3_t* ph3_ts_read_lock (ph3_ts_t* tree);
+void ph3_ts_read_unlock (ph3_ts_t* tree);
+ph3_t* ph3_ts_write_lock (ph3_ts_t* tree);
+void ph3_ts_write_unlock (ph3_ts_t* tree);
+
+/*
+ * copy the tree's contention counters in to stats
+ */
+void ph3_ts_stats (ph3_ts_t* tree, ph3_ts_stats_t* stats);
+
+typedef struct ph3_ts_snapshot_t
+{
+	/*
+	 * the tree as it was when the snapshot was taken
+	 * 	use it with the regular ph3_ reading functions (find/query/for_each/...)
+	 * 		without any locking
+	 * !! never change it !!
+	 */
+	ph3_t tree;
+
+	ph3_ts_t* source;
+	ph3_ts_reader_t* reader;
+} ph3_ts_snapshot_t;
+
+/*
+ * take a snapshot of the tree
+ * 	a snapshot uses one of the tree's reader slots until it is released
+ * 		returns false if every slot is taken
+ *
+ * nothing removed from the tree after the snapshot was taken is freed until it is released
+ * 	so release snapshots when you are done with them
+ * while a snapshot is alive
+ * 	do not change the tree through ph3_ts_write_lock, only through the ph3_ts_ functions
+ * all snapshots must be released before ph3_ts_destroy
+ */
+bool ph3_ts_snapshot_take (ph3_ts_t* tree, ph3_ts_snapshot_t* snapshot);
+void ph3_ts_snapshot_release (ph3_ts_snapshot_t* snapshot);
+
+/*
+ * thread pools
+ * 	the same pool can be used by trees of every bit width and dimension
+ */
+#ifndef _phtree_pool_
+#define _phtree_pool_
+typedef struct phtree_pool_t phtree_pool_t;
+
+/*
+ * a job is run once on each of a pool's threads
+ * 	thread is 0 .. thread_count - 1
+ */
+typedef void (*phtree_job_function_t) (void* data, int thread);
+
+struct phtree_pool_t
+{
+	/*
+	 * run job on threads 0 .. thread_count - 1 and return once every one of them is done
+	 * 	the calling thread can be one of them
+	 *
+	 * to run the _parallel functions on your own threads
+	 * 	set run, thread_count and user_data yourself instead of using _pool_initialize
+	 */
+	void (*run) (phtree_pool_t* pool, phtree_job_function_t job, void* data);
+	int thread_count;
+	void* user_data;
+
+	/*
+	 * the pool started by _pool_initialize
+	 * 	thread 0 is the thread calling run, the rest are workers
+	 */
+	pthread_t* workers;
+	int workers_started;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t finish;
+	phtree_job_function_t job;
+	void* job_data;
+	uint64_t generation;
+	int running;
+	bool busy;
+	bool stopping;
+};
+#endif
+
+/*
+ * start a pool with thread_count threads, including the thread which calls run
+ * 	returns false if the threads could not be started
+ */
+bool ph3_pool_initialize (phtree_pool_t* pool, int thread_count);
+void ph3_pool_destroy (phtree_pool_t* pool);
+
+/*
+ * query/for_each using every thread of pool
+ *
+ * the tree is split in to tasks, the subtrees split_depth levels below the root
+ * 	1 is the children of the root
+ * 	deeper levels give more and smaller tasks, which balances skewed trees better
+ * 	0 picks the first depth with a few tasks per thread
+ * threads take the next task as they finish their last one
+ * 	so no thread sits idle while there are tasks left
+ *
+ * the iteration function is called from all of the pool's threads at the same time
+ * 	with thread_data[thread] as its data
+ * 		so every thread can collect in to its own buffer
+ * 	thread_data needs pool->thread_count entries, or can be NULL to pass NULL
+ * elements are visited in no particular order
+ *
+ * nothing can change the tree while this runs
+ * 	use a ph3_ts_snapshot_t or ph3_ts_read_lock for a thread safe tree
+ * with no pool or a single thread this is a regular query/for_each
+ */
+void ph3_query_parallel (ph3_t* tree, ph3_query_t* query, phtree_pool_t* pool, int split_depth, void** thread_data);
+void ph3_for_each_parallel (ph3_t* tree, phtree_iteration_function_t function, phtree_pool_t* pool, int split_depth, void** thread_data);
+
+/*
+ * ph3_build using every thread of pool
+ * 	the resulting tree is the same as the one ph3_build makes
+ *
+ * the points are split in to buckets by the first bits of their z-order key
+ * 	and every bucket is sorted on its own thread
+ * the top of the tree is built on the calling thread
+ * 	until there are a few subtrees per thread
+ * 		which are then built on the pool's threads
+ *
+ * element_create and the node_children_ functions are called from all of the pool's threads
+ * 	so they need to be thread safe
+ * with no pool, a single thread, or a tree which already has entries this is ph3_build
+ * 	not available when compiled with PHTREE_NO_STDLIB
+ */
+void ph3_build_parallel (ph3_t* tree, ph3_point_t* points, void** inputs, size_t count, phtree_pool_t* pool);
+
+/*
+ * sharded trees
+ *
+ * a ph3_sharded_t is 1 << shard_bits independent trees, each with its own lock
+ * 	points go to the shard given by the first shard_bits bits of their z-order key
+ * 		so every shard holds one box of the key space
+ * inserts/removes/finds lock only the shard of their point
+ * 	so threads working in different regions do not touch the same lock
+ * queries only visit the shards whose box overlaps the query window
+ * 	one shard at a time, in z-order
+ *
+ * the number of shards can be changed while the tree is in use with ph3_sharded_reshard
+ * 	every operation holds the shard table for reading
+ * 		and resharding locks it for writing
+ *
+ * the shards share the tree's element and node_children_ functions
+ * 	so they need to be thread safe
+ */
+typedef struct ph3_shard_t
+{
+	_Alignas (64) pthread_rwlock_t lock;
+	ph3_t tree;
+	// how many entries are in the shard
+	size_t count;
+	// only written while the shard is write locked
+	uint64_t writes;
+	atomic_uint_least64_t reads;
+} ph3_shard_t;
+
+typedef struct ph3_sharded_t
+{
+	pthread_rwlock_t lock;
+	ph3_shard_t* shards;
+	int shard_bits;
+
+	// what every shard is initialized with
+	void* (*element_create) (void* input);
+	void (*element_destroy) (void* element);
+	ph3_node_t* (*node_children_malloc) (ph3_node_t* node);
+	ph3_node_t* (*node_children_expand) (ph3_node_t* node);
+	ph3_node_t* (*node_children_shrink) (ph3_node_t* node);
+	void (*node_children_free) (ph3_node_t* node);
+
+	atomic_uint_least64_t writes_contended;
+	uint64_t reshards;
+} ph3_sharded_t;
+
+typedef struct ph3_sharded_stats_t
+{
+	int shard_count;
+	// entries in all of the shards, and in the fullest and emptiest shard
+	size_t size;
+	size_t largest_shard;
+	size_t smallest_shard;
+	uint64_t writes;
+	uint64_t reads;
+	// how many writes had to wait for their shard
+	uint64_t writes_contended;
+	uint64_t reshards;
+} ph3_sharded_stats_t;
+
+// the most shards a sharded tree can have is 1 << PHTREE_SHARD_BITS_MAX
+#ifndef PHTREE_SHARD_BITS_MAX
+#define PHTREE_SHARD_BITS_MAX 16
+#endif
+
+/*
+ * takes the same functions as ph3_initialize
+ * 	shard_bits is clamped to 0 .. PHTREE_SHARD_BITS_MAX
+ * 		and to the number of bits in a point
+ *
+ * returns false if the shards or their locks could not be created
+ */
+bool ph3_sharded_initialize (
+	ph3_sharded_t* tree,
+	int shard_bits,
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void* element),
+	ph3_node_t* (*node_children_malloc) (ph3_node_t* node),
+	ph3_node_t* (*node_children_expand) (ph3_node_t* node),
+	ph3_node_t* (*node_children_shrink) (ph3_node_t* node),
+	void (*node_children_free) (ph3_node_t* node));
+void ph3_sharded_destroy (ph3_sharded_t* tree);
+
+/*
+ * the same as the ph3_ functions of the same name
+ * 	but safe to call from multiple threads
+ *
+ * the element returned by ph3_sharded_find and ph3_sharded_insert
+ * 	is only guaranteed to be alive while nothing removes it
+ * 		use ph3_sharded_find_apply to work on an element under its shard's lock
+ */
+void* ph3_sharded_insert (ph3_sharded_t* tree, ph3_point_t* point, void* element);
+void ph3_sharded_remove (ph3_sharded_t* tree, ph3_point_t* point);
+void* ph3_sharded_find (ph3_sharded_t* tree, ph3_point_t* point);
+bool ph3_sharded_find_apply (ph3_sharded_t* tree, ph3_point_t* point, phtree_iteration_function_t function, void* data);
+void ph3_sharded_query (ph3_sharded_t* tree, ph3_query_t* query, void* data);
+void ph3_sharded_for_each (ph3_sharded_t* tree, phtree_iteration_function_t function, void* data);
+
+size_t ph3_sharded_size (ph3_sharded_t* tree);
+void ph3_sharded_stats (ph3_sharded_t* tree, ph3_sharded_stats_t* stats);
+
+/*
+ * change the number of shards to 1 << shard_bits
+ * 	more shards are made by splitting every shard in half with ph3_split
+ * 	fewer by merging pairs of shards with ph3_merge
+ * 		so no entry is copied or re-inserted unless it is on a shard border
+ * everything else waits while this runs
+ *
+ * returns false if the new shards could not be created, the old ones are kept in that case
+ */
+bool ph3_sharded_reshard (ph3_sharded_t* tree, int shard_bits);
+#endif
+
 #endif
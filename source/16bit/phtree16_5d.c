@@ -1,11 +1,52 @@
+// the thread safe trees use clock_gettime and glibc's writer preferring rwlocks
+#if defined (PHTREE_THREADS) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+// fileno, fsync and ftruncate for the write ahead logs, and pread for paged trees, which strict C modes hide
+#if !defined (PHTREE_NO_STDLIB) && (defined (__unix__) || defined (__APPLE__)) && !defined (_GNU_SOURCE) && !defined (_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
 #ifndef PHTREE_NO_STDLIB
+#include <stdio.h>
 #include <stdlib.h>
 #endif
 
+// mapped trees are mmap'ed, write ahead logs fsync'ed and paged trees pread, where that is available
+#if !defined (PHTREE_NO_STDLIB) && (defined (__unix__) || defined (__APPLE__))
+#define PHTREE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if !defined (PHTREE_NO_STDLIB) && defined (_WIN32)
+#include <io.h>
+#endif
+
+#ifdef PHTREE_THREADS
+#include <time.h>
+#endif
+
+// hypercube addresses of 32 and 64 bit keys are gathered with SSE2 where it is available, and those of 8 and 16 bit keys with a multiply
+// 	define PHTREE_NO_SIMD to use the loop over the dimensions
+#if !defined (PHTREE_NO_SIMD) && (defined (__SSE2__) || defined (_M_X64) || (defined (_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define PHTREE_SSE2
+#endif
+
+// window compares of 64 bit keys need the 64 bit compare from SSE4.2
+#if defined (PHTREE_SSE2) && (defined (__SSE4_2__) || defined (__AVX__))
+#include <nmmintrin.h>
+#define PHTREE_SSE42
+#endif
+
 #include "phtree16_5d.h"
 
 #if defined (_MSC_VER)
@@ -83,8 +124,12 @@ uint64_t phtree16_5d_popcount (uint64_t bit_string)
 	return (bit_string * h01) >> 56;
 }
 
-#if defined (__clang__) || defined (__GNUC__)
-#define count_leading_zeroes(bit_string) (0 ? 64U : __builtin_clzll (bit_string))
+#if (defined (__clang__) || defined (__GNUC__)) && (defined (__i386__) || defined (__x86_64__)) && !defined (__POPCNT__)
+// without -mpopcnt (or a -march which has it) __builtin_popcountll is a call in to libgcc, which child_index can not afford
+#define count_leading_zeroes(bit_string) ((bit_string) == 0 ? 64U : __builtin_clzll (bit_string))
+#define popcount phtree16_5d_popcount
+#elif defined (__clang__) || defined (__GNUC__)
+#define count_leading_zeroes(bit_string) ((bit_string) == 0 ? 64U : __builtin_clzll (bit_string))
 #define popcount __builtin_popcountll
 #elif defined (_MSC_VER)
 #define count_leading_zeroes(bit_string) msvc16_5d_count_leading_zeoes (bit_string)
@@ -135,6 +180,88 @@ uint64_t phtree16_5d_popcount (uint64_t bit_string)
 
 typedef unsigned int hypercube_address_t;
 
+/*
+ * window compares on whole points
+ * 	a point is loaded in to POINT_VECTORS registers, with the lanes after the last dimension zero
+ * 	SSE2 only compares signed lanes, so every lane has its sign bit flipped before comparing
+ * 		which orders the lanes as unsigned keys
+ * 64 bit lanes need SSE4.2, without it the loops are used
+ */
+#if defined (PHTREE_SSE2) && (PHTREE16_BIT_WIDTH != 64 || defined (PHTREE_SSE42))
+#define WINDOW_VECTORS
+
+#if PHTREE16_BIT_WIDTH == 8
+#define POINT_VECTORS 1
+#define lanes_set(key) _mm_set1_epi8 ((char) (key))
+#define lanes_greater _mm_cmpgt_epi8
+#elif PHTREE16_BIT_WIDTH == 16
+#define POINT_VECTORS 1
+#define lanes_set(key) _mm_set1_epi16 ((short) (key))
+#define lanes_greater _mm_cmpgt_epi16
+#elif PHTREE16_BIT_WIDTH == 32
+#define POINT_VECTORS ((DIMENSIONS + 3) / 4)
+#define lanes_set(key) _mm_set1_epi32 ((int) (key))
+#define lanes_greater _mm_cmpgt_epi32
+#else
+#define POINT_VECTORS ((DIMENSIONS + 1) / 2)
+#define lanes_set(key) _mm_set1_epi64x ((long long) (key))
+#define lanes_greater _mm_cmpgt_epi64
+#endif
+
+static void point_load (ph5_point_t* point, __m128i* vectors)
+{
+#if PHTREE16_BIT_WIDTH == 8
+	// key i in byte i, which compilers turn in to loads of the point
+	uint64_t keys = 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		keys |= (uint64_t) point->values[dimension] << (8 * dimension);
+	}
+
+	vectors[0] = _mm_set_epi64x (0, (long long) keys);
+#elif PHTREE16_BIT_WIDTH == 16
+	uint64_t keys = 0;
+	uint64_t high_keys = 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS && dimension < 4; dimension++)
+	{
+		keys |= (uint64_t) point->values[dimension] << (16 * dimension);
+	}
+
+	for (int dimension = 4; dimension < DIMENSIONS; dimension++)
+	{
+		high_keys |= (uint64_t) point->values[dimension] << (16 * (dimension - 4));
+	}
+
+	vectors[0] = _mm_set_epi64x ((long long) high_keys, (long long) keys);
+#elif PHTREE16_BIT_WIDTH == 32
+#if DIMENSIONS == 1
+	vectors[0] = _mm_cvtsi32_si128 ((int) point->values[0]);
+#elif DIMENSIONS == 2
+	vectors[0] = _mm_loadl_epi64 ((const __m128i*) point->values);
+#elif DIMENSIONS == 3
+	vectors[0] = _mm_unpacklo_epi64 (_mm_loadl_epi64 ((const __m128i*) point->values), _mm_cvtsi32_si128 ((int) point->values[2]));
+#else
+	vectors[0] = _mm_loadu_si128 ((const __m128i*) point->values);
+#endif
+#if DIMENSIONS == 5
+	vectors[1] = _mm_cvtsi32_si128 ((int) point->values[4]);
+#elif DIMENSIONS == 6
+	vectors[1] = _mm_loadl_epi64 ((const __m128i*) (point->values + 4));
+#endif
+#else
+	for (int iter = 0; iter < DIMENSIONS / 2; iter++)
+	{
+		vectors[iter] = _mm_loadu_si128 ((const __m128i*) (point->values + 2 * iter));
+	}
+
+#if DIMENSIONS % 2
+	vectors[DIMENSIONS / 2] = _mm_loadl_epi64 ((const __m128i*) (point->values + DIMENSIONS - 1));
+#endif
+#endif
+}
+#else
 /*
  * point_a >= point_b
  * 	_all_ of point_a's dimensions must be greater than or equal to point_b's dimensions
@@ -170,12 +297,13 @@ static bool point_less_equal (ph5_point_t* point_a, ph5_point_t* point_b)
 
 	return true;
 }
+#endif
 
 static bool point_equal (ph5_point_t* point_a, ph5_point_t* point_b)
 {
 	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
 	{
-		if (point_a->values[dimension] & ~(point_b->values[dimension]))
+		if (point_a->values[dimension] != point_b->values[dimension])
 		{
 			return false;
 		}
@@ -198,58 +326,210 @@ static bool prefix_equal (ph5_point_t* point_a, ph5_point_t* point_b, int postfi
 	return (point_equal (&local_a, &local_b));
 }
 
+
 /*
- * checks if all the bits before postfix_length are >=
- * 	used in window queries
+ * checks if point is inside of the window
  */
-static bool prefix_greater_equal (ph5_point_t* point_a, ph5_point_t* point_b, int postfix_length)
+static bool window_contains (ph5_query_t* window, ph5_point_t* point)
 {
-	ph5_point_t local_a = *point_a;
-	ph5_point_t local_b = *point_b;
-
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+#ifdef WINDOW_VECTORS
+	__m128i sign = lanes_set (PHTREE16_SIGN_BIT);
+	__m128i points[POINT_VECTORS];
+	__m128i min[POINT_VECTORS];
+	__m128i max[POINT_VECTORS];
+	__m128i outside = _mm_setzero_si128 ();
+
+	point_load (point, points);
+	point_load (&window->min, min);
+	point_load (&window->max, max);
+
+	for (int iter = 0; iter < POINT_VECTORS; iter++)
 	{
-		local_a.values[dimension] >>= postfix_length + 1;
-		local_b.values[dimension] >>= postfix_length + 1;
+		__m128i value = _mm_xor_si128 (points[iter], sign);
+
+		outside = _mm_or_si128 (outside, lanes_greater (_mm_xor_si128 (min[iter], sign), value));
+		outside = _mm_or_si128 (outside, lanes_greater (value, _mm_xor_si128 (max[iter], sign)));
 	}
 
-	return (point_greater_equal (&local_a, &local_b));
+	return _mm_movemask_epi8 (outside) == 0;
+#else
+	return (point_greater_equal (point, &window->min) && point_less_equal (point, &window->max));
+#endif
 }
 
 /*
- * checks if all the bits before postfix_length are <=
- * 	used in window queries
+ * checks if any point which could be under node is inside of the window
+ * 	all the bits before postfix_length are between those of the window's min and max
+ * 		which is the same as the node's lowest point being <= max and its highest point >= min
  */
-static bool prefix_less_equal (ph5_point_t* point_a, ph5_point_t* point_b, int postfix_length)
+static bool prefix_in_window (ph5_node_t* node, ph5_query_t* window)
 {
-	ph5_point_t local_a = *point_a;
-	ph5_point_t local_b = *point_b;
+	// the bits at and after postfix_length
+	// 	shifting twice so the root does not shift by the full bit width
+	phtree_key_t postfix_mask = ((PHTREE16_KEY_ONE << node->postfix_length) << 1) - 1;
+#ifdef WINDOW_VECTORS
+	__m128i sign = lanes_set (PHTREE16_SIGN_BIT);
+	__m128i mask = lanes_set (postfix_mask);
+	__m128i points[POINT_VECTORS];
+	__m128i min[POINT_VECTORS];
+	__m128i max[POINT_VECTORS];
+	__m128i outside = _mm_setzero_si128 ();
+
+	point_load (&node->point, points);
+	point_load (&window->min, min);
+	point_load (&window->max, max);
+
+	for (int iter = 0; iter < POINT_VECTORS; iter++)
+	{
+		__m128i lowest = _mm_xor_si128 (_mm_andnot_si128 (mask, points[iter]), sign);
+		__m128i highest = _mm_xor_si128 (_mm_or_si128 (points[iter], mask), sign);
+
+		outside = _mm_or_si128 (outside, lanes_greater (_mm_xor_si128 (min[iter], sign), highest));
+		outside = _mm_or_si128 (outside, lanes_greater (lowest, _mm_xor_si128 (max[iter], sign)));
+	}
 
+	return _mm_movemask_epi8 (outside) == 0;
+#else
 	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
 	{
-		local_a.values[dimension] >>= postfix_length + 1;
-		local_b.values[dimension] >>= postfix_length + 1;
+		if ((phtree_key_t) (node->point.values[dimension] & ~postfix_mask) > window->max.values[dimension]
+			|| (phtree_key_t) (node->point.values[dimension] | postfix_mask) < window->min.values[dimension])
+		{
+			return false;
+		}
 	}
 
-	return (point_less_equal (&local_a, &local_b));
+	return true;
+#endif
 }
 
-
-static bool prefix_in_window (ph5_node_t* node, ph5_query_t* window)
+static bool point_in_window (ph5_node_t* node, ph5_query_t* window)
 {
-	return (prefix_greater_equal (&node->point, &window->min, node->postfix_length) && prefix_less_equal (&node->point, &window->max, node->postfix_length));
+	return window_contains (window, &node->point);
 }
 
-static bool point_in_window (ph5_node_t* node, ph5_query_t* window)
+/*
+ * checks if every point which could be under node is inside of the window
+ */
+static bool node_in_window (ph5_node_t* node, ph5_query_t* window)
 {
-	return (point_greater_equal (&node->point, &window->min) && point_less_equal (&node->point, &window->max));
+	// the bits at and after postfix_length
+	// 	shifting twice so the root does not shift by the full bit width
+	phtree_key_t postfix_mask = ((PHTREE16_KEY_ONE << node->postfix_length) << 1) - 1;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		if ((phtree_key_t) (node->point.values[dimension] & ~postfix_mask) < window->min.values[dimension]
+			|| (phtree_key_t) (node->point.values[dimension] | postfix_mask) > window->max.values[dimension])
+		{
+			return false;
+		}
+	}
+
+	return true;
 }
 
 /*
  * calculate the hypercube address of the point at the given node
+ * 	the bit at postfix_length of every dimension, with the first dimension as the highest bit
+ *
+ * 32 and 64 bit keys are shifted so that bit is the sign bit of their SSE2 lane
+ * 	and the lanes are reversed so the first dimension comes out highest from a movemask
+ * 8 and 16 bit keys are put in to one or two words
+ * 	and a multiply moves the bit of every key to the top of the word, in reverse order, without carries
  */
 static hypercube_address_t calculate_hypercube_address (ph5_point_t* point, ph5_node_t* node)
 {
+#if !defined (PHTREE_NO_SIMD) && PHTREE16_BIT_WIDTH == 8 && DIMENSIONS > 1
+	// key i in byte i, which compilers turn in to loads of the point
+	uint64_t keys = 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		keys |= (uint64_t) point->values[dimension] << (8 * dimension);
+	}
+
+	keys = (keys >> node->postfix_length) & UINT64_C(0x0101010101010101);
+
+	// byte i goes to bit 63 - i
+	return (hypercube_address_t) ((keys * UINT64_C(0x8040201008040201)) >> (64 - DIMENSIONS));
+#elif !defined (PHTREE_NO_SIMD) && PHTREE16_BIT_WIDTH == 16 && DIMENSIONS > 1
+	// lane i goes to bit 63 - i
+	#define gather_lanes(keys,count) ((uint64_t) ((((keys) >> node->postfix_length) & UINT64_C(0x0001000100010001)) * UINT64_C(0x8000400020001000)) >> (64 - (count)))
+	// key i in lane i
+	uint64_t keys = 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS && dimension < 4; dimension++)
+	{
+		keys |= (uint64_t) point->values[dimension] << (16 * dimension);
+	}
+
+#if DIMENSIONS <= 4
+	return (hypercube_address_t) gather_lanes (keys, DIMENSIONS);
+#else
+	// key 4 + i in lane i
+	uint64_t high_keys = 0;
+
+	for (int dimension = 4; dimension < DIMENSIONS; dimension++)
+	{
+		high_keys |= (uint64_t) point->values[dimension] << (16 * (dimension - 4));
+	}
+
+	return (hypercube_address_t) ((gather_lanes (keys, 4) << (DIMENSIONS - 4)) | gather_lanes (high_keys, DIMENSIONS - 4));
+#endif
+	#undef gather_lanes
+#elif defined (PHTREE_SSE2) && PHTREE16_BIT_WIDTH == 32 && DIMENSIONS > 1
+	__m128i shift = _mm_cvtsi32_si128 (31 - node->postfix_length);
+#if DIMENSIONS == 2
+	__m128i low = _mm_loadl_epi64 ((const __m128i*) point->values);
+#elif DIMENSIONS == 3
+	__m128i low = _mm_unpacklo_epi64 (_mm_loadl_epi64 ((const __m128i*) point->values), _mm_cvtsi32_si128 ((int) point->values[2]));
+#else
+	__m128i low = _mm_loadu_si128 ((const __m128i*) point->values);
+#endif
+	low = _mm_shuffle_epi32 (_mm_sll_epi32 (low, shift), _MM_SHUFFLE (0, 1, 2, 3));
+#if DIMENSIONS <= 4
+	return (hypercube_address_t) (_mm_movemask_ps (_mm_castsi128_ps (low)) >> (4 - DIMENSIONS));
+#else
+#if DIMENSIONS == 5
+	__m128i high = _mm_cvtsi32_si128 ((int) point->values[4]);
+#else
+	__m128i high = _mm_loadl_epi64 ((const __m128i*) (point->values + 4));
+#endif
+	high = _mm_shuffle_epi32 (_mm_sll_epi32 (high, shift), _MM_SHUFFLE (0, 1, 2, 3));
+	// signed saturation keeps the sign of every lane while packing them down to bytes
+	__m128i packed = _mm_packs_epi32 (high, low);
+	packed = _mm_packs_epi16 (packed, packed);
+
+	return (hypercube_address_t) ((_mm_movemask_epi8 (packed) & 0xff) >> (8 - DIMENSIONS));
+#endif
+#elif defined (PHTREE_SSE2) && PHTREE16_BIT_WIDTH == 64 && DIMENSIONS > 1
+	// the sign of a 64 bit lane is the sign of its high 32 bit half, which _mm_shuffle_ps picks out
+	__m128i shift = _mm_cvtsi32_si128 (63 - node->postfix_length);
+	__m128i first = _mm_sll_epi64 (_mm_loadu_si128 ((const __m128i*) point->values), shift);
+#if DIMENSIONS == 2
+	__m128i second = first;
+#elif DIMENSIONS == 3
+	__m128i second = _mm_sll_epi64 (_mm_loadl_epi64 ((const __m128i*) (point->values + 2)), shift);
+#else
+	__m128i second = _mm_sll_epi64 (_mm_loadu_si128 ((const __m128i*) (point->values + 2)), shift);
+#endif
+	hypercube_address_t address = (hypercube_address_t) _mm_movemask_ps (_mm_shuffle_ps (_mm_castsi128_ps (second), _mm_castsi128_ps (first), _MM_SHUFFLE (1, 3, 1, 3)));
+#if DIMENSIONS == 2
+	return address & 3;
+#elif DIMENSIONS <= 4
+	return address >> (4 - DIMENSIONS);
+#else
+#if DIMENSIONS == 5
+	__m128i third = _mm_sll_epi64 (_mm_loadl_epi64 ((const __m128i*) (point->values + 4)), shift);
+#else
+	__m128i third = _mm_sll_epi64 (_mm_loadu_si128 ((const __m128i*) (point->values + 4)), shift);
+#endif
+	hypercube_address_t low = (hypercube_address_t) _mm_movemask_ps (_mm_shuffle_ps (_mm_castsi128_ps (third), _mm_castsi128_ps (third), _MM_SHUFFLE (1, 3, 1, 3)));
+
+	return (address << (DIMENSIONS - 4)) | ((low & 3) >> (6 - DIMENSIONS));
+#endif
+#else
 	// which bit in the point->values we are interested in
 	phtree_key_t bit_mask = PHTREE16_KEY_ONE << node->postfix_length;
 	hypercube_address_t address = 0;
@@ -270,11 +550,109 @@ static hypercube_address_t calculate_hypercube_address (ph5_point_t* point, ph5_
 	}
 
 	return address;
+#endif
+}
+
+/*
+ * put a node's children array in the tree's recycle pool
+ * 	the pool is a list threaded through the first child of each array
+ * 		children[0].children is the next array in the pool
+ * 		children[0].child_capacity is the capacity of the array
+ */
+static void node_children_recycle (ph5_t* tree, ph5_node_t* node)
+{
+	if (!node->children || node->child_capacity <= 0)
+	{
+		return;
+	}
+
+	node->children[0].children = tree->recycled_children;
+	node->children[0].child_capacity = node->child_capacity;
+	tree->recycled_children = node->children;
+
+	node->children = NULL;
+	node->child_capacity = 0;
+}
+
+/*
+ * give a node a children array
+ * 	from the recycle pool if there is one in there
+ * 	otherwise from node_children_malloc
+ */
+static void node_children_take (ph5_t* tree, ph5_node_t* node)
+{
+	ph5_node_t* recycled = tree->recycled_children;
+
+	if (!recycled)
+	{
+		tree->node_children_malloc (node);
+
+		return;
+	}
+
+	tree->recycled_children = recycled[0].children;
+	node->children = recycled;
+	node->child_capacity = recycled[0].child_capacity;
+}
+
+/*
+ * free every children array in the recycle pool
+ */
+static void recycled_children_free (ph5_t* tree)
+{
+	while (tree->recycled_children)
+	{
+		ph5_node_t node = {0};
+		node.children = tree->recycled_children;
+		node.child_capacity = node.children[0].child_capacity;
+
+		tree->recycled_children = node.children[0].children;
+		tree->node_children_free (&node);
+	}
+}
+
+/*
+ * how far down the recycle pool we look for an array to grow in to
+ * 	looking further finds a fitting array more often
+ * 		but costs more on every grow
+ */
+#define RECYCLE_SEARCH_MAX 16
+
+/*
+ * move a node's children in to a bigger array from the recycle pool
+ * 	returns false if there was no bigger array near the front of the pool
+ */
+static bool node_children_grow_recycled (ph5_t* tree, ph5_node_t* node)
+{
+	ph5_node_t** link = &tree->recycled_children;
+
+	for (int iter = 0; iter < RECYCLE_SEARCH_MAX && *link; iter++)
+	{
+		ph5_node_t* recycled = *link;
+
+		if (recycled[0].child_capacity > node->child_capacity)
+		{
+			*link = recycled[0].children;
+			int capacity = recycled[0].child_capacity;
+
+			memcpy (recycled, node->children, node->child_count * sizeof (ph5_node_t));
+			node_children_recycle (tree, node);
+
+			node->children = recycled;
+			node->child_capacity = capacity;
+
+			return true;
+		}
+
+		link = &recycled[0].children;
+	}
+
+	return false;
 }
 
 static void* add_child (ph5_t* tree, ph5_node_t* node, hypercube_address_t address)
 {
-	if (node->child_count >= node->child_capacity)
+	if (node->child_count >= node->child_capacity && !node_children_grow_recycled (tree, node))
 	{
 		node->children = tree->node_children_expand (node);
 	}
@@ -318,14 +696,19 @@ static void node_add_entry (ph5_t* tree, ph5_node_t* node, ph5_point_t* point)
 	new_entry->children = NULL;
 }
 
-static void node_initialize (ph5_t* tree, ph5_node_t* node, uint16_t infix_length, uint16_t postfix_length, ph5_point_t* point)
+/*
+ * set everything in a node except its children array
+ */
+static void node_set (ph5_node_t* node, uint16_t infix_length, uint16_t postfix_length, ph5_point_t* point)
 {
-	tree->node_children_malloc (node);
 	node->child_count = 0;
 	node->active_children = 0;
 	node->infix_length = infix_length;
 	node->postfix_length = postfix_length;
 	node->point = *point;
+#ifdef PHTREE_HASHES
+	node->hash = 0;
+#endif
 
 	phtree_key_t key_mask = PHTREE16_KEY_MAX << (postfix_length + 1);
 
@@ -340,6 +723,12 @@ static void node_initialize (ph5_t* tree, ph5_node_t* node, uint16_t infix_lengt
 	}
 }
 
+static void node_initialize (ph5_t* tree, ph5_node_t* node, uint16_t infix_length, uint16_t postfix_length, ph5_point_t* point)
+{
+	node_children_take (tree, node);
+	node_set (node, infix_length, postfix_length, point);
+}
+
 /*
  * try to add a new child node to node
  * 	if the node already has a child at the address
@@ -379,7 +768,7 @@ static ph5_node_t* node_try_add (ph5_t* tree, bool* added_new_node, ph5_node_t*
  */
 static int number_of_diverging_bits (ph5_point_t* point_a, ph5_point_t* point_b)
 {
-	unsigned int difference = 0;
+	phtree_key_t difference = 0;
 
 	for (size_t dimension = 0; dimension < DIMENSIONS; dimension++)
 	{
@@ -409,6 +798,10 @@ static ph5_node_t* node_insert_split (ph5_t* tree, ph5_node_t* parent, ph5_node_
 	ph5_node_t old_child = *child;
 	// clear and reset child
 	node_initialize (tree, child, parent->postfix_length - max_conflicting_bits, max_conflicting_bits - 1, point);
+#ifdef PHTREE_HASHES
+	// everything under the new node is under old_child, until point is added
+	child->hash = old_child.hash;
+#endif
 	// add a new child to child
 	// 	which is going to be where the old_child goes
 	ph5_node_t* new_child = add_child (tree, child, calculate_hypercube_address (&old_child.point, child));
@@ -546,6 +939,65 @@ void ph5_default_children_free (ph5_node_t* node)
 #endif
 }
 
+/*
+ * make sure a node's children array can hold at least capacity children
+ * 	used when we know ahead of time how many children a node is going to get
+ *
+ * the default allocator is grown with a single realloc
+ * custom allocators are grown by calling node_children_expand until the capacity is reached
+ */
+static void node_children_reserve (ph5_t* tree, ph5_node_t* node, int capacity)
+{
+	if (capacity > (int) NODE_CHILD_MAX)
+	{
+		capacity = NODE_CHILD_MAX;
+	}
+
+	if (node->child_capacity >= capacity)
+	{
+		return;
+	}
+
+#ifndef PHTREE_NO_STDLIB
+	if (tree->node_children_expand == ph5_default_children_expand)
+	{
+		node->children = realloc (node->children, capacity * sizeof (ph5_node_t));
+		node->child_capacity = capacity;
+
+		return;
+	}
+#endif
+
+	while (node->child_capacity < capacity)
+	{
+		node->children = tree->node_children_expand (node);
+	}
+}
+
+#ifndef PHTREE_NO_STDLIB
+/*
+ * allocate a children array which is going to hold exactly capacity children
+ *
+ * with the default allocators this is a single malloc of the final size
+ * otherwise the array comes from node_children_take and is grown with node_children_reserve
+ */
+static void node_children_allocate (ph5_t* tree, ph5_node_t* node, int capacity)
+{
+	if (!tree->recycled_children
+		&& tree->node_children_malloc == ph5_default_children_malloc
+		&& tree->node_children_expand == ph5_default_children_expand)
+	{
+		node->children = malloc (capacity * sizeof (ph5_node_t));
+		node->child_capacity = capacity;
+
+		return;
+	}
+
+	node_children_take (tree, node);
+	node_children_reserve (tree, node, capacity);
+}
+#endif
+
 void ph5_initialize (
 	ph5_t* tree,
 	void* (*element_create) (void* input),
@@ -557,6 +1009,10 @@ void ph5_initialize (
 {
 	tree->element_create = element_create;
 	tree->element_destroy = element_destroy;
+	tree->recycled_children = NULL;
+#ifdef PHTREE_HASHES
+	tree->element_hash = NULL;
+#endif
 
 	tree->node_children_malloc = ph5_default_children_malloc;
 	tree->node_children_expand = ph5_default_children_expand;
@@ -626,7 +1082,7 @@ static void free_nodes (ph5_t* tree, ph5_node_t* node)
 		free_function (tree, &node->children[iter]);
 	}
 
-	tree->node_children_free (node->children);
+	tree->node_children_free (node);
 }
 
 /*
@@ -644,11 +1100,54 @@ void ph5_clear (ph5_t* tree)
 		free_nodes (tree, &tree->root.children[iter]);
 	}
 
+	tree->node_children_free (&tree->root);
+	recycled_children_free (tree);
+
+	tree->root.children = NULL;
 	tree->root.active_children = 0;
 	tree->root.child_count = 0;
 	tree->root.child_capacity = 0;
+}
+
+/*
+ * recursively destroy the entries under node
+ * 	and put all of the children arrays in the recycle pool
+ */
+static void recycle_nodes (ph5_t* tree, ph5_node_t* node)
+{
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		if (phtree_node_is_leaf (node))
+		{
+			entry_free (tree, &node->children[iter]);
+		}
+		else
+		{
+			recycle_nodes (tree, &node->children[iter]);
+		}
+	}
+
+	node_children_recycle (tree, node);
+}
+
+/*
+ * remove all of the entries in the tree
+ * 	but keep the children arrays for the nodes created afterwards
+ */
+void ph5_reset (ph5_t* tree)
+{
+	if (!tree)
+	{
+		return;
+	}
+
+	for (int iter = 0; iter < tree->root.child_count; iter++)
+	{
+		recycle_nodes (tree, &tree->root.children[iter]);
+	}
 
-	tree->node_children_free (tree->root.children);
+	tree->root.active_children = 0;
+	tree->root.child_count = 0;
 }
 
 /*
@@ -694,332 +1193,7445 @@ void ph5_for_each (ph5_t* tree, phtree_iteration_function_t function, void* data
 	}
 }
 
-void* ph5_insert (ph5_t* tree, ph5_point_t* index, void* element)
+#ifdef PHTREE_HASHES
+// splitmix64's finalizer
+static uint64_t hash_mix (uint64_t value)
 {
-	ph5_node_t* current_node = &tree->root;
+	value ^= value >> 30;
+	value *= UINT64_C(0xbf58476d1ce4e5b9);
+	value ^= value >> 27;
+	value *= UINT64_C(0x94d049bb133111eb);
+	value ^= value >> 31;
 
-	while (!phtree_node_is_leaf (current_node))
-	{
-		current_node = node_add (tree, current_node, index);
-	}
+	return value;
+}
 
-	int offset = child_index (current_node, calculate_hypercube_address (index, current_node));
-	ph5_node_t* entry = current_node->children + offset;
+static uint64_t hash_entry (ph5_t* tree, ph5_node_t* entry)
+{
+	uint64_t hash = UINT64_C(0x9e3779b97f4a7c15);
 
-	if (!entry->children)
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
 	{
-		entry->children = tree->element_create (element);
+		hash = hash_mix (hash ^ (uint64_t) entry->point.values[dimension]);
 	}
 
-	return entry->children;
+	return hash_mix (hash ^ (entry->children ? tree->element_hash (entry->children) : 0));
 }
 
 /*
- * find an entry in the tree
+ * add delta to the hash of every node on the path to point, below the root
+ * 	point has to be in the tree
  */
-ph5_node_t* ph5_find_entry (ph5_t* tree, ph5_point_t* point)
+static void hash_path_add (ph5_t* tree, ph5_point_t* point, uint64_t delta)
 {
-	ph5_node_t* current_node = &tree->root.children[child_index (&tree->root, calculate_hypercube_address (point, &tree->root))];
-	hypercube_address_t address;
+	ph5_node_t* node = &tree->root;
 
-	while (!phtree_node_is_leaf (current_node))
+	while (!phtree_node_is_leaf (node))
 	{
-		address = calculate_hypercube_address (point, current_node);
+		node = &node->children[child_index (node, calculate_hypercube_address (point, node))];
+		node->hash += delta;
+	}
+}
 
-		if (!child_active (current_node, address)
-			|| !prefix_equal (point, &current_node->point, current_node->postfix_length))
+// an element was just put in entry, which is at point
+static void hash_entry_added (ph5_t* tree, ph5_point_t* point, ph5_node_t* entry)
+{
+	if (tree->element_hash)
+	{
+		entry->hash = hash_entry (tree, entry);
+		hash_path_add (tree, point, entry->hash);
+	}
+}
+
+// entry, which is at point, is about to be removed
+static void hash_entry_removing (ph5_t* tree, ph5_point_t* point, ph5_node_t* entry)
+{
+	if (tree->element_hash)
+	{
+		hash_path_add (tree, point, -entry->hash);
+	}
+}
+
+/*
+ * recompute the hashes of node and everything under it
+ * 	if window is not NULL only the children which overlap it are recomputed
+ * 		the rest have not changed since their hashes were last right
+ */
+static uint64_t hash_node_refresh (ph5_t* tree, ph5_node_t* node, ph5_query_t* window)
+{
+	uint64_t hash = 0;
+
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		ph5_node_t* child = &node->children[iter];
+
+		if (phtree_node_is_leaf (node))
 		{
-			return NULL;
+			child->hash = hash_entry (tree, child);
+		}
+		else if (!window || prefix_in_window (child, window))
+		{
+			hash_node_refresh (tree, child, window);
 		}
 
-		current_node = &current_node->children[child_index (current_node, address)];
+		hash += child->hash;
 	}
 
-	address = calculate_hypercube_address (point, current_node);
+	node->hash = hash;
 
-	if (!child_active (current_node, address)
-		|| !point_equal (point, &current_node->point))
+	return hash;
+}
+
+static void hash_refresh (ph5_t* tree, ph5_query_t* window)
+{
+	if (tree->element_hash)
 	{
-		return NULL;
+		hash_node_refresh (tree, &tree->root, window);
 	}
-
-	return &current_node->children[child_index (current_node, address)];
 }
+#else
+#define hash_entry_added(tree, point, entry)
+#define hash_entry_removing(tree, point, entry)
+#define hash_refresh(tree, window)
+#endif
 
 /*
- * find an element at a specific index
- * returns NULL if there is no element at the index
+ * find or create the entry for a point
+ * 	a newly created entry does not have an element yet
  */
-void* ph5_find (ph5_t* tree, ph5_point_t* index)
+static ph5_node_t* insert_entry (ph5_t* tree, ph5_point_t* point)
 {
-	ph5_node_t* entry = ph5_find_entry (tree, index);
+	ph5_node_t* current_node = &tree->root;
 
-	if (!entry)
+	while (!phtree_node_is_leaf (current_node))
 	{
-		return NULL;
+		current_node = node_add (tree, current_node, point);
 	}
 
-	return entry->children;
+	int offset = child_index (current_node, calculate_hypercube_address (point, current_node));
+
+	return current_node->children + offset;
 }
 
-void ph5_remove_child (ph5_t* tree, ph5_node_t* node, hypercube_address_t address)
+void* ph5_insert (ph5_t* tree, ph5_point_t* index, void* element)
 {
-	int index = child_index (node, address);
-	ph5_node_t* child = &node->children[index];
-
-	tree->node_children_free (child->children);
+	ph5_node_t* entry = insert_entry (tree, index);
 
-	memmove (node->children + index, node->children + index + 1, sizeof (ph5_node_t) * (node->child_count - index - 1));
+	if (!entry->children)
+	{
+		entry->children = tree->element_create (element);
+		hash_entry_added (tree, index, entry);
+	}
 
-	node->child_count--;
-	node->active_children &= ~(PHTREE_CHILD_FLAG << (CHILD_SHIFT - address));
+	return entry->children;
 }
 
-void ph5_remove_entry (ph5_t* tree, ph5_node_t* node, hypercube_address_t address)
+#ifndef PHTREE_NO_STDLIB
+/*
+ * point_a < point_b in z-order (hypercube order)
+ * 	the order in which points are laid out in the tree
+ *
+ * the dimension with the highest differing bit decides the order
+ * 	dimension 0 is the most significant bit of a hypercube address
+ * 		so earlier dimensions win ties
+ */
+static bool point_z_less (ph5_point_t* point_a, ph5_point_t* point_b)
 {
-	int index = child_index (node, address);
-	ph5_node_t* entry = &node->children[index];
+	int deciding_dimension = 0;
+	phtree_key_t deciding_difference = 0;
 
-	if (entry->children)
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
 	{
-		if (tree->element_destroy)
+		phtree_key_t difference = point_a->values[dimension] ^ point_b->values[dimension];
+
+		// the highest set bit of difference is higher than the highest set bit of deciding_difference
+		if (deciding_difference < difference && deciding_difference < (deciding_difference ^ difference))
 		{
-			tree->element_destroy (entry->children);
+			deciding_dimension = dimension;
+			deciding_difference = difference;
 		}
+	}
 
-		entry->children = NULL;
+	return point_a->values[deciding_dimension] < point_b->values[deciding_dimension];
+}
+
+/*
+ * qsort comparison for an array of point pointers
+ * 	equal points are ordered by their position in memory
+ * 		so the first of several equal points in a batch is inserted first
+ */
+static int point_pointer_z_compare (const void* a, const void* b)
+{
+	ph5_point_t* point_a = *(ph5_point_t* const*) a;
+	ph5_point_t* point_b = *(ph5_point_t* const*) b;
+
+	if (point_z_less (point_a, point_b))
+	{
+		return -1;
 	}
 
-	memmove (node->children + index, node->children + index + 1, sizeof (ph5_node_t) * (node->child_count - index - 1));
+	if (point_z_less (point_b, point_a))
+	{
+		return 1;
+	}
 
-	node->child_count--;
-	node->active_children &= ~(PHTREE_CHILD_FLAG << (CHILD_SHIFT - address));
+	return (point_a > point_b) - (point_a < point_b);
 }
+#endif
 
-void ph5_remove (ph5_t* tree, ph5_point_t* point)
+/*
+ * before adding a child to a full node during a batch insert
+ * 	count how many new children the rest of the batch is going to add to the node
+ * 		and grow the children array once for all of them
+ *
+ * order is the z-ordered batch
+ * 	all of the points which land in node come directly after order[first]
+ */
+static void node_reserve_batch (ph5_t* tree, ph5_node_t* node, ph5_point_t** order, size_t first, size_t count)
 {
-	int stack_index = 0;
-	ph5_node_t* node_stack[PHTREE_DEPTH] = {0};
-	ph5_node_t* current_node = &tree->root;
-	hypercube_address_t address;
+	hypercube_address_t address = calculate_hypercube_address (order[first], node);
 
-	while (!phtree_node_is_leaf (current_node))
+	if (child_active (node, address) || node->child_count < node->child_capacity)
 	{
-		address = calculate_hypercube_address (point, current_node);
+		return;
+	}
 
-		if (child_active (current_node, address))
+	int new_children = 1;
+	hypercube_address_t previous_address = address;
+
+	for (size_t iter = first + 1; iter < count; iter++)
+	{
+		// the z-order guarantees that once a point is outside of node
+		// 	every point after it is also outside of node
+		if (number_of_diverging_bits (order[first], order[iter]) > node->postfix_length + 1)
 		{
-			node_stack[stack_index] = current_node;
-			stack_index++;
-			current_node = &current_node->children[child_index (current_node, address)];
+			break;
 		}
-		// if the point doesnt exist in the tree we dont need to remove it
-		else
+
+		address = calculate_hypercube_address (order[iter], node);
+
+		if (address != previous_address && !child_active (node, address))
 		{
-			return;
+			new_children++;
 		}
+
+		previous_address = address;
+	}
+
+	node_children_reserve (tree, node, node->child_count + new_children);
+}
+
+void ph5_insert_batch (ph5_t* tree, ph5_point_t* points, void** inputs, size_t count, void** out_elements)
+{
+	if (!tree || !points || count == 0)
+	{
+		return;
 	}
 
-	ph5_remove_entry (tree, current_node, calculate_hypercube_address (point, current_node));
+	/*
+	 * sort the batch in z-order
+	 * 	consecutive points then share as much of their path through the tree as possible
+	 * if there is no stdlib (or no memory) the batch is inserted in the order it was given
+	 * 	which is still correct, just slower
+	 */
+	ph5_point_t** order = NULL;
+
+#ifndef PHTREE_NO_STDLIB
+	order = malloc (count * sizeof (*order));
 
-	if (current_node->child_count == 0)
+	if (order)
 	{
-		// set stack_index to the last node in the stack
-		// 	the parent of current_node
-		stack_index--;
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			order[iter] = &points[iter];
+		}
 
-		ph5_node_t* parent = node_stack[stack_index];
+		qsort (order, count, sizeof (*order), point_pointer_z_compare);
+	}
+#endif
 
-		ph5_remove_child (tree, parent, calculate_hypercube_address (point, parent));
-		stack_index--;
+	/*
+	 * the path from the root to the leaf of the previously inserted point
+	 * 	inserting a point only changes the children of the nodes below where its path
+	 * 		splits from the previous path
+	 * 	so every node above that split is still valid and can be reused
+	 */
+	ph5_node_t* node_stack[PHTREE_DEPTH + 1];
+	int stack_size = 1;
+	node_stack[0] = &tree->root;
+	ph5_point_t* previous = NULL;
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		ph5_point_t* point = order ? order[iter] : &points[iter];
+		size_t index = point - points;
 
-		// node_stack[0] is root
-		// 	we dont need to run this on root
-		while (stack_index > 0)
+		if (previous)
 		{
-			parent = node_stack[stack_index - 1];
-			current_node = node_stack[stack_index];
+			int diverging_bits = number_of_diverging_bits (previous, point);
 
-			// XXX
-			// 	we dont need to check if current_node->child_count == 0
-			// 		because that would imply that we had a split node which didnt split anything
-			// 			and only had a single child
-			// 		such a node shouldnt exist
-			// 			it should have been removed before getting here
-			if (current_node->child_count > 1)
+			// pop every node whose prefix does not contain point
+			// 	root contains everything
+			while (stack_size > 1 && node_stack[stack_size - 1]->postfix_length + 1 < diverging_bits)
 			{
-				break;
+				stack_size--;
 			}
+		}
+
+		ph5_node_t* current_node = node_stack[stack_size - 1];
+
+		if (order)
+		{
+			node_reserve_batch (tree, current_node, order, iter, count);
+		}
+
+		// node_add adds the entry when it reaches a leaf
+		// 	but if we are starting at a leaf we need to add it ourselves
+		if (phtree_node_is_leaf (current_node))
+		{
+			node_add_entry (tree, current_node, point);
+		}
+
+		while (!phtree_node_is_leaf (current_node))
+		{
+			current_node = node_add (tree, current_node, point);
+			node_stack[stack_size] = current_node;
+			stack_size++;
 
-			int index = child_index (parent, calculate_hypercube_address (point, parent));
+			if (order)
+			{
+				node_reserve_batch (tree, current_node, order, iter, count);
+			}
+		}
 
-			// current_node->children[0] is the only child
-			parent->children[index] = current_node->children[0];
-			parent->children[index].infix_length = parent->postfix_length - parent->children[index].postfix_length - 1;
+		ph5_node_t* entry = current_node->children + child_index (current_node, calculate_hypercube_address (point, current_node));
 
-			tree->node_children_free (current_node->children);
+		if (!entry->children)
+		{
+			entry->children = tree->element_create (inputs ? inputs[index] : NULL);
+			hash_entry_added (tree, point, entry);
+		}
 
-			stack_index--;
+		if (out_elements)
+		{
+			out_elements[index] = entry->children;
 		}
+
+		previous = point;
 	}
-}
 
-/*
- * check if the tree is empty
- */
-bool ph5_empty (ph5_t* tree)
-{
-	return (tree->root.child_count == 0);
+#ifndef PHTREE_NO_STDLIB
+	free (order);
+#endif
 }
 
+#ifndef PHTREE_NO_STDLIB
 /*
- * run a window query on a specific node
+ * set up the children of node from a z-ordered range of points
+ * 	every point in order[first] to order[last - 1] is inside of node
+ * 		and duplicate points are next to eachother
+ *
+ * the children of a node are exactly the groups of consecutive points
+ * 	which share a hypercube address in the node
+ * so we find the groups first and allocate the children array once at its final size
+ *
+ * group_starts gets the range of points of each child, the number of children is returned
+ * 	children which are not entries still need to be built from their range
  */
-static void node_query_window (ph5_node_t* node, ph5_query_t* query, void* data)
+static int node_build_children (ph5_t* tree, ph5_node_t* node, ph5_point_t** order, ph5_point_t* points, void** inputs, size_t first, size_t last, size_t* group_starts)
 {
-	if (!prefix_in_window (node, query))
+	int group_count = 0;
+	hypercube_address_t address = 0;
+
+	for (size_t iter = first; iter < last; iter++)
 	{
-		return;
+		hypercube_address_t next_address = calculate_hypercube_address (order[iter], node);
+
+		if (group_count == 0 || next_address != address)
+		{
+			group_starts[group_count] = iter;
+			group_count++;
+			address = next_address;
+		}
 	}
 
-	/*
-	 * these masks are used to accelerate queries
-	 * 	when iterating children
-	 * 		we can do a broad check if a child node overlaps the query window at all
-	 * 		without needing to go to the child node and performing node_in_window
-	 * 		
-	 * 	if the child node does not overlap the query window
-	 * 		we save a memory jump to that node
-	 */
-	phtree_key_t mask_lower = 0;
-	phtree_key_t mask_upper = 0;
+	group_starts[group_count] = last;
 
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	if (node->child_capacity == 0)
 	{
-		/*
-		 * for these >= to work properly
-		 * 	node->point has to be set to the mid point of the node
-		 * 	we set node->point to the mid point, during node creation
-		 * 		so we dont have to calculate it here
-		 */
-		mask_lower <<= 1;
-		mask_lower |= query->min.values[dimension] >= node->point.values[dimension];
-
-		mask_upper <<= 1;
-		mask_upper |= query->max.values[dimension] >= node->point.values[dimension];
+		node_children_allocate (tree, node, group_count);
+	}
+	else
+	{
+		node_children_reserve (tree, node, group_count);
 	}
 
-	if (phtree_node_is_leaf (node))
+	for (int group = 0; group < group_count; group++)
 	{
-		for (int iter = 0; iter < NODE_CHILD_MAX; iter++)
+		ph5_point_t* point = order[group_starts[group]];
+		address = calculate_hypercube_address (point, node);
+
+		node->active_children |= (PHTREE_CHILD_FLAG << (CHILD_SHIFT - address));
+		ph5_node_t* child = &node->children[group];
+		memset (child, 0, sizeof (ph5_node_t));
+
+		// every point in a leaf group is the same point
+		// 	the first one in the group is the first one in the batch
+		if (phtree_node_is_leaf (node))
 		{
-			if (child_active (node, iter) && ((iter | mask_lower) & mask_upper) == iter)
-			{
-				ph5_node_t* child = &node->children[child_index (node, iter)];
+			child->point = *point;
+			child->children = tree->element_create (inputs ? inputs[point - points] : NULL);
 
-				if (point_in_window (child, query))
-				{
-					query->function (child->children, data);
-				}
-			}
+			continue;
 		}
 
-		return;
-	}
+		// the child sits at the highest bit at which the points in its group diverge
+		// 	in z-order that is where the first and last points of the group diverge
+		// a group of a single point (or points which only differ in their last bit) gets a leaf
+		int diverging_bits = number_of_diverging_bits (point, order[group_starts[group + 1] - 1]);
+		int postfix_length = diverging_bits > 1 ? diverging_bits - 1 : 0;
 
-	// if the node _is_ in the window and _is not_ a leaf
-	// 	recurse through the node's children
-	for (unsigned int iter = 0; iter < NODE_CHILD_MAX; iter++)
-	{
-		if (child_active (node, iter) && ((iter | mask_lower) & mask_upper) == iter)
-		{
-			node_query_window (&node->children[child_index (node, iter)], query, data);
-		}
+		node_set (child, node->postfix_length - postfix_length - 1, postfix_length, point);
 	}
+
+	node->child_count = group_count;
+
+	return group_count;
 }
 
 /*
- * run a window query on a tree
+ * build the subtree under node from a z-ordered range of points
  */
-void ph5_query (ph5_t* tree, ph5_query_t* query, void* data)
+static void node_build (ph5_t* tree, ph5_node_t* node, ph5_point_t** order, ph5_point_t* points, void** inputs, size_t first, size_t last)
 {
-	if (!tree || !query || !query->function)
+	size_t group_starts[NODE_CHILD_MAX + 1];
+	int group_count = node_build_children (tree, node, order, points, inputs, first, last, group_starts);
+
+	if (phtree_node_is_leaf (node))
 	{
 		return;
 	}
 
-	for (int iter = 0; iter < tree->root.child_count; iter++)
+	for (int group = 0; group < group_count; group++)
 	{
-		node_query_window (&tree->root.children[iter], query, data);
+		node_build (tree, &node->children[group], order, points, inputs, group_starts[group], group_starts[group + 1]);
 	}
 }
+#endif
 
-/*
- * query_set does not need to convert external values in to internal points/keys
- * so it needs to be its own function
- */
-void ph5_query_set (ph5_query_t* query, ph5_point_t* min, ph5_point_t* max, phtree_iteration_function_t function)
+void ph5_build (ph5_t* tree, ph5_point_t* points, void** inputs, size_t count)
 {
-	ph5_query_clear (query);
+	if (!tree || !points || count == 0)
+	{
+		return;
+	}
 
-	query->min = *min;
-	query->max = *max;
+#ifndef PHTREE_NO_STDLIB
+	ph5_point_t** order = NULL;
 
-	// make sure min and max are properly populated
-	// 	all minimum values in min
-	// 	all maximum values in max
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	// building only works from nothing
+	// 	a tree which already has entries gets a batch insert instead
+	if (ph5_empty (tree))
 	{
-		if (query->max.values[dimension] < query->min.values[dimension])
+		order = malloc (count * sizeof (*order));
+	}
+
+	if (order)
+	{
+		for (size_t iter = 0; iter < count; iter++)
 		{
-			phtree_key_t temp = query->min.values[dimension];
-			query->min.values[dimension] = query->max.values[dimension];
-			query->max.values[dimension] = temp;
+			order[iter] = &points[iter];
 		}
-	}
 
-	query->function = function;
-}
+		qsort (order, count, sizeof (*order), point_pointer_z_compare);
 
-ph5_query_t ph5_query_create (void* min, void* max, phtree_iteration_function_t function)
+		node_build (tree, &tree->root, order, points, inputs, 0, count);
+		hash_refresh (tree, NULL);
+
+		free (order);
+
+		return;
+	}
+#endif
+
+	ph5_insert_batch (tree, points, inputs, count, NULL);
+}
+
+/*
+ * find an entry under a child of the root
+ */
+static ph5_node_t* node_find_entry (ph5_node_t* current_node, ph5_point_t* point)
+{
+	hypercube_address_t address;
+
+	while (!phtree_node_is_leaf (current_node))
+	{
+		address = calculate_hypercube_address (point, current_node);
+
+		if (!child_active (current_node, address)
+			|| !prefix_equal (point, &current_node->point, current_node->postfix_length))
+		{
+			return NULL;
+		}
+
+		current_node = &current_node->children[child_index (current_node, address)];
+	}
+
+	address = calculate_hypercube_address (point, current_node);
+
+	if (!child_active (current_node, address)
+		|| !prefix_equal (point, &current_node->point, current_node->postfix_length))
+	{
+		return NULL;
+	}
+
+	return &current_node->children[child_index (current_node, address)];
+}
+
+/*
+ * find an entry in the tree
+ */
+ph5_node_t* ph5_find_entry (ph5_t* tree, ph5_point_t* point)
+{
+	hypercube_address_t address = calculate_hypercube_address (point, &tree->root);
+
+	if (!child_active (&tree->root, address))
+	{
+		return NULL;
+	}
+
+	return node_find_entry (&tree->root.children[child_index (&tree->root, address)], point);
+}
+
+/*
+ * find an element at a specific index
+ * returns NULL if there is no element at the index
+ */
+void* ph5_find (ph5_t* tree, ph5_point_t* index)
+{
+	ph5_node_t* entry = ph5_find_entry (tree, index);
+
+	if (!entry)
+	{
+		return NULL;
+	}
+
+	return entry->children;
+}
+
+/*
+ * replace a node which only has a single child with that child
+ * 	node is the child of parent which is being replaced
+ */
+static void node_collapse (ph5_t* tree, ph5_node_t* parent, ph5_node_t* node)
+{
+	ph5_node_t collapsed = *node;
+
+	*node = collapsed.children[0];
+	node->infix_length = parent->postfix_length - node->postfix_length - 1;
+
+	tree->node_children_free (&collapsed);
+}
+
+void ph5_remove_child (ph5_t* tree, ph5_node_t* node, hypercube_address_t address)
+{
+	int index = child_index (node, address);
+	ph5_node_t* child = &node->children[index];
+
+	tree->node_children_free (child);
+
+	memmove (node->children + index, node->children + index + 1, sizeof (ph5_node_t) * (node->child_count - index - 1));
+
+	node->child_count--;
+	node->active_children &= ~(PHTREE_CHILD_FLAG << (CHILD_SHIFT - address));
+}
+
+void ph5_remove_entry (ph5_t* tree, ph5_node_t* node, hypercube_address_t address)
+{
+	int index = child_index (node, address);
+	ph5_node_t* entry = &node->children[index];
+
+	if (entry->children)
+	{
+		if (tree->element_destroy)
+		{
+			tree->element_destroy (entry->children);
+		}
+
+		entry->children = NULL;
+	}
+
+	memmove (node->children + index, node->children + index + 1, sizeof (ph5_node_t) * (node->child_count - index - 1));
+
+	node->child_count--;
+	node->active_children &= ~(PHTREE_CHILD_FLAG << (CHILD_SHIFT - address));
+}
+
+void ph5_remove (ph5_t* tree, ph5_point_t* point)
+{
+	int stack_index = 0;
+	ph5_node_t* node_stack[PHTREE_DEPTH] = {0};
+	ph5_node_t* current_node = &tree->root;
+	hypercube_address_t address;
+
+	while (!phtree_node_is_leaf (current_node))
+	{
+		address = calculate_hypercube_address (point, current_node);
+
+		if (child_active (current_node, address))
+		{
+			node_stack[stack_index] = current_node;
+			stack_index++;
+			current_node = &current_node->children[child_index (current_node, address)];
+		}
+		// if the point doesnt exist in the tree we dont need to remove it
+		else
+		{
+			return;
+		}
+	}
+
+	address = calculate_hypercube_address (point, current_node);
+
+	// the leaf we reached does not necessarily hold point
+	if (!child_active (current_node, address)
+		|| !point_equal (point, &current_node->children[child_index (current_node, address)].point))
+	{
+		return;
+	}
+
+	hash_entry_removing (tree, point, &current_node->children[child_index (current_node, address)]);
+	ph5_remove_entry (tree, current_node, address);
+
+	/*
+	 * walk back up the path
+	 * 	dropping nodes which are now empty
+	 * 	and collapsing a node which is left with a single child in to its parent
+	 * node_stack[0] is root, which is never dropped or collapsed
+	 */
+	while (stack_index > 0)
+	{
+		ph5_node_t* parent = node_stack[stack_index - 1];
+
+		if (current_node->child_count == 0)
+		{
+			ph5_remove_child (tree, parent, calculate_hypercube_address (point, parent));
+		}
+		else if (current_node->child_count == 1 && !phtree_node_is_leaf (current_node))
+		{
+			node_collapse (tree, parent, current_node);
+			break;
+		}
+		else
+		{
+			break;
+		}
+
+		current_node = parent;
+		stack_index--;
+	}
+}
+
+// element_create for elements which already exist and are only being moved
+static void* element_keep (void* element)
+{
+	return element;
+}
+
+void* ph5_relocate (ph5_t* tree, ph5_point_t* from, ph5_point_t* to)
+{
+	void* element = ph5_find (tree, from);
+
+	if (!element || point_equal (from, to))
+	{
+		return element;
+	}
+
+	if (ph5_find (tree, to))
+	{
+		return NULL;
+	}
+
+	void* (*element_create) (void* input) = tree->element_create;
+	void (*element_destroy) (void* element) = tree->element_destroy;
+
+	tree->element_destroy = NULL;
+	ph5_remove (tree, from);
+	tree->element_destroy = element_destroy;
+
+	tree->element_create = element_keep;
+	ph5_insert (tree, to, element);
+	tree->element_create = element_create;
+
+	return element;
+}
+
+/*
+ * everything a merge needs to carry through its recursion
+ */
+typedef struct merge_context_t
+{
+	ph5_t* destination;
+	ph5_t* source;
+	phtree_merge_function_t conflict;
+	void* data;
+} merge_context_t;
+
+/*
+ * put an element from the other tree in to an entry
+ * 	if the entry already has an element the conflict function decides which one stays
+ * 		and the other one is destroyed by the tree it came from
+ *
+ * swapped is true when the entry belongs to the source tree and element to the destination
+ */
+static void entry_merge (merge_context_t* context, ph5_node_t* entry, void* element, bool swapped)
+{
+	if (!entry->children)
+	{
+		entry->children = element;
+
+		return;
+	}
+
+	void* destination_element = swapped ? element : entry->children;
+	void* source_element = swapped ? entry->children : element;
+	void* keep = destination_element;
+
+	if (context->conflict)
+	{
+		keep = context->conflict (destination_element, source_element, context->data);
+	}
+
+	if (keep != destination_element && context->destination->element_destroy)
+	{
+		context->destination->element_destroy (destination_element);
+	}
+
+	if (keep != source_element && context->source->element_destroy)
+	{
+		context->source->element_destroy (source_element);
+	}
+
+	entry->children = keep;
+}
+
+/*
+ * nodes can only be moved from one tree to another
+ * 	if both trees allocate and free children arrays the same way
+ */
+static bool trees_share_allocators (ph5_t* tree_a, ph5_t* tree_b)
+{
+	return (tree_a->node_children_malloc == tree_b->node_children_malloc
+		&& tree_a->node_children_expand == tree_b->node_children_expand
+		&& tree_a->node_children_free == tree_b->node_children_free);
+}
+
+static void merge_nodes (merge_context_t* context, ph5_node_t* parent, ph5_node_t* slot, ph5_node_t other, bool swapped);
+
+/*
+ * move all of the children of other in to node
+ * 	node and other have the same prefix and postfix_length
+ * 		so children at different addresses are moved over as they are
+ * 		and children at the same address are merged
+ * other's children array is freed afterwards, but none of the nodes in it are
+ */
+static void merge_children (merge_context_t* context, ph5_node_t* node, ph5_node_t other, bool swapped)
+{
+	ph5_t* tree = context->destination;
+
+	node_children_reserve (tree, node, node->child_count + popcount (other.active_children & ~node->active_children));
+
+	for (int iter = 0; iter < other.child_count; iter++)
+	{
+		ph5_node_t* other_child = &other.children[iter];
+		hypercube_address_t address = calculate_hypercube_address (&other_child->point, node);
+
+		if (!child_active (node, address))
+		{
+			*((ph5_node_t*) add_child (tree, node, address)) = *other_child;
+		}
+		else if (phtree_node_is_leaf (node))
+		{
+			entry_merge (context, &node->children[child_index (node, address)], other_child->children, swapped);
+		}
+		else
+		{
+			merge_nodes (context, node, &node->children[child_index (node, address)], *other_child, swapped);
+		}
+	}
+
+	tree->node_children_free (&other);
+}
+
+/*
+ * merge other in to slot
+ * 	slot is a child of parent
+ * 	other would be a child of parent at the same address as slot
+ */
+static void merge_nodes (merge_context_t* context, ph5_node_t* parent, ph5_node_t* slot, ph5_node_t other, bool swapped)
+{
+	ph5_t* tree = context->destination;
+	int higher_postfix = slot->postfix_length > other.postfix_length ? slot->postfix_length : other.postfix_length;
+	phtree_key_t prefix_mask = (PHTREE16_KEY_MAX << higher_postfix) << 1;
+	ph5_point_t slot_prefix = slot->point;
+	ph5_point_t other_prefix = other.point;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		slot_prefix.values[dimension] &= prefix_mask;
+		other_prefix.values[dimension] &= prefix_mask;
+	}
+
+	int diverging_bits = number_of_diverging_bits (&slot_prefix, &other_prefix);
+
+	// the prefixes diverge above both nodes
+	// 	put a new node where they diverge with both nodes as its children
+	if (diverging_bits > 0)
+	{
+		ph5_node_t old_slot = *slot;
+		node_initialize (tree, slot, parent->postfix_length - diverging_bits, diverging_bits - 1, &other.point);
+
+		ph5_node_t* child = add_child (tree, slot, calculate_hypercube_address (&old_slot.point, slot));
+		*child = old_slot;
+		child->infix_length = slot->postfix_length - child->postfix_length - 1;
+
+		child = add_child (tree, slot, calculate_hypercube_address (&other.point, slot));
+		*child = other;
+		child->infix_length = slot->postfix_length - child->postfix_length - 1;
+
+		return;
+	}
+
+	if (slot->postfix_length == other.postfix_length)
+	{
+		merge_children (context, slot, other, swapped);
+
+		return;
+	}
+
+	// other belongs somewhere under slot
+	if (slot->postfix_length > other.postfix_length)
+	{
+		hypercube_address_t address = calculate_hypercube_address (&other.point, slot);
+
+		if (!child_active (slot, address))
+		{
+			ph5_node_t* child = add_child (tree, slot, address);
+			*child = other;
+			child->infix_length = slot->postfix_length - child->postfix_length - 1;
+		}
+		else
+		{
+			merge_nodes (context, slot, &slot->children[child_index (slot, address)], other, swapped);
+		}
+
+		return;
+	}
+
+	// slot belongs somewhere under other
+	// 	put other in slot's place and merge the old slot in to it
+	ph5_node_t old_slot = *slot;
+	*slot = other;
+	slot->infix_length = parent->postfix_length - slot->postfix_length - 1;
+	merge_nodes (context, parent, slot, old_slot, !swapped);
+}
+
+/*
+ * when the trees do not share node allocators
+ * 	no node can move between them
+ * so move the elements one at a time and free the source's nodes as we go
+ */
+static void merge_entries (merge_context_t* context, ph5_node_t* node)
+{
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		ph5_node_t* child = &node->children[iter];
+
+		if (phtree_node_is_leaf (node))
+		{
+			entry_merge (context, insert_entry (context->destination, &child->point), child->children, false);
+		}
+		else
+		{
+			merge_entries (context, child);
+		}
+	}
+
+	context->source->node_children_free (node);
+}
+
+/*
+ * move a whole subtree of the source in to the destination
+ * 	subtree's infix_length is relative to its old parent and is recalculated
+ */
+static void merge_subtree (merge_context_t* context, ph5_node_t subtree)
+{
+	ph5_node_t* root = &context->destination->root;
+	hypercube_address_t address = calculate_hypercube_address (&subtree.point, root);
+
+	if (!child_active (root, address))
+	{
+		ph5_node_t* child = add_child (context->destination, root, address);
+		*child = subtree;
+		child->infix_length = root->postfix_length - child->postfix_length - 1;
+
+		return;
+	}
+
+	merge_nodes (context, root, &root->children[child_index (root, address)], subtree, false);
+}
+
+void ph5_merge (ph5_t* destination, ph5_t* source, phtree_merge_function_t conflict, void* data)
+{
+	if (!destination || !source || destination == source)
+	{
+		return;
+	}
+
+	merge_context_t context = {destination, source, conflict, data};
+
+	if (trees_share_allocators (destination, source))
+	{
+		merge_children (&context, &destination->root, source->root, false);
+	}
+	else
+	{
+		merge_entries (&context, &source->root);
+	}
+
+	hash_refresh (destination, NULL);
+
+	// the source's root children array has been freed
+	// 	leave source as an empty tree, the same as after ph5_clear
+	source->root.children = NULL;
+	source->root.active_children = 0;
+	source->root.child_count = 0;
+	source->root.child_capacity = 0;
+}
+
+/*
+ * remove every entry under node for which predicate returns true
+ * 	if query is not NULL only entries inside of the query window are checked
+ * 	if predicate is NULL every entry (inside of the query window) is removed
+ * 		and children entirely inside of the window are dropped whole
+ * 	if move is not NULL removed entries and dropped children are moved to move->destination
+ * 		instead of being freed
+ *
+ * children which end up empty are dropped
+ * 	and children which end up with a single child are collapsed
+ * node's children array is compacted once after all of its children have been processed
+ */
+static void node_remove_if (ph5_t* tree, ph5_node_t* node, ph5_query_t* query, phtree_predicate_function_t predicate, void* data, merge_context_t* move)
+{
+	// the same child masks as node_query_window
+	phtree_key_t mask_lower = 0;
+	phtree_key_t mask_upper = NODE_CHILD_MAX - 1;
+
+	if (query)
+	{
+		mask_upper = 0;
+
+		for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+		{
+			mask_lower <<= 1;
+			mask_lower |= query->min.values[dimension] >= node->point.values[dimension];
+
+			mask_upper <<= 1;
+			mask_upper |= query->max.values[dimension] >= node->point.values[dimension];
+		}
+	}
+
+	int kept = 0;
+	ph5_node_t* children = node->children;
+	int child_count = node->child_count;
+
+	for (int iter = 0; iter < child_count; iter++)
+	{
+		ph5_node_t* child = &children[iter];
+		hypercube_address_t address = calculate_hypercube_address (&child->point, node);
+		bool remove = false;
+
+		if (((address | mask_lower) & mask_upper) == address)
+		{
+			if (phtree_node_is_leaf (node))
+			{
+				if ((!query || point_in_window (child, query)) && (!predicate || predicate (child->children, data)))
+				{
+					if (move)
+					{
+						entry_merge (move, insert_entry (move->destination, &child->point), child->children, false);
+					}
+					else
+					{
+						entry_free (tree, child);
+					}
+
+					remove = true;
+				}
+			}
+			// with no predicate everything inside of the window goes
+			// 	so a child which is entirely inside of the window is detached and freed
+			// 		without editing any of the nodes under it
+			else if (!predicate && (!query || node_in_window (child, query))
+				&& (!move || trees_share_allocators (tree, move->destination)))
+			{
+				if (move)
+				{
+					merge_subtree (move, *child);
+				}
+				else
+				{
+					free_nodes (tree, child);
+				}
+
+				remove = true;
+			}
+			else if (!query || prefix_in_window (child, query))
+			{
+				node_remove_if (tree, child, query, predicate, data, move);
+
+				if (child->child_count == 0)
+				{
+					tree->node_children_free (child);
+					remove = true;
+				}
+				else if (child->child_count == 1 && !phtree_node_is_leaf (child))
+				{
+					node_collapse (tree, node, child);
+				}
+			}
+		}
+
+		if (remove)
+		{
+			node->active_children &= ~(PHTREE_CHILD_FLAG << (CHILD_SHIFT - address));
+		}
+		else
+		{
+			if (kept != iter)
+			{
+				children[kept] = *child;
+			}
+
+			kept++;
+		}
+	}
+
+	node->child_count = kept;
+}
+
+void ph5_remove_if (ph5_t* tree, ph5_query_t* query, phtree_predicate_function_t predicate, void* data)
+{
+	if (!tree || !predicate)
+	{
+		return;
+	}
+
+	node_remove_if (tree, &tree->root, query, predicate, data, NULL);
+	hash_refresh (tree, query);
+}
+
+void ph5_erase_window (ph5_t* tree, ph5_query_t* query)
+{
+	if (!tree || !query)
+	{
+		return;
+	}
+
+	node_remove_if (tree, &tree->root, query, NULL, NULL, NULL);
+	hash_refresh (tree, query);
+}
+
+void ph5_split (ph5_t* tree, ph5_query_t* query, ph5_t* out_tree)
+{
+	if (!tree || !query || !out_tree || tree == out_tree)
+	{
+		return;
+	}
+
+	merge_context_t context = {out_tree, tree, NULL, NULL};
+
+	node_remove_if (tree, &tree->root, query, NULL, NULL, &context);
+	hash_refresh (tree, query);
+	hash_refresh (out_tree, query);
+}
+
+/*
+ * everything a diff needs to carry through its recursion
+ */
+typedef struct diff_context_t
+{
+	phtree_diff_function_t added;
+	phtree_diff_function_t removed;
+	phtree_diff_function_t changed;
+	phtree_equal_function_t equal;
+	void* data;
+	// both trees keep hashes, so subtrees with the same hash are the same
+	bool hashed;
+} diff_context_t;
+
+/*
+ * report every entry under node as added, or as removed
+ */
+static void diff_subtree (diff_context_t* context, ph5_node_t* node, bool added)
+{
+	phtree_diff_function_t function = added ? context->added : context->removed;
+
+	if (!function)
+	{
+		return;
+	}
+
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		ph5_node_t* child = &node->children[iter];
+
+		if (phtree_node_is_leaf (node))
+		{
+			function (&child->point, added ? NULL : child->children, added ? child->children : NULL, context->data);
+		}
+		else
+		{
+			diff_subtree (context, child, added);
+		}
+	}
+}
+
+/*
+ * both nodes use the same children array, which copy on write snapshots of a tree do for unchanged subtrees
+ */
+static bool diff_shared (ph5_node_t* node_a, ph5_node_t* node_b)
+{
+	return (node_a->children == node_b->children
+		&& node_a->active_children == node_b->active_children
+		&& node_a->child_count == node_b->child_count
+		&& node_a->postfix_length == node_b->postfix_length
+		&& point_equal (&node_a->point, &node_b->point));
+}
+
+static void diff_nodes (diff_context_t* context, ph5_node_t* old_node, ph5_node_t* new_node);
+
+/*
+ * outer has a longer postfix than inner
+ * 	so inner is either under one of outer's children or outside of outer altogether
+ * outer_old is true when outer is from the old tree
+ */
+static void diff_nested (diff_context_t* context, ph5_node_t* outer, ph5_node_t* inner, bool outer_old)
+{
+	if (!phtree_node_is_root (outer) && !prefix_equal (&outer->point, &inner->point, outer->postfix_length))
+	{
+		diff_subtree (context, outer, !outer_old);
+		diff_subtree (context, inner, outer_old);
+
+		return;
+	}
+
+	hypercube_address_t address = calculate_hypercube_address (&inner->point, outer);
+	int inner_index = child_active (outer, address) ? (int) child_index (outer, address) : -1;
+
+	for (int iter = 0; iter < outer->child_count; iter++)
+	{
+		ph5_node_t* child = &outer->children[iter];
+
+		if (iter != inner_index)
+		{
+			diff_subtree (context, child, !outer_old);
+		}
+		else if (outer_old)
+		{
+			diff_nodes (context, child, inner);
+		}
+		else
+		{
+			diff_nodes (context, inner, child);
+		}
+	}
+
+	if (inner_index < 0)
+	{
+		diff_subtree (context, inner, outer_old);
+	}
+}
+
+/*
+ * old_node and new_node are at the same place in their trees
+ */
+static void diff_nodes (diff_context_t* context, ph5_node_t* old_node, ph5_node_t* new_node)
+{
+	if (diff_shared (old_node, new_node))
+	{
+		return;
+	}
+
+#ifdef PHTREE_HASHES
+	// the root's hash is not kept
+	if (context->hashed && !phtree_node_is_root (old_node) && old_node->hash == new_node->hash
+		&& old_node->postfix_length == new_node->postfix_length && point_equal (&old_node->point, &new_node->point))
+	{
+		return;
+	}
+#endif
+
+	if (old_node->postfix_length != new_node->postfix_length)
+	{
+		if (old_node->postfix_length > new_node->postfix_length)
+		{
+			diff_nested (context, old_node, new_node, true);
+		}
+		else
+		{
+			diff_nested (context, new_node, old_node, false);
+		}
+
+		return;
+	}
+
+	if (!phtree_node_is_root (old_node) && !prefix_equal (&old_node->point, &new_node->point, old_node->postfix_length))
+	{
+		diff_subtree (context, old_node, false);
+		diff_subtree (context, new_node, true);
+
+		return;
+	}
+
+	bool leaf = phtree_node_is_leaf (old_node);
+	int old_index = 0;
+	int new_index = 0;
+
+	// children arrays are in address order, so both are walked in one pass
+	for (unsigned int iter = 0; iter < NODE_CHILD_MAX; iter++)
+	{
+		ph5_node_t* old_child = child_active (old_node, iter) ? &old_node->children[old_index++] : NULL;
+		ph5_node_t* new_child = child_active (new_node, iter) ? &new_node->children[new_index++] : NULL;
+
+		if (old_child && new_child)
+		{
+			if (!leaf)
+			{
+				diff_nodes (context, old_child, new_child);
+			}
+			else if (context->changed && old_child->children != new_child->children
+				&& !(context->equal && context->equal (old_child->children, new_child->children, context->data)))
+			{
+				context->changed (&new_child->point, old_child->children, new_child->children, context->data);
+			}
+		}
+		else if (old_child)
+		{
+			if (leaf)
+			{
+				if (context->removed)
+				{
+					context->removed (&old_child->point, old_child->children, NULL, context->data);
+				}
+			}
+			else
+			{
+				diff_subtree (context, old_child, false);
+			}
+		}
+		else if (new_child)
+		{
+			if (leaf)
+			{
+				if (context->added)
+				{
+					context->added (&new_child->point, NULL, new_child->children, context->data);
+				}
+			}
+			else
+			{
+				diff_subtree (context, new_child, true);
+			}
+		}
+	}
+}
+
+void ph5_diff (ph5_t* old_tree, ph5_t* new_tree, phtree_diff_function_t added, phtree_diff_function_t removed, phtree_diff_function_t changed, phtree_equal_function_t equal, void* data)
+{
+	if (!old_tree || !new_tree || old_tree == new_tree)
+	{
+		return;
+	}
+
+	diff_context_t context = {added, removed, changed, equal, data, false};
+#ifdef PHTREE_HASHES
+	context.hashed = old_tree->element_hash && new_tree->element_hash;
+#endif
+
+	diff_nodes (&context, &old_tree->root, &new_tree->root);
+}
+
+#ifdef PHTREE_HASHES
+void ph5_hash_enable (ph5_t* tree, uint64_t (*element_hash) (void* element))
+{
+	if (!tree)
+	{
+		return;
+	}
+
+	tree->element_hash = element_hash;
+	hash_refresh (tree, NULL);
+}
+
+void ph5_hash_update (ph5_t* tree, ph5_point_t* point)
+{
+	ph5_node_t* entry = tree ? ph5_find_entry (tree, point) : NULL;
+
+	if (!entry || !tree->element_hash)
+	{
+		return;
+	}
+
+	uint64_t hash = hash_entry (tree, entry);
+	hash_path_add (tree, point, hash - entry->hash);
+	entry->hash = hash;
+}
+
+uint64_t ph5_hash (ph5_t* tree)
+{
+	uint64_t hash = 0;
+
+	for (int iter = 0; tree && tree->element_hash && iter < tree->root.child_count; iter++)
+	{
+		hash += tree->root.children[iter].hash;
+	}
+
+	return hash;
+}
+
+/*
+ * the first prefix_length bits of every dimension are the same in both points
+ */
+static bool prefix_length_equal (ph5_point_t* point_a, ph5_point_t* point_b, int prefix_length)
+{
+	if (prefix_length <= 0)
+	{
+		return true;
+	}
+
+	if (prefix_length >= PHTREE16_BIT_WIDTH)
+	{
+		return point_equal (point_a, point_b);
+	}
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		if ((point_a->values[dimension] ^ point_b->values[dimension]) >> (PHTREE16_BIT_WIDTH - prefix_length))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * how many leading bits of every dimension all of the points under a child of node share
+ * 	entries are a single point
+ */
+static int child_prefix_length (ph5_node_t* node, ph5_node_t* child)
+{
+	return phtree_node_is_leaf (node) ? PHTREE16_BIT_WIDTH : PHTREE16_BIT_WIDTH - 1 - child->postfix_length;
+}
+
+uint64_t ph5_hash_prefix (ph5_t* tree, ph5_point_t* point, int prefix_length)
+{
+	if (!tree || !tree->element_hash || prefix_length <= 0)
+	{
+		return ph5_hash (tree);
+	}
+
+	ph5_node_t* node = &tree->root;
+
+	// every step goes at least one level down, and a leaf always returns
+	for (int depth = 0; depth <= PHTREE_DEPTH; depth++)
+	{
+		hypercube_address_t address = calculate_hypercube_address (point, node);
+
+		if (!child_active (node, address))
+		{
+			return 0;
+		}
+
+		ph5_node_t* child = &node->children[child_index (node, address)];
+		int child_length = child_prefix_length (node, child);
+
+		if (!prefix_length_equal (point, &child->point, child_length < prefix_length ? child_length : prefix_length))
+		{
+			return 0;
+		}
+
+		// child is the whole region, or all of the region there is
+		if (child_length >= prefix_length || phtree_node_is_leaf (node))
+		{
+			return child->hash;
+		}
+
+		node = child;
+	}
+
+	return 0;
+}
+
+typedef struct sync_context_t
+{
+	phtree_region_function_t function;
+	void* data;
+} sync_context_t;
+
+static void sync_region (sync_context_t* context, ph5_node_t* parent, ph5_node_t* child)
+{
+	context->function (&child->point, child_prefix_length (parent, child), context->data);
+}
+
+static void sync_nodes (sync_context_t* context, ph5_node_t* parent_a, ph5_node_t* node_a, ph5_node_t* parent_b, ph5_node_t* node_b);
+
+/*
+ * like diff_nested
+ * 	outer has a longer postfix than inner
+ */
+static void sync_nested (sync_context_t* context, ph5_node_t* outer_parent, ph5_node_t* outer, ph5_node_t* inner_parent, ph5_node_t* inner)
+{
+	if (!phtree_node_is_root (outer) && !prefix_equal (&outer->point, &inner->point, outer->postfix_length))
+	{
+		sync_region (context, outer_parent, outer);
+		sync_region (context, inner_parent, inner);
+
+		return;
+	}
+
+	hypercube_address_t address = calculate_hypercube_address (&inner->point, outer);
+	int inner_index = child_active (outer, address) ? (int) child_index (outer, address) : -1;
+
+	for (int iter = 0; iter < outer->child_count; iter++)
+	{
+		if (iter != inner_index)
+		{
+			sync_region (context, outer, &outer->children[iter]);
+		}
+		else
+		{
+			sync_nodes (context, outer, &outer->children[iter], inner_parent, inner);
+		}
+	}
+
+	if (inner_index < 0)
+	{
+		sync_region (context, inner_parent, inner);
+	}
+}
+
+/*
+ * node_a and node_b are at the same place in their trees
+ * 	parents are NULL for the roots
+ */
+static void sync_nodes (sync_context_t* context, ph5_node_t* parent_a, ph5_node_t* node_a, ph5_node_t* parent_b, ph5_node_t* node_b)
+{
+	if (node_a->postfix_length != node_b->postfix_length)
+	{
+		if (node_a->postfix_length > node_b->postfix_length)
+		{
+			sync_nested (context, parent_a, node_a, parent_b, node_b);
+		}
+		else
+		{
+			sync_nested (context, parent_b, node_b, parent_a, node_a);
+		}
+
+		return;
+	}
+
+	if (!phtree_node_is_root (node_a))
+	{
+		if (!prefix_equal (&node_a->point, &node_b->point, node_a->postfix_length))
+		{
+			sync_region (context, parent_a, node_a);
+			sync_region (context, parent_b, node_b);
+
+			return;
+		}
+
+		if (node_a->hash == node_b->hash)
+		{
+			return;
+		}
+	}
+
+	bool leaf = phtree_node_is_leaf (node_a);
+	int index_a = 0;
+	int index_b = 0;
+
+	for (unsigned int iter = 0; iter < NODE_CHILD_MAX; iter++)
+	{
+		ph5_node_t* child_a = child_active (node_a, iter) ? &node_a->children[index_a++] : NULL;
+		ph5_node_t* child_b = child_active (node_b, iter) ? &node_b->children[index_b++] : NULL;
+
+		if (child_a && child_b)
+		{
+			if (!leaf)
+			{
+				sync_nodes (context, node_a, child_a, node_b, child_b);
+			}
+			else if (child_a->hash != child_b->hash)
+			{
+				sync_region (context, node_a, child_a);
+			}
+		}
+		else if (child_a || child_b)
+		{
+			sync_region (context, child_a ? node_a : node_b, child_a ? child_a : child_b);
+		}
+	}
+}
+
+void ph5_sync_plan (ph5_t* tree_a, ph5_t* tree_b, phtree_region_function_t function, void* data)
+{
+	if (!tree_a || !tree_b || !function || !tree_a->element_hash || !tree_b->element_hash)
+	{
+		return;
+	}
+
+	sync_context_t context = {function, data};
+
+	sync_nodes (&context, NULL, &tree_a->root, NULL, &tree_b->root);
+}
+#endif
+
+
+/*
+ * check if the tree is empty
+ */
+bool ph5_empty (ph5_t* tree)
+{
+	return (tree->root.child_count == 0);
+}
+
+/*
+ * the header at the start of a saved tree
+ * 	written byte by byte, so the layout does not depend on struct padding
+ * 		magic[4] version[4] byte_order[2] bit_width[1] dimensions[1] depth[1] reserved[3]
+ */
+#define SAVE_HEADER_SIZE 16
+#define SAVE_BYTE_ORDER UINT16_C(0x0102)
+
+/*
+ * every node is written as
+ * 	active_children, infix_length[1], postfix_length[1], point
+ * followed by its children
+ * 	leaves are followed by the points of all of their entries, then each entry's element
+ */
+#define SAVE_NODE_SIZE (sizeof (uint32_t) + 2 + sizeof (ph5_point_t))
+
+typedef struct save_context_t
+{
+	phtree_write_function_t write;
+	void* stream;
+	phtree_element_save_function_t element_save;
+	void* data;
+} save_context_t;
+
+typedef struct load_context_t
+{
+	ph5_t* tree;
+	phtree_read_function_t read;
+	void* stream;
+	phtree_element_load_function_t element_load;
+	void* data;
+} load_context_t;
+
+static void save_header (uint8_t header[SAVE_HEADER_SIZE])
+{
+	uint32_t version = PHTREE_FILE_VERSION;
+	uint16_t byte_order = SAVE_BYTE_ORDER;
+
+	memset (header, 0, SAVE_HEADER_SIZE);
+	memcpy (header, "PHTR", 4);
+	memcpy (header + 4, &version, sizeof (version));
+	memcpy (header + 8, &byte_order, sizeof (byte_order));
+	header[10] = PHTREE16_BIT_WIDTH;
+	header[11] = DIMENSIONS;
+	header[12] = PHTREE_DEPTH;
+}
+
+static bool node_save (save_context_t* context, ph5_node_t* node)
+{
+	uint8_t record[SAVE_NODE_SIZE];
+
+	memcpy (record, &node->active_children, sizeof (node->active_children));
+	record[sizeof (node->active_children)] = (uint8_t) node->infix_length;
+	record[sizeof (node->active_children) + 1] = (uint8_t) node->postfix_length;
+	memcpy (record + sizeof (node->active_children) + 2, &node->point, sizeof (ph5_point_t));
+
+	if (!context->write (context->stream, record, sizeof (record)))
+	{
+		return false;
+	}
+
+	if (!phtree_node_is_leaf (node))
+	{
+		for (int iter = 0; iter < node->child_count; iter++)
+		{
+			if (!node_save (context, &node->children[iter]))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	ph5_point_t points[NODE_CHILD_MAX];
+
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		points[iter] = node->children[iter].point;
+	}
+
+	if (!context->write (context->stream, points, node->child_count * sizeof (ph5_point_t)))
+	{
+		return false;
+	}
+
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		if (!context->element_save (node->children[iter].children, context->write, context->stream, context->data))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool ph5_save (ph5_t* tree, phtree_write_function_t write, void* stream, phtree_element_save_function_t element_save, void* data)
+{
+	if (!tree || !write || !element_save)
+	{
+		return false;
+	}
+
+	uint8_t header[SAVE_HEADER_SIZE];
+	save_header (header);
+
+	if (!write (stream, header, sizeof (header)))
+	{
+		return false;
+	}
+
+	save_context_t context = {write, stream, element_save, data};
+
+	return node_save (&context, &tree->root);
+}
+
+/*
+ * the address of the child at index, from the node's active_children
+ */
+static hypercube_address_t child_address (ph5_node_t* node, int index)
+{
+	hypercube_address_t address = 0;
+
+	for (int found = -1; address < NODE_CHILD_MAX; address++)
+	{
+		if (child_active (node, address) && ++found == index)
+		{
+			break;
+		}
+	}
+
+	return address;
+}
+
+/*
+ * free what node_load has loaded under node so far
+ */
+static void node_load_abort (ph5_t* tree, ph5_node_t* node)
+{
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		if (phtree_node_is_leaf (node))
+		{
+			entry_free (tree, &node->children[iter]);
+		}
+		else
+		{
+			free_nodes (tree, &node->children[iter]);
+		}
+	}
+
+	tree->node_children_free (node);
+	node->children = NULL;
+	node->child_count = 0;
+	node->child_capacity = 0;
+}
+
+/*
+ * read a node and everything under it
+ * 	parent is NULL for the root
+ * on failure nothing under node is left allocated
+ */
+static bool node_load (load_context_t* context, ph5_node_t* parent, ph5_node_t* node)
+{
+	uint8_t record[SAVE_NODE_SIZE];
+	uint32_t active_children;
+	ph5_point_t point;
+
+	if (!context->read (context->stream, record, sizeof (record)))
+	{
+		return false;
+	}
+
+	memcpy (&active_children, record, sizeof (active_children));
+	int infix_length = (int8_t) record[sizeof (active_children)];
+	int postfix_length = (int8_t) record[sizeof (active_children) + 1];
+	memcpy (&point, record + sizeof (active_children) + 2, sizeof (point));
+
+	int parent_postfix_length = parent ? parent->postfix_length : PHTREE_DEPTH;
+	int child_count = (int) popcount (active_children);
+
+	// the lengths have to fit under the parent, the root has no infix, and only real children can be active
+	if (infix_length < 0 || postfix_length < 0 || postfix_length + infix_length + 1 != parent_postfix_length
+		|| (!parent && infix_length != 0)
+		|| (active_children & ((PHTREE_CHILD_FLAG << (CHILD_SHIFT + 1 - NODE_CHILD_MAX)) - 1))
+		|| (parent && child_count == 0))
+	{
+		return false;
+	}
+
+	node_set (node, infix_length, postfix_length, &point);
+
+	// a node's point has to be under its parent, at the address the parent has it at
+	if (parent
+		&& ((!phtree_node_is_root (parent) && !prefix_equal (&node->point, &parent->point, parent->postfix_length))
+			|| calculate_hypercube_address (&node->point, parent) != child_address (parent, (int) (node - parent->children))))
+	{
+		return false;
+	}
+
+	node->active_children = active_children;
+	node->children = NULL;
+	node->child_capacity = 0;
+
+	if (child_count == 0)
+	{
+		return true;
+	}
+
+#ifndef PHTREE_NO_STDLIB
+	node_children_allocate (context->tree, node, child_count);
+#else
+	node_children_take (context->tree, node);
+	node_children_reserve (context->tree, node, child_count);
+#endif
+
+	if (!phtree_node_is_leaf (node))
+	{
+		for (int iter = 0; iter < child_count; iter++)
+		{
+			if (!node_load (context, node, &node->children[iter]))
+			{
+				node_load_abort (context->tree, node);
+
+				return false;
+			}
+
+			node->child_count++;
+		}
+
+		return true;
+	}
+
+	ph5_point_t points[NODE_CHILD_MAX];
+
+	if (!context->read (context->stream, points, child_count * sizeof (ph5_point_t)))
+	{
+		node_load_abort (context->tree, node);
+
+		return false;
+	}
+
+	for (int iter = 0; iter < child_count; iter++)
+	{
+		ph5_node_t* entry = &node->children[iter];
+
+		memset (entry, 0, sizeof (ph5_node_t));
+		entry->point = points[iter];
+
+		if (!prefix_equal (&entry->point, &node->point, 0)
+			|| calculate_hypercube_address (&entry->point, node) != child_address (node, iter))
+		{
+			node_load_abort (context->tree, node);
+
+			return false;
+		}
+
+		entry->children = context->element_load (context->read, context->stream, context->data);
+
+		if (!entry->children)
+		{
+			node_load_abort (context->tree, node);
+
+			return false;
+		}
+
+		node->child_count++;
+	}
+
+	return true;
+}
+
+bool ph5_load (ph5_t* tree, phtree_read_function_t read, void* stream, phtree_element_load_function_t element_load, void* data)
+{
+	if (!tree || !read || !element_load)
+	{
+		return false;
+	}
+
+	ph5_clear (tree);
+
+	uint8_t header[SAVE_HEADER_SIZE];
+	uint8_t expected[SAVE_HEADER_SIZE];
+	save_header (expected);
+
+	if (!read (stream, header, sizeof (header)) || memcmp (header, expected, sizeof (header)) != 0)
+	{
+		return false;
+	}
+
+	load_context_t context = {tree, read, stream, element_load, data};
+	bool loaded = node_load (&context, NULL, &tree->root);
+
+	// a tree which failed to load has been emptied by node_load_abort, so only a loaded tree needs its hashes
+	if (loaded)
+	{
+		hash_refresh (tree, NULL);
+	}
+
+	return loaded;
+}
+
+/*
+ * the compressed format
+ *
+ * the header is the same as ph5_save's, with magic "PHTZ"
+ * 	followed by the number of bits the tree's shape takes [8]
+ * then the shape, bit packed, then every element in depth first order
+ *
+ * a node's point is its parent's point down to the parent's postfix bit
+ * 	then its address in the parent, then its infix bits
+ * 		so only the infix bits are stored
+ * 	and an entry's point is its leaf's point with its address as the last bit
+ * 		so entries do not store anything but their element
+ *
+ * every node is
+ * 	its children as either
+ * 		0 then a bit for every address
+ * 		1 then child_count - 1 and each child's address, in DIMENSIONS bits each
+ * 	whichever is smaller
+ * 	and unless it is a leaf, for every child
+ * 		infix_length + 1 as an elias gamma code, which is 1 bit for the common infix_length of 0
+ * 		infix_length bits for every dimension
+ * 		then the child's node
+ */
+#define COMPRESSED_HEADER_SIZE (SAVE_HEADER_SIZE + 8)
+#define COMPRESSED_BUFFER_SIZE 4096
+
+typedef struct bit_writer_t
+{
+	// NULL only counts bits
+	phtree_write_function_t write;
+	void* stream;
+	uint64_t bits;
+	uint64_t pending;
+	int pending_count;
+	size_t buffer_size;
+	bool failed;
+	uint8_t buffer[COMPRESSED_BUFFER_SIZE];
+} bit_writer_t;
+
+typedef struct bit_reader_t
+{
+	phtree_read_function_t read;
+	void* stream;
+	// bits of the shape which have not been read from the stream yet
+	uint64_t bits_left;
+	uint64_t pending;
+	int pending_count;
+	size_t buffer_size;
+	size_t buffer_position;
+	bool failed;
+	uint8_t buffer[COMPRESSED_BUFFER_SIZE];
+} bit_reader_t;
+
+static void bit_writer_flush (bit_writer_t* writer)
+{
+	if (writer->buffer_size > 0 && !writer->write (writer->stream, writer->buffer, writer->buffer_size))
+	{
+		writer->failed = true;
+	}
+
+	writer->buffer_size = 0;
+}
+
+// count is at most 32
+static void bits_write_small (bit_writer_t* writer, uint64_t value, int count)
+{
+	writer->bits += count;
+
+	if (!writer->write)
+	{
+		return;
+	}
+
+	writer->pending |= (value & ((UINT64_C(1) << count) - 1)) << writer->pending_count;
+	writer->pending_count += count;
+
+	while (writer->pending_count >= 8)
+	{
+		writer->buffer[writer->buffer_size++] = (uint8_t) writer->pending;
+		writer->pending >>= 8;
+		writer->pending_count -= 8;
+
+		if (writer->buffer_size == COMPRESSED_BUFFER_SIZE)
+		{
+			bit_writer_flush (writer);
+		}
+	}
+}
+
+static void bits_write (bit_writer_t* writer, uint64_t value, int count)
+{
+	for (; count > 32; count -= 32, value >>= 32)
+	{
+		bits_write_small (writer, value, 32);
+	}
+
+	if (count > 0)
+	{
+		bits_write_small (writer, value, count);
+	}
+}
+
+static uint64_t bits_read_small (bit_reader_t* reader, int count)
+{
+	while (reader->pending_count < count)
+	{
+		if (reader->buffer_position == reader->buffer_size)
+		{
+			uint64_t bytes_left = (reader->bits_left + 7) / 8;
+			reader->buffer_size = bytes_left < COMPRESSED_BUFFER_SIZE ? (size_t) bytes_left : COMPRESSED_BUFFER_SIZE;
+			reader->buffer_position = 0;
+
+			if (reader->buffer_size == 0 || !reader->read (reader->stream, reader->buffer, reader->buffer_size))
+			{
+				reader->failed = true;
+				reader->buffer_size = 0;
+
+				return 0;
+			}
+
+			reader->bits_left -= reader->bits_left < reader->buffer_size * 8 ? reader->bits_left : reader->buffer_size * 8;
+		}
+
+		reader->pending |= (uint64_t) reader->buffer[reader->buffer_position++] << reader->pending_count;
+		reader->pending_count += 8;
+	}
+
+	uint64_t value = reader->pending & ((UINT64_C(1) << count) - 1);
+	reader->pending >>= count;
+	reader->pending_count -= count;
+
+	return value;
+}
+
+static uint64_t bits_read (bit_reader_t* reader, int count)
+{
+	uint64_t value = 0;
+
+	for (int shift = 0; shift < count; shift += 32)
+	{
+		int piece = count - shift < 32 ? count - shift : 32;
+		value |= bits_read_small (reader, piece) << shift;
+	}
+
+	return value;
+}
+
+static void gamma_write (bit_writer_t* writer, uint64_t value)
+{
+	int length = 64 - (int) count_leading_zeroes (value);
+
+	bits_write (writer, 0, length - 1);
+
+	// the top bit first, so the reader knows when the zeros end
+	for (int bit = length - 1; bit >= 0; bit--)
+	{
+		bits_write (writer, (value >> bit) & 1, 1);
+	}
+}
+
+static uint64_t gamma_read (bit_reader_t* reader)
+{
+	int zeros = 0;
+
+	while (!reader->failed && bits_read (reader, 1) == 0)
+	{
+		// nothing written by gamma_write has more than 7 bits
+		if (++zeros > 7)
+		{
+			reader->failed = true;
+
+			return 0;
+		}
+	}
+
+	uint64_t value = 1;
+
+	for (int bit = 0; bit < zeros; bit++)
+	{
+		value = (value << 1) | bits_read (reader, 1);
+	}
+
+	return value;
+}
+
+static void node_compress (bit_writer_t* writer, ph5_node_t* node)
+{
+	int list_bits = DIMENSIONS * (node->child_count + 1);
+
+	if (node->child_count == 0 || (int) NODE_CHILD_MAX <= list_bits)
+	{
+		uint64_t bitmap = 0;
+
+		for (hypercube_address_t address = 0; address < NODE_CHILD_MAX; address++)
+		{
+			bitmap |= (uint64_t) (child_active (node, address) ? 1 : 0) << address;
+		}
+
+		bits_write (writer, 0, 1);
+		bits_write (writer, bitmap, NODE_CHILD_MAX);
+	}
+	else
+	{
+		bits_write (writer, 1, 1);
+		bits_write (writer, node->child_count - 1, DIMENSIONS);
+
+		for (int iter = 0; iter < node->child_count; iter++)
+		{
+			bits_write (writer, calculate_hypercube_address (&node->children[iter].point, node), DIMENSIONS);
+		}
+	}
+
+	if (phtree_node_is_leaf (node))
+	{
+		return;
+	}
+
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		ph5_node_t* child = &node->children[iter];
+
+		gamma_write (writer, child->infix_length + 1);
+
+		for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+		{
+			bits_write (writer, child->point.values[dimension] >> (child->postfix_length + 1), child->infix_length);
+		}
+
+		node_compress (writer, child);
+	}
+}
+
+static bool elements_save (save_context_t* context, ph5_node_t* node)
+{
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		bool saved = phtree_node_is_leaf (node)
+			? context->element_save (node->children[iter].children, context->write, context->stream, context->data)
+			: elements_save (context, &node->children[iter]);
+
+		if (!saved)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool ph5_save_compressed (ph5_t* tree, phtree_write_function_t write, void* stream, phtree_element_save_function_t element_save, void* data)
+{
+	if (!tree || !write || !element_save)
+	{
+		return false;
+	}
+
+	// the first pass only counts the bits, so the reader knows where the elements start
+	bit_writer_t writer = {0};
+	node_compress (&writer, &tree->root);
+
+	uint8_t header[COMPRESSED_HEADER_SIZE];
+	save_header (header);
+	memcpy (header, "PHTZ", 4);
+	memcpy (header + SAVE_HEADER_SIZE, &writer.bits, sizeof (writer.bits));
+
+	if (!write (stream, header, sizeof (header)))
+	{
+		return false;
+	}
+
+	writer = (bit_writer_t) {0};
+	writer.write = write;
+	writer.stream = stream;
+	node_compress (&writer, &tree->root);
+
+	// the last partial byte
+	bits_write (&writer, 0, (8 - writer.pending_count) & 7);
+	bit_writer_flush (&writer);
+
+	save_context_t context = {write, stream, element_save, data};
+
+	return !writer.failed && elements_save (&context, &tree->root);
+}
+
+/*
+ * read a node's children and everything under them
+ * 	the node's point and lengths are already set
+ * every node which is counted in its parent has its children array
+ * 	so a failure part way can be cleaned up with ph5_clear
+ */
+static bool node_decompress (bit_reader_t* reader, ph5_t* tree, ph5_node_t* node)
+{
+	hypercube_address_t addresses[NODE_CHILD_MAX];
+	int child_count = 0;
+
+	if (bits_read (reader, 1) == 0)
+	{
+		uint64_t bitmap = bits_read (reader, NODE_CHILD_MAX);
+
+		for (hypercube_address_t address = 0; address < NODE_CHILD_MAX; address++)
+		{
+			if ((bitmap >> address) & 1)
+			{
+				addresses[child_count++] = address;
+			}
+		}
+	}
+	else
+	{
+		child_count = (int) bits_read (reader, DIMENSIONS) + 1;
+
+		for (int iter = 0; iter < child_count; iter++)
+		{
+			addresses[iter] = (hypercube_address_t) bits_read (reader, DIMENSIONS);
+
+			// addresses are written in order, so a repeated one is corruption
+			if (iter > 0 && addresses[iter] <= addresses[iter - 1])
+			{
+				return false;
+			}
+		}
+	}
+
+	if (reader->failed || (child_count == 0 && !phtree_node_is_root (node)))
+	{
+		return false;
+	}
+
+	node->active_children = 0;
+
+	for (int iter = 0; iter < child_count; iter++)
+	{
+		node->active_children |= PHTREE_CHILD_FLAG << (CHILD_SHIFT - addresses[iter]);
+	}
+
+	node->children = NULL;
+	node->child_capacity = 0;
+	node->child_count = 0;
+
+	if (child_count == 0)
+	{
+		return true;
+	}
+
+#ifndef PHTREE_NO_STDLIB
+	node_children_allocate (tree, node, child_count);
+#else
+	node_children_take (tree, node);
+	node_children_reserve (tree, node, child_count);
+#endif
+
+	if (phtree_node_is_leaf (node))
+	{
+		for (int iter = 0; iter < child_count; iter++)
+		{
+			ph5_node_t* entry = &node->children[iter];
+
+			memset (entry, 0, sizeof (ph5_node_t));
+
+			for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+			{
+				phtree_key_t bit = (addresses[iter] >> (DIMENSIONS - 1 - dimension)) & 1;
+				entry->point.values[dimension] = (node->point.values[dimension] & ~PHTREE16_KEY_ONE) | bit;
+			}
+		}
+
+		node->child_count = child_count;
+
+		return true;
+	}
+
+	for (int iter = 0; iter < child_count; iter++)
+	{
+		ph5_node_t* child = &node->children[iter];
+		int infix_length = (int) gamma_read (reader) - 1;
+		int postfix_length = node->postfix_length - infix_length - 1;
+		ph5_point_t point;
+
+		if (reader->failed || infix_length < 0 || postfix_length < 0)
+		{
+			return false;
+		}
+
+		for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+		{
+			phtree_key_t key = node->point.values[dimension];
+			phtree_key_t bit = (addresses[iter] >> (DIMENSIONS - 1 - dimension)) & 1;
+			phtree_key_t infix = (phtree_key_t) bits_read (reader, infix_length);
+
+			// the parent's prefix, then the address bit, then the infix
+			// 	shifting twice so the root does not shift by the full bit width
+			key = (key >> node->postfix_length >> 1) << 1 | bit;
+			key = (key << infix_length) | infix;
+			point.values[dimension] = key << postfix_length << 1;
+		}
+
+		node_set (child, infix_length, postfix_length, &point);
+		child->children = NULL;
+		child->child_capacity = 0;
+
+		node->child_count++;
+
+		if (!node_decompress (reader, tree, child))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool elements_load (load_context_t* context, ph5_node_t* node)
+{
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		ph5_node_t* child = &node->children[iter];
+
+		if (phtree_node_is_leaf (node))
+		{
+			child->children = context->element_load (context->read, context->stream, context->data);
+
+			if (!child->children)
+			{
+				return false;
+			}
+		}
+		else if (!elements_load (context, child))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool ph5_load_compressed (ph5_t* tree, phtree_read_function_t read, void* stream, phtree_element_load_function_t element_load, void* data)
+{
+	if (!tree || !read || !element_load)
+	{
+		return false;
+	}
+
+	ph5_clear (tree);
+
+	uint8_t header[COMPRESSED_HEADER_SIZE];
+	uint8_t expected[SAVE_HEADER_SIZE];
+	save_header (expected);
+	memcpy (expected, "PHTZ", 4);
+
+	if (!read (stream, header, sizeof (header)) || memcmp (header, expected, sizeof (expected)) != 0)
+	{
+		return false;
+	}
+
+	bit_reader_t reader = {0};
+	reader.read = read;
+	reader.stream = stream;
+	memcpy (&reader.bits_left, header + SAVE_HEADER_SIZE, sizeof (reader.bits_left));
+
+	bool loaded = node_decompress (&reader, tree, &tree->root);
+
+	// the whole shape has to be used, and nothing more than the padding of the last byte
+	loaded = loaded && !reader.failed && reader.bits_left == 0 && reader.buffer_position == reader.buffer_size
+		&& reader.pending_count < 8 && reader.pending == 0;
+
+	load_context_t context = {tree, read, stream, element_load, data};
+
+	if (!loaded || !elements_load (&context, &tree->root))
+	{
+		ph5_clear (tree);
+
+		return false;
+	}
+
+	hash_refresh (tree, NULL);
+
+	return true;
+}
+
+#ifndef PHTREE_NO_STDLIB
+static bool file_write (void* stream, const void* bytes, size_t size)
+{
+	return fwrite (bytes, 1, size, stream) == size;
+}
+
+static bool file_read (void* stream, void* bytes, size_t size)
+{
+	return fread (bytes, 1, size, stream) == size;
+}
+
+bool ph5_save_file (ph5_t* tree, const char* path, phtree_element_save_function_t element_save, void* data)
+{
+	FILE* file = fopen (path, "wb");
+
+	if (!file)
+	{
+		return false;
+	}
+
+	bool saved = ph5_save (tree, file_write, file, element_save, data);
+
+	// fclose is what finally writes the buffered bytes, so it can fail too
+	return (fclose (file) == 0) && saved;
+}
+
+bool ph5_load_file (ph5_t* tree, const char* path, phtree_element_load_function_t element_load, void* data)
+{
+	FILE* file = fopen (path, "rb");
+
+	if (!file)
+	{
+		return false;
+	}
+
+	bool loaded = ph5_load (tree, file_read, file, element_load, data);
+	fclose (file);
+
+	return loaded;
+}
+
+bool ph5_save_compressed_file (ph5_t* tree, const char* path, phtree_element_save_function_t element_save, void* data)
+{
+	FILE* file = fopen (path, "wb");
+
+	if (!file)
+	{
+		return false;
+	}
+
+	bool saved = ph5_save_compressed (tree, file_write, file, element_save, data);
+
+	return (fclose (file) == 0) && saved;
+}
+
+bool ph5_load_compressed_file (ph5_t* tree, const char* path, phtree_element_load_function_t element_load, void* data)
+{
+	FILE* file = fopen (path, "rb");
+
+	if (!file)
+	{
+		return false;
+	}
+
+	bool loaded = ph5_load_compressed (tree, file_read, file, element_load, data);
+	fclose (file);
+
+	return loaded;
+}
+#endif
+
+/*
+ * run a window query on a specific node
+ */
+static void node_query_masks (ph5_node_t* node, ph5_query_t* query, phtree_key_t* lower, phtree_key_t* upper)
+{
+	/*
+	 * these masks are used to accelerate queries
+	 * 	when iterating children
+	 * 		we can do a broad check if a child node overlaps the query window at all
+	 * 		without needing to go to the child node and performing node_in_window
+	 * 		
+	 * 	if the child node does not overlap the query window
+	 * 		we save a memory jump to that node
+	 */
+	phtree_key_t mask_lower = 0;
+	phtree_key_t mask_upper = 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		/*
+		 * for these >= to work properly
+		 * 	node->point has to be set to the mid point of the node
+		 * 	we set node->point to the mid point, during node creation
+		 * 		so we dont have to calculate it here
+		 */
+		mask_lower <<= 1;
+		mask_lower |= query->min.values[dimension] >= node->point.values[dimension];
+
+		mask_upper <<= 1;
+		mask_upper |= query->max.values[dimension] >= node->point.values[dimension];
+	}
+
+	*lower = mask_lower;
+	*upper = mask_upper;
+}
+
+static void node_query_window (ph5_node_t* node, ph5_query_t* query, void* data)
+{
+	if (!prefix_in_window (node, query))
+	{
+		return;
+	}
+
+	phtree_key_t mask_lower;
+	phtree_key_t mask_upper;
+	node_query_masks (node, query, &mask_lower, &mask_upper);
+
+	if (phtree_node_is_leaf (node))
+	{
+		for (int iter = 0; iter < NODE_CHILD_MAX; iter++)
+		{
+			if (child_active (node, iter) && ((iter | mask_lower) & mask_upper) == iter)
+			{
+				ph5_node_t* child = &node->children[child_index (node, iter)];
+
+				if (point_in_window (child, query))
+				{
+					query->function (child->children, data);
+				}
+			}
+		}
+
+		return;
+	}
+
+	// if the node _is_ in the window and _is not_ a leaf
+	// 	recurse through the node's children
+	for (unsigned int iter = 0; iter < NODE_CHILD_MAX; iter++)
+	{
+		if (child_active (node, iter) && ((iter | mask_lower) & mask_upper) == iter)
+		{
+			node_query_window (&node->children[child_index (node, iter)], query, data);
+		}
+	}
+}
+
+/*
+ * run a window query on a tree
+ */
+void ph5_query (ph5_t* tree, ph5_query_t* query, void* data)
+{
+	if (!tree || !query || !query->function)
+	{
+		return;
+	}
+
+	for (int iter = 0; iter < tree->root.child_count; iter++)
+	{
+		node_query_window (&tree->root.children[iter], query, data);
+	}
+}
+
+/*
+ * mapped files are
+ * 	a header of MAPPED_HEADER_SIZE bytes
+ * 		magic[4] version[4] byte_order[2] bit_width[1] dimensions[1] depth[1] reserved[1] node_size[2]
+ * 	the elements
+ * 	the root node, then every children array, breadth first
+ * 	a footer of MAPPED_FOOTER_SIZE bytes
+ * 		root_offset[8] node_count[8] entry_count[8] magic[4] reserved[4]
+ */
+#define MAPPED_HEADER_SIZE 64
+#define MAPPED_FOOTER_SIZE 32
+#define MAPPED_ALIGNMENT 8
+
+static void mapped_header (uint8_t header[MAPPED_HEADER_SIZE])
+{
+	uint32_t version = PHTREE_FILE_VERSION;
+	uint16_t byte_order = SAVE_BYTE_ORDER;
+	uint16_t node_size = sizeof (ph5_mapped_node_t);
+
+	memset (header, 0, MAPPED_HEADER_SIZE);
+	memcpy (header, "PHTM", 4);
+	memcpy (header + 4, &version, sizeof (version));
+	memcpy (header + 8, &byte_order, sizeof (byte_order));
+	header[10] = PHTREE16_BIT_WIDTH;
+	header[11] = DIMENSIONS;
+	header[12] = PHTREE_DEPTH;
+	memcpy (header + 14, &node_size, sizeof (node_size));
+}
+
+#ifndef PHTREE_NO_STDLIB
+typedef struct mapped_write_context_t
+{
+	phtree_write_function_t write;
+	void* stream;
+	// how many bytes have been written
+	uint64_t position;
+	// the tree's nodes (not entries), in the order they are laid out
+	ph5_node_t** queue;
+	uint64_t* element_offsets;
+} mapped_write_context_t;
+
+// element_save writes through this, so the position of every element is known
+static bool mapped_write_counted (void* stream, const void* bytes, size_t size)
+{
+	mapped_write_context_t* context = stream;
+
+	if (!context->write (context->stream, bytes, size))
+	{
+		return false;
+	}
+
+	context->position += size;
+
+	return true;
+}
+
+static bool mapped_write_padding (mapped_write_context_t* context)
+{
+	static const uint8_t zeroes[MAPPED_ALIGNMENT] = {0};
+	size_t padding = (MAPPED_ALIGNMENT - (context->position % MAPPED_ALIGNMENT)) % MAPPED_ALIGNMENT;
+
+	return padding == 0 || mapped_write_counted (context, zeroes, padding);
+}
+
+static void mapped_count (mapped_write_context_t* context, ph5_node_t* node, uint64_t* node_count, uint64_t* entry_count)
+{
+	(*node_count)++;
+
+	if (phtree_node_is_leaf (node))
+	{
+		*entry_count += node->child_count;
+
+		return;
+	}
+
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		mapped_count (context, &node->children[iter], node_count, entry_count);
+	}
+}
+
+static ph5_mapped_node_t mapped_node_from (ph5_node_t* node, uint64_t offset)
+{
+	ph5_mapped_node_t mapped_node;
+
+	// zeroed so the padding written to the file is always the same
+	memset (&mapped_node, 0, sizeof (mapped_node));
+	mapped_node.point = node->point;
+	mapped_node.offset = offset;
+	mapped_node.active_children = node->active_children;
+	mapped_node.child_count = node->child_count;
+	mapped_node.infix_length = node->infix_length;
+	mapped_node.postfix_length = node->postfix_length;
+
+	return mapped_node;
+}
+
+bool ph5_mapped_write (ph5_t* tree, phtree_write_function_t write, void* stream, phtree_element_save_function_t element_save, void* data)
+{
+	if (!tree || !write || !element_save)
+	{
+		return false;
+	}
+
+	mapped_write_context_t context = {write, stream, 0, NULL, NULL};
+	uint64_t node_count = 0;
+	uint64_t entry_count = 0;
+	mapped_count (&context, &tree->root, &node_count, &entry_count);
+
+	context.queue = malloc (node_count * sizeof (ph5_node_t*));
+	context.element_offsets = malloc ((entry_count ? entry_count : 1) * sizeof (uint64_t));
+
+	uint8_t header[MAPPED_HEADER_SIZE];
+	mapped_header (header);
+
+	bool written = context.queue && context.element_offsets && mapped_write_counted (&context, header, sizeof (header));
+
+	// the queue is filled breadth first once, then used by both passes below
+	uint64_t queue_count = 0;
+
+	if (written)
+	{
+		context.queue[queue_count++] = &tree->root;
+
+		for (uint64_t iter = 0; iter < queue_count; iter++)
+		{
+			ph5_node_t* node = context.queue[iter];
+
+			for (int child = 0; !phtree_node_is_leaf (node) && child < node->child_count; child++)
+			{
+				context.queue[queue_count++] = &node->children[child];
+			}
+		}
+	}
+
+	// the elements, in the order their entries are laid out
+	uint64_t entry_iter = 0;
+
+	for (uint64_t iter = 0; written && iter < queue_count; iter++)
+	{
+		ph5_node_t* node = context.queue[iter];
+
+		for (int child = 0; phtree_node_is_leaf (node) && child < node->child_count && written; child++)
+		{
+			context.element_offsets[entry_iter++] = context.position;
+			written = element_save (node->children[child].children, mapped_write_counted, &context, data)
+				&& mapped_write_padding (&context);
+		}
+	}
+
+	/*
+	 * the nodes
+	 * 	the root's children start right after the root
+	 * 	every children array after that starts where the one before it ends
+	 * 		and they are written in the order their offsets are handed out
+	 */
+	uint64_t root_offset = context.position;
+	uint64_t next_offset = root_offset + sizeof (ph5_mapped_node_t);
+	ph5_mapped_node_t record = mapped_node_from (&tree->root, next_offset);
+	next_offset += tree->root.child_count * sizeof (ph5_mapped_node_t);
+	written = written && mapped_write_counted (&context, &record, sizeof (record));
+	entry_iter = 0;
+
+	for (uint64_t iter = 0; written && iter < queue_count; iter++)
+	{
+		ph5_node_t* node = context.queue[iter];
+
+		for (int child = 0; child < node->child_count && written; child++)
+		{
+			ph5_node_t* child_node = &node->children[child];
+
+			if (phtree_node_is_leaf (node))
+			{
+				record = mapped_node_from (child_node, context.element_offsets[entry_iter++]);
+			}
+			else
+			{
+				record = mapped_node_from (child_node, next_offset);
+				next_offset += child_node->child_count * sizeof (ph5_mapped_node_t);
+			}
+
+			written = mapped_write_counted (&context, &record, sizeof (record));
+		}
+	}
+
+	uint8_t footer[MAPPED_FOOTER_SIZE] = {0};
+	memcpy (footer, &root_offset, sizeof (uint64_t));
+	memcpy (footer + 8, &node_count, sizeof (uint64_t));
+	memcpy (footer + 16, &entry_count, sizeof (uint64_t));
+	memcpy (footer + 24, "PHTM", 4);
+	written = written && mapped_write_counted (&context, footer, sizeof (footer));
+
+	free (context.queue);
+	free (context.element_offsets);
+
+	return written;
+}
+
+bool ph5_mapped_write_file (ph5_t* tree, const char* path, phtree_element_save_function_t element_save, void* data)
+{
+	FILE* file = fopen (path, "wb");
+
+	if (!file)
+	{
+		return false;
+	}
+
+	bool written = ph5_mapped_write (tree, file_write, file, element_save, data);
+
+	return (fclose (file) == 0) && written;
+}
+#endif
+
+bool ph5_mapped_open_memory (ph5_mapped_t* mapped, void* bytes, size_t size)
+{
+	*mapped = (ph5_mapped_t) {0};
+
+	uint8_t header[MAPPED_HEADER_SIZE];
+	mapped_header (header);
+
+	if (!bytes || (uintptr_t) bytes % MAPPED_ALIGNMENT != 0
+		|| size < MAPPED_HEADER_SIZE + sizeof (ph5_mapped_node_t) + MAPPED_FOOTER_SIZE
+		|| memcmp (bytes, header, sizeof (header)) != 0)
+	{
+		return false;
+	}
+
+	uint8_t* footer = (uint8_t*) bytes + size - MAPPED_FOOTER_SIZE;
+	uint64_t root_offset;
+
+	memcpy (&root_offset, footer, sizeof (uint64_t));
+
+	if (memcmp (footer + 24, "PHTM", 4) != 0
+		|| root_offset % MAPPED_ALIGNMENT != 0
+		|| root_offset < MAPPED_HEADER_SIZE
+		|| root_offset > size - MAPPED_FOOTER_SIZE - sizeof (ph5_mapped_node_t))
+	{
+		return false;
+	}
+
+	mapped->base = bytes;
+	mapped->size = size;
+	mapped->root = (ph5_mapped_node_t*) (mapped->base + root_offset);
+	memcpy (&mapped->node_count, footer + 8, sizeof (uint64_t));
+	memcpy (&mapped->entry_count, footer + 16, sizeof (uint64_t));
+
+	return true;
+}
+
+#ifndef PHTREE_NO_STDLIB
+bool ph5_mapped_open (ph5_mapped_t* mapped, const char* path)
+{
+	*mapped = (ph5_mapped_t) {0};
+
+#ifdef PHTREE_MMAP
+	int file = open (path, O_RDONLY);
+	struct stat status;
+
+	if (file < 0)
+	{
+		return false;
+	}
+
+	if (fstat (file, &status) != 0 || status.st_size <= 0)
+	{
+		close (file);
+
+		return false;
+	}
+
+	size_t size = (size_t) status.st_size;
+	void* bytes = mmap (NULL, size, PROT_READ, MAP_SHARED, file, 0);
+
+	// the mapping stays valid after the file is closed
+	close (file);
+
+	if (bytes == MAP_FAILED)
+	{
+		return false;
+	}
+
+	if (!ph5_mapped_open_memory (mapped, bytes, size))
+	{
+		munmap (bytes, size);
+
+		return false;
+	}
+
+	mapped->mapped = true;
+#else
+	FILE* file = fopen (path, "rb");
+
+	if (!file)
+	{
+		return false;
+	}
+
+	long size = -1;
+
+	if (fseek (file, 0, SEEK_END) == 0)
+	{
+		size = ftell (file);
+	}
+
+	// malloc is aligned for any type, which is enough for the nodes
+	void* bytes = size > 0 ? malloc ((size_t) size) : NULL;
+
+	if (!bytes || fseek (file, 0, SEEK_SET) != 0 || fread (bytes, 1, (size_t) size, file) != (size_t) size
+		|| !ph5_mapped_open_memory (mapped, bytes, (size_t) size))
+	{
+		free (bytes);
+		fclose (file);
+
+		return false;
+	}
+
+	fclose (file);
+	mapped->allocated = true;
+#endif
+
+	return true;
+}
+#endif
+
+void ph5_mapped_close (ph5_mapped_t* mapped)
+{
+#if !defined (PHTREE_NO_STDLIB) && defined (PHTREE_MMAP)
+	if (mapped->mapped)
+	{
+		munmap (mapped->base, mapped->size);
+	}
+#endif
+
+#ifndef PHTREE_NO_STDLIB
+	if (mapped->allocated)
+	{
+		free (mapped->base);
+	}
+#endif
+
+	*mapped = (ph5_mapped_t) {0};
+}
+
+/*
+ * a node's children in the file
+ * 	NULL if the node has none, or they would be outside of the file
+ */
+static ph5_mapped_node_t* mapped_children (ph5_mapped_t* mapped, ph5_mapped_node_t* node)
+{
+	uint64_t end = mapped->size - MAPPED_FOOTER_SIZE;
+
+	if (node->child_count <= 0 || node->offset % MAPPED_ALIGNMENT != 0
+		|| node->offset > end || (uint64_t) node->child_count * sizeof (ph5_mapped_node_t) > end - node->offset)
+	{
+		return NULL;
+	}
+
+	return (ph5_mapped_node_t*) (mapped->base + node->offset);
+}
+
+static void* mapped_element (ph5_mapped_t* mapped, ph5_mapped_node_t* entry)
+{
+	return entry->offset < mapped->size && entry->offset % MAPPED_ALIGNMENT == 0 ? mapped->base + entry->offset : NULL;
+}
+
+/*
+ * a ph5_node_t with the parts of a mapped node the node helpers look at
+ * 	so the same window and address code is used for both kinds of tree
+ */
+static ph5_node_t mapped_node_view (ph5_mapped_node_t* mapped_node)
+{
+	ph5_node_t node;
+
+	node.point = mapped_node->point;
+	node.children = NULL;
+	node.active_children = mapped_node->active_children;
+	node.child_capacity = 0;
+	node.child_count = mapped_node->child_count;
+	node.infix_length = mapped_node->infix_length;
+	node.postfix_length = mapped_node->postfix_length;
+
+	return node;
+}
+
+void* ph5_mapped_find (ph5_mapped_t* mapped, ph5_point_t* point)
+{
+	if (!mapped || !mapped->root)
+	{
+		return NULL;
+	}
+
+	ph5_mapped_node_t* current = mapped->root;
+
+	// bounded by the depth, even if the file is corrupt
+	for (int depth = 0; depth <= PHTREE_DEPTH; depth++)
+	{
+		ph5_node_t node = mapped_node_view (current);
+		hypercube_address_t address = calculate_hypercube_address (point, &node);
+		ph5_mapped_node_t* children = mapped_children (mapped, current);
+
+		if (!children || !child_active (&node, address)
+			|| (!phtree_node_is_root (&node) && !prefix_equal (point, &node.point, node.postfix_length)))
+		{
+			return NULL;
+		}
+
+		int index = child_index (&node, address);
+
+		if (index >= node.child_count)
+		{
+			return NULL;
+		}
+
+		if (phtree_node_is_leaf (&node))
+		{
+			return point_equal (point, &children[index].point) ? mapped_element (mapped, &children[index]) : NULL;
+		}
+
+		current = &children[index];
+	}
+
+	return NULL;
+}
+
+/*
+ * query is NULL for for_each
+ */
+static void mapped_query_window (ph5_mapped_t* mapped, ph5_mapped_node_t* mapped_node, ph5_query_t* query, phtree_iteration_function_t function, void* data, int depth)
+{
+	ph5_node_t node = mapped_node_view (mapped_node);
+	ph5_mapped_node_t* children = mapped_children (mapped, mapped_node);
+
+	if (!children || depth > PHTREE_DEPTH
+		|| (query && !phtree_node_is_root (&node) && !prefix_in_window (&node, query)))
+	{
+		return;
+	}
+
+	phtree_key_t mask_lower = 0;
+	phtree_key_t mask_upper = NODE_CHILD_MAX - 1;
+
+	if (query)
+	{
+		node_query_masks (&node, query, &mask_lower, &mask_upper);
+	}
+
+	for (unsigned int iter = 0; iter < NODE_CHILD_MAX; iter++)
+	{
+		if (!child_active (&node, iter) || ((iter | mask_lower) & mask_upper) != iter)
+		{
+			continue;
+		}
+
+		int index = child_index (&node, iter);
+
+		if (index >= node.child_count)
+		{
+			return;
+		}
+
+		ph5_mapped_node_t* child = &children[index];
+
+		if (!phtree_node_is_leaf (&node))
+		{
+			mapped_query_window (mapped, child, query, function, data, depth + 1);
+		}
+		else if (!query || window_contains (query, &child->point))
+		{
+			void* element = mapped_element (mapped, child);
+
+			if (element)
+			{
+				function (element, data);
+			}
+		}
+	}
+}
+
+void ph5_mapped_query (ph5_mapped_t* mapped, ph5_query_t* query, void* data)
+{
+	if (!mapped || !mapped->root || !query || !query->function)
+	{
+		return;
+	}
+
+	mapped_query_window (mapped, mapped->root, query, query->function, data, 0);
+}
+
+void ph5_mapped_for_each (ph5_mapped_t* mapped, phtree_iteration_function_t function, void* data)
+{
+	if (!mapped || !mapped->root || !function)
+	{
+		return;
+	}
+
+	mapped_query_window (mapped, mapped->root, NULL, function, data, 0);
+}
+
+#ifndef PHTREE_NO_STDLIB
+#define PAGED_FOOTER_SIZE 32
+
+/*
+ * the mapped header with its own magic, and the page size at byte 16
+ * 	the first page of the file is the header, padded to a whole page
+ */
+static void paged_header (uint8_t header[MAPPED_HEADER_SIZE], uint32_t page_size)
+{
+	mapped_header (header);
+	memcpy (header, "PHTP", 4);
+	memcpy (header + 16, &page_size, sizeof (page_size));
+}
+
+typedef struct paged_buffer_t
+{
+	uint8_t* bytes;
+	size_t size;
+	size_t capacity;
+} paged_buffer_t;
+
+static bool paged_buffer_write (void* stream, const void* bytes, size_t size)
+{
+	paged_buffer_t* buffer = stream;
+
+	if (buffer->size + size > buffer->capacity)
+	{
+		size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+
+		while (capacity < buffer->size + size)
+		{
+			capacity *= 2;
+		}
+
+		uint8_t* bytes_grown = realloc (buffer->bytes, capacity);
+
+		if (!bytes_grown)
+		{
+			return false;
+		}
+
+		buffer->bytes = bytes_grown;
+		buffer->capacity = capacity;
+	}
+
+	memcpy (buffer->bytes + buffer->size, bytes, size);
+	buffer->size += size;
+
+	return true;
+}
+
+static bool paged_buffer_align (paged_buffer_t* buffer)
+{
+	static const uint8_t zeroes[MAPPED_ALIGNMENT] = {0};
+	size_t padding = (MAPPED_ALIGNMENT - (buffer->size % MAPPED_ALIGNMENT)) % MAPPED_ALIGNMENT;
+
+	return padding == 0 || paged_buffer_write (buffer, zeroes, padding);
+}
+
+typedef struct paged_write_context_t
+{
+	phtree_write_function_t write;
+	void* stream;
+	phtree_element_save_function_t element_save;
+	void* data;
+	uint32_t page_size;
+	int pinned_depth;
+
+	// the page being filled, which is page page_count of the file
+	uint8_t* page;
+	uint64_t page_used;
+	uint64_t page_count;
+
+	/*
+	 * the pinned levels, written after the last page
+	 * 	offsets in to them are from the start of top until the pages are done
+	 * 		fixups holds where each of those records is, so they can be moved to offsets from the start of the file
+	 */
+	paged_buffer_t top;
+	paged_buffer_t fixups;
+	// the elements of the leaf being written
+	paged_buffer_t elements;
+	// a children array of records for every level, filled before the array is placed
+	ph5_mapped_node_t* records;
+
+	uint64_t node_count;
+	uint64_t entry_count;
+} paged_write_context_t;
+
+static bool paged_flush_page (paged_write_context_t* context)
+{
+	memset (context->page + context->page_used, 0, context->page_size - context->page_used);
+
+	if (!context->write (context->stream, context->page, context->page_size))
+	{
+		return false;
+	}
+
+	context->page_count++;
+	context->page_used = 0;
+
+	return true;
+}
+
+static bool paged_fixup (paged_write_context_t* context, uint64_t position)
+{
+	return paged_buffer_write (&context->fixups, &position, sizeof (position));
+}
+
+/*
+ * place node's children array, and its children's arrays before it
+ * 	*offset is where the array went, and *top if it is an offset in to the pinned levels
+ */
+static bool paged_write_children (paged_write_context_t* context, ph5_node_t* node, int depth, uint64_t* offset, bool* top)
+{
+	ph5_mapped_node_t* records = context->records + depth * NODE_CHILD_MAX;
+	// which children's records hold an offset in to the pinned levels
+	uint64_t top_children = 0;
+	bool leaf = phtree_node_is_leaf (node);
+
+	context->node_count++;
+	*offset = 0;
+	*top = false;
+
+	if (node->child_count <= 0 || depth > PHTREE_DEPTH)
+	{
+		return node->child_count <= 0;
+	}
+
+	if (leaf)
+	{
+		context->entry_count += node->child_count;
+		context->elements.size = 0;
+
+		for (int iter = 0; iter < node->child_count; iter++)
+		{
+			// from the start of the elements until the array is placed
+			records[iter] = mapped_node_from (&node->children[iter], context->elements.size);
+
+			if (!context->element_save (node->children[iter].children, paged_buffer_write, &context->elements, context->data)
+				|| !paged_buffer_align (&context->elements))
+			{
+				return false;
+			}
+		}
+	}
+	else
+	{
+		for (int iter = 0; iter < node->child_count; iter++)
+		{
+			uint64_t child_offset;
+			bool child_top;
+
+			if (!paged_write_children (context, &node->children[iter], depth + 1, &child_offset, &child_top))
+			{
+				return false;
+			}
+
+			records[iter] = mapped_node_from (&node->children[iter], child_offset);
+			top_children |= (uint64_t) child_top << iter;
+		}
+	}
+
+	uint64_t record_size = node->child_count * sizeof (ph5_mapped_node_t);
+	uint64_t element_size = leaf ? context->elements.size : 0;
+	uint64_t start;
+
+	if (depth >= context->pinned_depth)
+	{
+		if (record_size + element_size > context->page_size
+			|| (context->page_used + record_size + element_size > context->page_size && !paged_flush_page (context)))
+		{
+			return false;
+		}
+
+		start = context->page_count * context->page_size + context->page_used;
+	}
+	else
+	{
+		start = context->top.size;
+		*top = true;
+	}
+
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		if (leaf)
+		{
+			records[iter].offset += start + record_size;
+		}
+
+		if (*top && (leaf || (top_children >> iter) & 1)
+			&& !paged_fixup (context, start + iter * sizeof (ph5_mapped_node_t)))
+		{
+			return false;
+		}
+	}
+
+	*offset = start;
+
+	if (*top)
+	{
+		return paged_buffer_write (&context->top, records, record_size)
+			&& (element_size == 0 || paged_buffer_write (&context->top, context->elements.bytes, element_size));
+	}
+
+	memcpy (context->page + context->page_used, records, record_size);
+
+	if (element_size)
+	{
+		memcpy (context->page + context->page_used + record_size, context->elements.bytes, element_size);
+	}
+
+	context->page_used += record_size + element_size;
+
+	return true;
+}
+
+bool ph5_paged_write (ph5_t* tree, phtree_write_function_t write, void* stream, phtree_element_save_function_t element_save, void* data, uint32_t page_size, int pinned_depth)
+{
+	if (page_size == 0)
+	{
+		page_size = PHTREE_PAGE_SIZE;
+	}
+
+	if (!tree || !write || !element_save || page_size % MAPPED_ALIGNMENT != 0 || page_size < MAPPED_HEADER_SIZE)
+	{
+		return false;
+	}
+
+	paged_write_context_t context = {0};
+	context.write = write;
+	context.stream = stream;
+	context.element_save = element_save;
+	context.data = data;
+	context.page_size = page_size;
+	context.pinned_depth = pinned_depth < 0 ? PHTREE_PAGED_DEPTH : pinned_depth;
+	context.page = malloc (page_size);
+	context.records = malloc ((PHTREE_DEPTH + 1) * NODE_CHILD_MAX * sizeof (ph5_mapped_node_t));
+
+	bool written = context.page && context.records;
+
+	if (written)
+	{
+		paged_header (context.page, page_size);
+		context.page_used = MAPPED_HEADER_SIZE;
+		written = paged_flush_page (&context);
+	}
+
+	uint64_t root_offset = 0;
+	bool root_top = false;
+	written = written && paged_write_children (&context, &tree->root, 0, &root_offset, &root_top);
+
+	if (written && context.page_used > 0)
+	{
+		written = paged_flush_page (&context);
+	}
+
+	// the root is the last record of the pinned levels
+	ph5_mapped_node_t root = mapped_node_from (&tree->root, root_offset);
+	written = written
+		&& (!root_top || paged_fixup (&context, context.top.size))
+		&& paged_buffer_write (&context.top, &root, sizeof (root));
+
+	uint64_t top_offset = context.page_count * page_size;
+
+	for (size_t iter = 0; written && iter < context.fixups.size / sizeof (uint64_t); iter++)
+	{
+		uint64_t position;
+		memcpy (&position, context.fixups.bytes + iter * sizeof (uint64_t), sizeof (uint64_t));
+		memcpy (&root, context.top.bytes + position, sizeof (root));
+		root.offset += top_offset;
+		memcpy (context.top.bytes + position, &root, sizeof (root));
+	}
+
+	uint8_t footer[PAGED_FOOTER_SIZE] = {0};
+	memcpy (footer, &top_offset, sizeof (uint64_t));
+	memcpy (footer + 8, &context.node_count, sizeof (uint64_t));
+	memcpy (footer + 16, &context.entry_count, sizeof (uint64_t));
+	memcpy (footer + 24, "PHTP", 4);
+
+	written = written
+		&& write (stream, context.top.bytes, context.top.size)
+		&& write (stream, footer, sizeof (footer));
+
+	free (context.page);
+	free (context.records);
+	free (context.top.bytes);
+	free (context.fixups.bytes);
+	free (context.elements.bytes);
+
+	return written;
+}
+
+bool ph5_paged_write_file (ph5_t* tree, const char* path, phtree_element_save_function_t element_save, void* data, uint32_t page_size, int pinned_depth)
+{
+	FILE* file = fopen (path, "wb");
+
+	if (!file)
+	{
+		return false;
+	}
+
+	bool written = ph5_paged_write (tree, file_write, file, element_save, data, page_size, pinned_depth);
+
+	return (fclose (file) == 0) && written;
+}
+
+static bool paged_read (void* file, int descriptor, uint64_t offset, void* bytes, size_t size)
+{
+#ifdef PHTREE_MMAP
+	(void) file;
+
+	while (size > 0)
+	{
+		ssize_t count = pread (descriptor, bytes, size, (off_t) offset);
+
+		if (count <= 0)
+		{
+			return false;
+		}
+
+		bytes = (uint8_t*) bytes + count;
+		offset += count;
+		size -= count;
+	}
+
+	return true;
+#else
+	(void) descriptor;
+#ifdef _WIN32
+	int seeked = _fseeki64 (file, (__int64) offset, SEEK_SET);
+#else
+	int seeked = fseek (file, (long) offset, SEEK_SET);
+#endif
+
+	return seeked == 0 && fread (bytes, 1, size, file) == size;
+#endif
+}
+
+static uint64_t paged_file_size (void* file, int descriptor)
+{
+#ifdef PHTREE_MMAP
+	(void) file;
+	struct stat status;
+
+	return fstat (descriptor, &status) == 0 && status.st_size > 0 ? (uint64_t) status.st_size : 0;
+#else
+	(void) descriptor;
+#ifdef _WIN32
+	__int64 size = _fseeki64 (file, 0, SEEK_END) == 0 ? _ftelli64 (file) : -1;
+#else
+	long size = fseek (file, 0, SEEK_END) == 0 ? ftell (file) : -1;
+#endif
+
+	return size > 0 ? (uint64_t) size : 0;
+#endif
+}
+
+bool ph5_paged_open (ph5_paged_t* paged, const char* path, size_t cache_pages)
+{
+	*paged = (ph5_paged_t) {0};
+	paged->descriptor = -1;
+
+#ifdef PHTREE_MMAP
+	paged->descriptor = open (path, O_RDONLY);
+
+	if (paged->descriptor < 0)
+	{
+		return false;
+	}
+#else
+	paged->file = fopen (path, "rb");
+
+	if (!paged->file)
+	{
+		return false;
+	}
+#endif
+
+	uint64_t size = paged_file_size (paged->file, paged->descriptor);
+	uint8_t header[MAPPED_HEADER_SIZE];
+	uint8_t expected[MAPPED_HEADER_SIZE];
+	uint8_t footer[PAGED_FOOTER_SIZE];
+	uint32_t page_size = 0;
+
+	bool opened = size >= MAPPED_HEADER_SIZE + PAGED_FOOTER_SIZE
+		&& paged_read (paged->file, paged->descriptor, 0, header, sizeof (header))
+		&& paged_read (paged->file, paged->descriptor, size - PAGED_FOOTER_SIZE, footer, sizeof (footer));
+
+	if (opened)
+	{
+		memcpy (&page_size, header + 16, sizeof (page_size));
+		paged_header (expected, page_size);
+		memcpy (&paged->top_offset, footer, sizeof (uint64_t));
+		memcpy (&paged->node_count, footer + 8, sizeof (uint64_t));
+		memcpy (&paged->entry_count, footer + 16, sizeof (uint64_t));
+
+		opened = memcmp (header, expected, sizeof (header)) == 0
+			&& memcmp (footer + 24, "PHTP", 4) == 0
+			&& page_size >= MAPPED_HEADER_SIZE && page_size % MAPPED_ALIGNMENT == 0
+			&& paged->top_offset >= page_size && paged->top_offset % page_size == 0
+			&& paged->top_offset / page_size < UINT32_MAX
+			&& paged->top_offset <= size - PAGED_FOOTER_SIZE - sizeof (ph5_mapped_node_t);
+	}
+
+	if (opened)
+	{
+		paged->page_size = page_size;
+		paged->page_count = paged->top_offset / page_size;
+		paged->top_size = size - PAGED_FOOTER_SIZE - paged->top_offset;
+		paged->top = malloc (paged->top_size);
+
+		if (cache_pages == 0)
+		{
+			cache_pages = PHTREE_PAGED_CACHE;
+		}
+
+		// page 0 is the header, which is never cached
+		paged->frame_count = paged->page_count - 1 < cache_pages ? paged->page_count - 1 : cache_pages;
+		paged->frame_count = paged->frame_count ? paged->frame_count : 1;
+		paged->frames = malloc (paged->frame_count * page_size);
+		paged->frame_pages = malloc (paged->frame_count * sizeof (uint64_t));
+		paged->frame_referenced = calloc (paged->frame_count, 1);
+		paged->page_frames = malloc (paged->page_count * sizeof (uint32_t));
+
+		opened = paged->top && paged->frames && paged->frame_pages && paged->frame_referenced && paged->page_frames
+			&& paged->top_size % MAPPED_ALIGNMENT == 0
+			&& paged_read (paged->file, paged->descriptor, paged->top_offset, paged->top, paged->top_size);
+	}
+
+	if (!opened)
+	{
+		ph5_paged_close (paged);
+		return false;
+	}
+
+	memset (paged->page_frames, 0xff, paged->page_count * sizeof (uint32_t));
+	memcpy (&paged->root, paged->top + paged->top_size - sizeof (ph5_mapped_node_t), sizeof (ph5_mapped_node_t));
+
+	return true;
+}
+
+void ph5_paged_close (ph5_paged_t* paged)
+{
+#ifdef PHTREE_MMAP
+	if (paged->descriptor >= 0)
+	{
+		close (paged->descriptor);
+	}
+#else
+	if (paged->file)
+	{
+		fclose (paged->file);
+	}
+#endif
+
+	free (paged->top);
+	free (paged->frames);
+	free (paged->frame_pages);
+	free (paged->frame_referenced);
+	free (paged->page_frames);
+
+	*paged = (ph5_paged_t) {0};
+	paged->descriptor = -1;
+}
+
+/*
+ * the cached copy of a page, read in to the cache if it is not there
+ * 	evicting a page with the clock algorithm once the cache is full
+ * this can evict any page, so pointers in to other pages are not valid after it
+ */
+static uint8_t* paged_page (ph5_paged_t* paged, uint64_t page)
+{
+	if (page == 0 || page >= paged->page_count)
+	{
+		return NULL;
+	}
+
+	uint32_t frame = paged->page_frames[page];
+
+	if (frame != UINT32_MAX)
+	{
+		paged->frame_referenced[frame] = 1;
+		paged->page_hits++;
+
+		return paged->frames + (size_t) frame * paged->page_size;
+	}
+
+	if (paged->frames_used < paged->frame_count)
+	{
+		frame = paged->frames_used++;
+	}
+	else
+	{
+		while (paged->frame_referenced[paged->hand])
+		{
+			paged->frame_referenced[paged->hand] = 0;
+			paged->hand = (paged->hand + 1) % paged->frame_count;
+		}
+
+		frame = paged->hand;
+		paged->hand = (paged->hand + 1) % paged->frame_count;
+		paged->page_frames[paged->frame_pages[frame]] = UINT32_MAX;
+	}
+
+	uint8_t* bytes = paged->frames + (size_t) frame * paged->page_size;
+	paged->page_reads++;
+
+	if (!paged_read (paged->file, paged->descriptor, page * paged->page_size, bytes, paged->page_size))
+	{
+		// the frame holds nothing, page 0 is never looked up
+		paged->frame_pages[frame] = 0;
+		paged->failed = true;
+
+		return NULL;
+	}
+
+	paged->page_frames[page] = frame;
+	paged->frame_pages[frame] = page;
+	paged->frame_referenced[frame] = 1;
+
+	return bytes;
+}
+
+/*
+ * size bytes at offset, from the pinned levels or the cache
+ * 	NULL if they are outside of the file, cross the end of a page, or could not be read
+ */
+static uint8_t* paged_bytes (ph5_paged_t* paged, uint64_t offset, uint64_t size)
+{
+	if (offset % MAPPED_ALIGNMENT != 0)
+	{
+		return NULL;
+	}
+
+	if (offset >= paged->top_offset)
+	{
+		uint64_t position = offset - paged->top_offset;
+
+		return position < paged->top_size && size <= paged->top_size - position ? paged->top + position : NULL;
+	}
+
+	uint64_t position = offset % paged->page_size;
+
+	if (size > paged->page_size - position)
+	{
+		return NULL;
+	}
+
+	uint8_t* page = paged_page (paged, offset / paged->page_size);
+
+	return page ? page + position : NULL;
+}
+
+static ph5_mapped_node_t* paged_children (ph5_paged_t* paged, ph5_mapped_node_t* node)
+{
+	if (node->child_count <= 0)
+	{
+		return NULL;
+	}
+
+	return (ph5_mapped_node_t*) paged_bytes (paged, node->offset, (uint64_t) node->child_count * sizeof (ph5_mapped_node_t));
+}
+
+void* ph5_paged_find (ph5_paged_t* paged, ph5_point_t* point)
+{
+	if (!paged || !paged->top)
+	{
+		return NULL;
+	}
+
+	// a copy, since reading the next page can evict the one it is in
+	ph5_mapped_node_t current = paged->root;
+
+	for (int depth = 0; depth <= PHTREE_DEPTH; depth++)
+	{
+		ph5_node_t node = mapped_node_view (&current);
+		hypercube_address_t address = calculate_hypercube_address (point, &node);
+
+		if (!child_active (&node, address)
+			|| (!phtree_node_is_root (&node) && !prefix_equal (point, &node.point, node.postfix_length)))
+		{
+			return NULL;
+		}
+
+		int index = child_index (&node, address);
+		ph5_mapped_node_t* children = paged_children (paged, &current);
+
+		if (!children || index >= node.child_count)
+		{
+			return NULL;
+		}
+
+		current = children[index];
+
+		if (phtree_node_is_leaf (&node))
+		{
+			// a leaf's elements are in the same page as its entries
+			return point_equal (point, &current.point) ? paged_bytes (paged, current.offset, 0) : NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * query is NULL for for_each
+ * 	like mapped_query_window, but mapped_node is a copy and the children are looked up again after anything which could read a page
+ */
+static void paged_query_window (ph5_paged_t* paged, ph5_mapped_node_t* mapped_node, ph5_query_t* query, phtree_iteration_function_t function, void* data, int depth)
+{
+	ph5_node_t node = mapped_node_view (mapped_node);
+
+	if (mapped_node->child_count <= 0 || depth > PHTREE_DEPTH
+		|| (query && !phtree_node_is_root (&node) && !prefix_in_window (&node, query)))
+	{
+		return;
+	}
+
+	phtree_key_t mask_lower = 0;
+	phtree_key_t mask_upper = NODE_CHILD_MAX - 1;
+
+	if (query)
+	{
+		node_query_masks (&node, query, &mask_lower, &mask_upper);
+	}
+
+	ph5_mapped_node_t* children = NULL;
+
+	for (unsigned int iter = 0; iter < NODE_CHILD_MAX; iter++)
+	{
+		if (!child_active (&node, iter) || ((iter | mask_lower) & mask_upper) != iter)
+		{
+			continue;
+		}
+
+		int index = child_index (&node, iter);
+
+		if (index >= node.child_count || (!children && !(children = paged_children (paged, mapped_node))))
+		{
+			return;
+		}
+
+		ph5_mapped_node_t child = children[index];
+
+		if (!phtree_node_is_leaf (&node))
+		{
+			paged_query_window (paged, &child, query, function, data, depth + 1);
+			children = NULL;
+		}
+		else if (!query || window_contains (query, &child.point))
+		{
+			void* element = paged_bytes (paged, child.offset, 0);
+
+			if (element)
+			{
+				function (element, data);
+				children = NULL;
+			}
+		}
+	}
+}
+
+void ph5_paged_query (ph5_paged_t* paged, ph5_query_t* query, void* data)
+{
+	if (!paged || !paged->top || !query || !query->function)
+	{
+		return;
+	}
+
+	ph5_mapped_node_t root = paged->root;
+	paged_query_window (paged, &root, query, query->function, data, 0);
+}
+
+void ph5_paged_for_each (ph5_paged_t* paged, phtree_iteration_function_t function, void* data)
+{
+	if (!paged || !paged->top || !function)
+	{
+		return;
+	}
+
+	ph5_mapped_node_t root = paged->root;
+	paged_query_window (paged, &root, NULL, function, data, 0);
+}
+#endif
+
+/*
+ * query_set does not need to convert external values in to internal points/keys
+ * so it needs to be its own function
+ */
+void ph5_query_set (ph5_query_t* query, ph5_point_t* min, ph5_point_t* max, phtree_iteration_function_t function)
+{
+	ph5_query_clear (query);
+
+	query->min = *min;
+	query->max = *max;
+
+	// make sure min and max are properly populated
+	// 	all minimum values in min
+	// 	all maximum values in max
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		if (query->max.values[dimension] < query->min.values[dimension])
+		{
+			phtree_key_t temp = query->min.values[dimension];
+			query->min.values[dimension] = query->max.values[dimension];
+			query->max.values[dimension] = temp;
+		}
+	}
+
+	query->function = function;
+}
+
+ph5_query_t ph5_query_create (void* min, void* max, phtree_iteration_function_t function)
+{
+	ph5_query_t query;
+	ph5_query_set (&query, min, max, function);
+
+	return query;
+}
+
+/*
+ * a query for every point which shares the first prefix_length bits of every dimension with point
+ */
+void ph5_query_prefix_set (ph5_query_t* query, ph5_point_t* point, int prefix_length, phtree_iteration_function_t function)
+{
+	phtree_key_t postfix_mask = 0;
+
+	if (prefix_length < PHTREE16_BIT_WIDTH)
+	{
+		postfix_mask = PHTREE16_KEY_MAX >> (prefix_length > 0 ? prefix_length : 0);
+	}
+
+	ph5_point_t min;
+	ph5_point_t max;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		min.values[dimension] = point->values[dimension] & ~postfix_mask;
+		max.values[dimension] = point->values[dimension] | postfix_mask;
+	}
+
+	ph5_query_set (query, &min, &max, function);
+}
+
+
+/*
+ * clear a window query
+ */
+void ph5_query_clear (ph5_query_t* query)
+{
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		query->min.values[dimension] = 0;
+		query->max.values[dimension] = 0;
+	}
+
+	query->function = NULL;
+}
+
+/*
+ * convenience function for setting the values of a ph5_point_t
+ */
+void ph5_point_set (ph5_point_t* point, phtree_key_t a, phtree_key_t b, phtree_key_t c, phtree_key_t d, phtree_key_t e)
+{
+	point->values[0] = a;
+	point->values[1] = b;
+	point->values[2] = c;
+	point->values[3] = d;
+	point->values[4] = e;
+}
+
+
+#ifndef PHTREE_NO_STDLIB
+static size_t shadowed_slot (ph5_buffered_t* tree, void* element)
+{
+	// the low bits of an allocation are mostly 0
+	uint64_t hash = ((uint64_t) (uintptr_t) element >> 4) * UINT64_C(0x9e3779b97f4a7c15);
+	size_t slot = (size_t) (hash >> 32) & (tree->shadowed_capacity - 1);
+
+	while (tree->shadowed[slot] && tree->shadowed[slot] != element)
+	{
+		slot = (slot + 1) & (tree->shadowed_capacity - 1);
+	}
+
+	return slot;
+}
+
+static void shadowed_add (ph5_buffered_t* tree, void* element)
+{
+	size_t slot = shadowed_slot (tree, element);
+
+	if (!tree->shadowed[slot])
+	{
+		tree->shadowed[slot] = element;
+		tree->shadowed_count++;
+	}
+}
+
+static bool shadowed_contains (ph5_buffered_t* tree, void* element)
+{
+	return tree->shadowed[shadowed_slot (tree, element)] != NULL;
+}
+
+// remove element, moving back the elements after it which would no longer be found
+static void shadowed_remove (ph5_buffered_t* tree, void* element)
+{
+	size_t mask = tree->shadowed_capacity - 1;
+	size_t slot = shadowed_slot (tree, element);
+
+	if (!tree->shadowed[slot])
+	{
+		return;
+	}
+
+	tree->shadowed[slot] = NULL;
+	tree->shadowed_count--;
+
+	for (size_t next = (slot + 1) & mask; tree->shadowed[next]; next = (next + 1) & mask)
+	{
+		void* moved = tree->shadowed[next];
+		uint64_t hash = ((uint64_t) (uintptr_t) moved >> 4) * UINT64_C(0x9e3779b97f4a7c15);
+		size_t home = (size_t) (hash >> 32) & mask;
+
+		// moved stays if its home is cyclically in (slot, next]
+		if (((next - home) & mask) >= ((next - slot) & mask))
+		{
+			tree->shadowed[slot] = moved;
+			tree->shadowed[next] = NULL;
+			slot = next;
+		}
+	}
+}
+
+static size_t log_index_slot (ph5_buffered_t* tree, ph5_point_t* point)
+{
+	uint64_t hash = 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		hash = (hash ^ point->values[dimension]) * UINT64_C(0x9e3779b97f4a7c15);
+	}
+
+	size_t slot = (size_t) (hash >> 32) & (tree->log_index_capacity - 1);
+
+	while (tree->log_index[slot] && !point_equal (&tree->log[tree->log_index[slot] - 1].point, point))
+	{
+		slot = (slot + 1) & (tree->log_index_capacity - 1);
+	}
+
+	return slot;
+}
+
+static int buffered_change_compare (const void* a, const void* b)
+{
+	ph5_point_t* point_a = &((ph5_buffered_change_t*) a)->point;
+	ph5_point_t* point_b = &((ph5_buffered_change_t*) b)->point;
+	int deciding_dimension = 0;
+	phtree_key_t deciding_difference = 0;
+
+	// point_z_less, but finding the deciding dimension once for both directions
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		phtree_key_t difference = point_a->values[dimension] ^ point_b->values[dimension];
+
+		if (deciding_difference < difference && deciding_difference < (deciding_difference ^ difference))
+		{
+			deciding_dimension = dimension;
+			deciding_difference = difference;
+		}
+	}
+
+	if (!deciding_difference)
+	{
+		return 0;
+	}
+
+	return point_a->values[deciding_dimension] < point_b->values[deciding_dimension] ? -1 : 1;
+}
+
+/*
+ * find the change buffered for point
+ * 	returns NULL if point has no change
+ */
+static ph5_buffered_change_t* buffered_change_find (ph5_buffered_t* tree, ph5_point_t* point)
+{
+	uint32_t position = tree->log_index[log_index_slot (tree, point)];
+
+	if (position)
+	{
+		return &tree->log[position - 1];
+	}
+
+	size_t low = tree->run_first;
+	size_t high = tree->run_count;
+
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		ph5_point_t* middle_point = &tree->run[middle].point;
+
+		if (point_z_less (middle_point, point))
+		{
+			low = middle + 1;
+		}
+		else if (point_z_less (point, middle_point))
+		{
+			high = middle;
+		}
+		else
+		{
+			return &tree->run[middle];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * look up the tree's element at the change's point, and create the change's element if it is inserted
+ * 	after this an insert either has an element or is dropped because the tree already has one
+ */
+static void buffered_change_resolve (ph5_buffered_t* tree, ph5_buffered_change_t* change)
+{
+	if (!change->resolved)
+	{
+		change->shadowed = ph5_find (&tree->tree, &change->point);
+		change->resolved = true;
+
+		if (change->remove && change->shadowed)
+		{
+			shadowed_add (tree, change->shadowed);
+		}
+	}
+
+	if (change->insert && !change->element)
+	{
+		if (change->shadowed && !change->remove)
+		{
+			change->insert = false;
+		}
+		else
+		{
+			change->element = tree->tree.element_create (change->input);
+		}
+	}
+}
+
+// whether flushing the change would do nothing
+static bool buffered_change_empty (ph5_buffered_change_t* change)
+{
+	return !change->insert && (!change->remove || (change->resolved && !change->shadowed));
+}
+
+/*
+ * sort the log and merge it in to the run
+ * 	dropping changes which do nothing
+ */
+static void buffered_log_merge (ph5_buffered_t* tree)
+{
+	qsort (tree->log, tree->log_count, sizeof (ph5_buffered_change_t), buffered_change_compare);
+
+	// a point is never in both the log and the run
+	size_t log_iter = 0;
+	size_t run_iter = tree->run_first;
+	size_t merged_count = 0;
+
+	while (log_iter < tree->log_count || run_iter < tree->run_count)
+	{
+		ph5_buffered_change_t* change;
+
+		if (run_iter >= tree->run_count
+			|| (log_iter < tree->log_count && point_z_less (&tree->log[log_iter].point, &tree->run[run_iter].point)))
+		{
+			change = &tree->log[log_iter];
+			log_iter++;
+		}
+		else
+		{
+			change = &tree->run[run_iter];
+			run_iter++;
+		}
+
+		if (!buffered_change_empty (change))
+		{
+			tree->merged[merged_count] = *change;
+			merged_count++;
+		}
+	}
+
+	ph5_buffered_change_t* run = tree->run;
+	tree->run = tree->merged;
+	tree->merged = run;
+	tree->run_first = 0;
+	tree->run_count = merged_count;
+	tree->log_count = 0;
+	memset (tree->log_index, 0, tree->log_index_capacity * sizeof (uint32_t));
+}
+
+// apply the change at the front of the run to the tree, after which the tree has it and the buffer does not
+static void buffered_change_apply (ph5_buffered_t* tree)
+{
+	ph5_buffered_change_t* change = &tree->run[tree->run_first];
+	tree->run_first++;
+
+	if (change->remove)
+	{
+		// the element is about to be freed, and its address could come back for an element queries have to see
+		if (change->resolved && change->shadowed)
+		{
+			shadowed_remove (tree, change->shadowed);
+		}
+
+		ph5_remove (&tree->tree, &change->point);
+	}
+
+	if (change->element)
+	{
+		// the element already exists, so the tree is given an element_create which keeps it
+		void* (*element_create) (void* input) = tree->tree.element_create;
+		tree->tree.element_create = element_keep;
+		ph5_insert (&tree->tree, &change->point, change->element);
+		tree->tree.element_create = element_create;
+	}
+	else if (change->insert)
+	{
+		ph5_insert (&tree->tree, &change->point, change->input);
+	}
+
+	if (tree->run_first == tree->run_count)
+	{
+		tree->run_first = 0;
+		tree->run_count = 0;
+	}
+}
+
+void ph5_buffered_flush (ph5_buffered_t* tree)
+{
+	if (tree->log_count > 0)
+	{
+		buffered_log_merge (tree);
+	}
+
+	// in z-order, so each change mostly walks nodes the one before it just touched
+	while (tree->run_count > 0)
+	{
+		buffered_change_apply (tree);
+	}
+
+	tree->flushes++;
+}
+
+static ph5_buffered_change_t* buffered_change_add (ph5_buffered_t* tree, ph5_point_t* point)
+{
+	/*
+	 * a full log adds at most log_capacity changes to the run
+	 * 	so keeping the run at run_capacity - log_capacity changes when the log fills keeps it under run_capacity
+	 * every change added applies PHTREE_BUFFER_STEP from the front of the run, which is at least as fast as the log fills
+	 * 	so no write pays for applying a whole run
+	 */
+	size_t drain_above = tree->run_capacity > tree->log_capacity ? tree->run_capacity - tree->log_capacity : 0;
+
+	for (int iter = 0; iter < PHTREE_BUFFER_STEP && tree->run_count - tree->run_first > drain_above; iter++)
+	{
+		buffered_change_apply (tree);
+	}
+
+	if (tree->log_count >= tree->log_capacity)
+	{
+		buffered_log_merge (tree);
+	}
+
+	ph5_buffered_change_t* change = &tree->log[tree->log_count];
+	tree->log_count++;
+	tree->log_index[log_index_slot (tree, point)] = (uint32_t) tree->log_count;
+
+	*change = (ph5_buffered_change_t) {0};
+	change->point = *point;
+
+	return change;
+}
+
+bool ph5_buffered_initialize (
+	ph5_buffered_t* tree,
+	size_t log_capacity,
+	size_t run_capacity,
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void* element),
+	ph5_node_t* (*node_children_malloc) (ph5_node_t* node),
+	ph5_node_t* (*node_children_expand) (ph5_node_t* node),
+	ph5_node_t* (*node_children_shrink) (ph5_node_t* node),
+	void (*node_children_free) (ph5_node_t* node))
+{
+	*tree = (ph5_buffered_t) {0};
+
+	tree->log_capacity = log_capacity ? log_capacity : PHTREE_BUFFER_LOG;
+	tree->run_capacity = run_capacity ? run_capacity : PHTREE_BUFFER_RUN;
+
+	// a change can be in the log or the run, and a merge can go over the run's capacity by a full log
+	size_t total = tree->log_capacity + tree->run_capacity;
+
+	// the hashes are at most half full
+	tree->log_index_capacity = 1;
+	tree->shadowed_capacity = 1;
+
+	while (tree->log_index_capacity < tree->log_capacity * 2)
+	{
+		tree->log_index_capacity <<= 1;
+	}
+
+	while (tree->shadowed_capacity < total * 2)
+	{
+		tree->shadowed_capacity <<= 1;
+	}
+
+	tree->log = malloc (tree->log_capacity * sizeof (ph5_buffered_change_t));
+	tree->log_index = calloc (tree->log_index_capacity, sizeof (uint32_t));
+	tree->run = malloc (total * sizeof (ph5_buffered_change_t));
+	tree->merged = malloc (total * sizeof (ph5_buffered_change_t));
+	tree->shadowed = calloc (tree->shadowed_capacity, sizeof (void*));
+
+	if (!tree->log || !tree->log_index || !tree->run || !tree->merged || !tree->shadowed)
+	{
+		free (tree->log);
+		free (tree->log_index);
+		free (tree->run);
+		free (tree->merged);
+		free (tree->shadowed);
+
+		return false;
+	}
+
+	ph5_initialize (&tree->tree, element_create, element_destroy, node_children_malloc, node_children_expand, node_children_shrink, node_children_free);
+
+	return true;
+}
+
+void ph5_buffered_destroy (ph5_buffered_t* tree)
+{
+	for (int list = 0; list < 2; list++)
+	{
+		ph5_buffered_change_t* changes = list == 0 ? tree->run + tree->run_first : tree->log;
+		size_t count = list == 0 ? tree->run_count - tree->run_first : tree->log_count;
+
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			if (changes[iter].element && tree->tree.element_destroy)
+			{
+				tree->tree.element_destroy (changes[iter].element);
+			}
+		}
+	}
+
+	ph5_clear (&tree->tree);
+
+	free (tree->log);
+	free (tree->log_index);
+	free (tree->run);
+	free (tree->merged);
+	free (tree->shadowed);
+
+	*tree = (ph5_buffered_t) {0};
+}
+
+void ph5_buffered_insert (ph5_buffered_t* tree, ph5_point_t* point, void* input)
+{
+	ph5_buffered_change_t* change = buffered_change_find (tree, point);
+
+	if (!change)
+	{
+		change = buffered_change_add (tree, point);
+	}
+	else if (change->insert || (change->resolved && change->shadowed && !change->remove))
+	{
+		// point already has an element
+		return;
+	}
+
+	change->insert = true;
+	change->input = input;
+}
+
+void ph5_buffered_remove (ph5_buffered_t* tree, ph5_point_t* point)
+{
+	ph5_buffered_change_t* change = buffered_change_find (tree, point);
+
+	if (!change)
+	{
+		change = buffered_change_add (tree, point);
+	}
+
+	if (change->element)
+	{
+		if (tree->tree.element_destroy)
+		{
+			tree->tree.element_destroy (change->element);
+		}
+
+		change->element = NULL;
+	}
+
+	change->insert = false;
+
+	if (!change->remove)
+	{
+		change->remove = true;
+
+		if (change->resolved && change->shadowed)
+		{
+			shadowed_add (tree, change->shadowed);
+		}
+	}
+}
+
+void* ph5_buffered_find (ph5_buffered_t* tree, ph5_point_t* point)
+{
+	ph5_buffered_change_t* change = buffered_change_find (tree, point);
+
+	if (!change)
+	{
+		return ph5_find (&tree->tree, point);
+	}
+
+	buffered_change_resolve (tree, change);
+
+	if (change->element)
+	{
+		return change->element;
+	}
+
+	return change->remove ? NULL : change->shadowed;
+}
+
+typedef struct buffered_visit_t
+{
+	ph5_buffered_t* tree;
+	phtree_iteration_function_t function;
+	void* data;
+} buffered_visit_t;
+
+// skips the tree's elements which the buffer replaces or removes
+static void buffered_visit (void* element, void* data)
+{
+	buffered_visit_t* visit = data;
+
+	if (!shadowed_contains (visit->tree, element))
+	{
+		visit->function (element, visit->data);
+	}
+}
+
+static bool buffered_change_in (ph5_query_t* query, ph5_buffered_change_t* change)
+{
+	return !query || window_contains (query, &change->point);
+}
+
+/*
+ * visit the tree's elements the buffer does not hide, then the buffer's elements
+ * 	query can be NULL to visit everything
+ */
+static void buffered_visit_all (ph5_buffered_t* tree, ph5_query_t* query, phtree_iteration_function_t function, void* data)
+{
+	buffered_visit_t visit = {tree, function, data};
+
+	// every change the query meets has to know what it hides before the tree is walked
+	for (int list = 0; list < 2; list++)
+	{
+		ph5_buffered_change_t* changes = list == 0 ? tree->run + tree->run_first : tree->log;
+		size_t count = list == 0 ? tree->run_count - tree->run_first : tree->log_count;
+
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			if (buffered_change_in (query, &changes[iter]))
+			{
+				buffered_change_resolve (tree, &changes[iter]);
+			}
+		}
+	}
+
+	phtree_iteration_function_t tree_function = tree->shadowed_count > 0 ? buffered_visit : function;
+	void* tree_data = tree->shadowed_count > 0 ? (void*) &visit : data;
+
+	if (query)
+	{
+		ph5_query_t tree_query = *query;
+		tree_query.function = tree_function;
+		ph5_query (&tree->tree, &tree_query, tree_data);
+	}
+	else
+	{
+		ph5_for_each (&tree->tree, tree_function, tree_data);
+	}
+
+	for (int list = 0; list < 2; list++)
+	{
+		ph5_buffered_change_t* changes = list == 0 ? tree->run + tree->run_first : tree->log;
+		size_t count = list == 0 ? tree->run_count - tree->run_first : tree->log_count;
+
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			if (changes[iter].element && buffered_change_in (query, &changes[iter]))
+			{
+				function (changes[iter].element, data);
+			}
+		}
+	}
+}
+
+void ph5_buffered_query (ph5_buffered_t* tree, ph5_query_t* query, void* data)
+{
+	if (!tree || !query || !query->function)
+	{
+		return;
+	}
+
+	buffered_visit_all (tree, query, query->function, data);
+}
+
+void ph5_buffered_for_each (ph5_buffered_t* tree, phtree_iteration_function_t function, void* data)
+{
+	if (!tree || !function)
+	{
+		return;
+	}
+
+	buffered_visit_all (tree, NULL, function, data);
+}
+
+/*
+ * the header at the start of a log
+ * 	magic[4] version[4] byte_order[2] bit_width[1] dimensions[1] reserved[4] generation[8]
+ * and of a snapshot, which is followed by ph5_save's bytes
+ * 	magic[4] version[4] generation[8]
+ */
+#define WAL_HEADER_SIZE 24
+#define WAL_SNAPSHOT_HEADER_SIZE 16
+
+/*
+ * every record is
+ * 	length[4] checksum[4] type[1] point
+ * followed by the element for inserts, or the point moved to for relocates
+ * 	length and checksum cover everything after them
+ */
+#define WAL_RECORD_HEADER_SIZE 8
+#define WAL_RECORD_INSERT 1
+#define WAL_RECORD_REMOVE 2
+#define WAL_RECORD_RELOCATE 3
+// bigger than any record being replayed is treated as corruption
+#define WAL_RECORD_MAX (UINT32_C(1) << 30)
+// inserts collected for one ph5_insert_batch while replaying
+#define WAL_REPLAY_BATCH 65536
+
+static void wal_header (uint8_t header[WAL_HEADER_SIZE], uint64_t generation)
+{
+	uint32_t version = PHTREE_FILE_VERSION;
+	uint16_t byte_order = SAVE_BYTE_ORDER;
+
+	memset (header, 0, WAL_HEADER_SIZE);
+	memcpy (header, "PHTW", 4);
+	memcpy (header + 4, &version, sizeof (version));
+	memcpy (header + 8, &byte_order, sizeof (byte_order));
+	header[10] = PHTREE16_BIT_WIDTH;
+	header[11] = DIMENSIONS;
+	memcpy (header + 16, &generation, sizeof (generation));
+}
+
+static void wal_snapshot_header (uint8_t header[WAL_SNAPSHOT_HEADER_SIZE], uint64_t generation)
+{
+	uint32_t version = PHTREE_FILE_VERSION;
+
+	memcpy (header, "PHTC", 4);
+	memcpy (header + 4, &version, sizeof (version));
+	memcpy (header + 8, &generation, sizeof (generation));
+}
+
+// FNV-1a, only there to catch records which were not completely written
+static uint32_t wal_checksum (const uint8_t* bytes, size_t size)
+{
+	uint32_t hash = UINT32_C(2166136261);
+
+	for (size_t iter = 0; iter < size; iter++)
+	{
+		hash = (hash ^ bytes[iter]) * UINT32_C(16777619);
+	}
+
+	return hash;
+}
+
+// write everything fwrite has buffered to the disk
+static bool wal_file_sync (FILE* file)
+{
+	if (fflush (file) != 0)
+	{
+		return false;
+	}
+
+#if defined (PHTREE_MMAP)
+	return fsync (fileno (file)) == 0;
+#elif defined (_WIN32)
+	return _commit (_fileno (file)) == 0;
+#else
+	return true;
+#endif
+}
+
+static bool wal_file_truncate (FILE* file, long size)
+{
+	if (fflush (file) != 0)
+	{
+		return false;
+	}
+
+#if defined (PHTREE_MMAP)
+	return ftruncate (fileno (file), (off_t) size) == 0;
+#elif defined (_WIN32)
+	return _chsize_s (_fileno (file), size) == 0;
+#else
+	return false;
+#endif
+}
+
+// make a rename or a new file in the directory of path durable
+static void wal_directory_sync (const char* path)
+{
+#ifdef PHTREE_MMAP
+	const char* slash = strrchr (path, '/');
+	char* directory = slash ? malloc ((size_t) (slash - path) + 2) : NULL;
+
+	if (directory)
+	{
+		memcpy (directory, path, (size_t) (slash - path) + 1);
+		directory[slash - path + 1] = '\0';
+	}
+
+	int file = open (directory ? directory : ".", O_RDONLY);
+
+	if (file >= 0)
+	{
+		fsync (file);
+		close (file);
+	}
+
+	free (directory);
+#else
+	(void) path;
+#endif
+}
+
+static char* wal_string_copy (const char* string, const char* suffix)
+{
+	size_t length = strlen (string);
+	size_t suffix_length = strlen (suffix);
+	char* copy = malloc (length + suffix_length + 1);
+
+	if (copy)
+	{
+		memcpy (copy, string, length);
+		memcpy (copy + length, suffix, suffix_length + 1);
+	}
+
+	return copy;
+}
+
+// element_save writes records in to the buffer through this
+static bool wal_buffer_write (void* stream, const void* bytes, size_t size)
+{
+	ph5_wal_t* wal = stream;
+
+	if (wal->buffer_size + size > wal->buffer_capacity)
+	{
+		size_t capacity = wal->buffer_capacity ? wal->buffer_capacity : 4096;
+
+		while (capacity < wal->buffer_size + size)
+		{
+			capacity *= 2;
+		}
+
+		uint8_t* buffer = realloc (wal->buffer, capacity);
+
+		if (!buffer)
+		{
+			return false;
+		}
+
+		wal->buffer = buffer;
+		wal->buffer_capacity = capacity;
+	}
+
+	memcpy (wal->buffer + wal->buffer_size, bytes, size);
+	wal->buffer_size += size;
+
+	return true;
+}
+
+/*
+ * append a record to the buffer
+ * 	element is saved after the points for inserts
+ * if the record can not be written the log no longer matches the tree
+ */
+static void wal_record (
+	ph5_wal_t* wal,
+	uint8_t type,
+	ph5_point_t* point,
+	ph5_point_t* to,
+	void* element)
+{
+	// the log is already broken, the next checkpoint saves what it is missing
+	if (wal->failed)
+	{
+		return;
+	}
+
+	size_t start = wal->buffer_size;
+	uint8_t record_header[WAL_RECORD_HEADER_SIZE] = {0};
+
+	bool written = wal_buffer_write (wal, record_header, sizeof (record_header))
+		&& wal_buffer_write (wal, &type, 1)
+		&& wal_buffer_write (wal, point, sizeof (ph5_point_t))
+		&& (!to || wal_buffer_write (wal, to, sizeof (ph5_point_t)))
+		&& (!element || wal->element_save (element, wal_buffer_write, wal, wal->data))
+		&& wal->buffer_size - start - WAL_RECORD_HEADER_SIZE <= WAL_RECORD_MAX;
+
+	if (!written)
+	{
+		wal->buffer_size = start;
+		wal->failed = true;
+
+		return;
+	}
+
+	uint32_t length = (uint32_t) (wal->buffer_size - start - WAL_RECORD_HEADER_SIZE);
+	uint32_t checksum = wal_checksum (wal->buffer + start + WAL_RECORD_HEADER_SIZE, length);
+
+	memcpy (wal->buffer + start, &length, sizeof (length));
+	memcpy (wal->buffer + start + sizeof (length), &checksum, sizeof (checksum));
+
+	wal->records++;
+	wal->pending++;
+
+	if (wal->pending >= wal->group_size)
+	{
+		ph5_wal_commit (wal);
+	}
+}
+
+// element_load reads an insert's element from the record through this
+typedef struct wal_reader_t
+{
+	const uint8_t* bytes;
+	size_t size;
+	size_t position;
+} wal_reader_t;
+
+static bool wal_record_read (void* stream, void* bytes, size_t size)
+{
+	wal_reader_t* reader = stream;
+
+	if (size > reader->size - reader->position)
+	{
+		return false;
+	}
+
+	memcpy (bytes, reader->bytes + reader->position, size);
+	reader->position += size;
+
+	return true;
+}
+
+/*
+ * the inserts being collected while replaying
+ * 	elements were made by element_load, so they go in to the tree as they are
+ * removes and relocates which do not touch a collected point are applied straight away
+ * 	since they do the same thing before or after the inserts
+ * 		so a log of mixed changes still replays in big batches
+ */
+typedef struct wal_replay_t
+{
+	ph5_point_t* points;
+	void** elements;
+	void** out_elements;
+	size_t count;
+	/*
+	 * a hash of the collected points, holds positions + 1, 0 is empty
+	 * 	open addressing, WAL_REPLAY_INDEX slots
+	 */
+	uint32_t* index;
+} wal_replay_t;
+
+#define WAL_REPLAY_INDEX (WAL_REPLAY_BATCH * 2)
+
+static size_t wal_replay_slot (wal_replay_t* replay, ph5_point_t* point)
+{
+	uint64_t hash = 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		hash = (hash ^ point->values[dimension]) * UINT64_C(0x9e3779b97f4a7c15);
+	}
+
+	size_t slot = (size_t) (hash >> 32) & (WAL_REPLAY_INDEX - 1);
+
+	while (replay->index[slot] && !point_equal (&replay->points[replay->index[slot] - 1], point))
+	{
+		slot = (slot + 1) & (WAL_REPLAY_INDEX - 1);
+	}
+
+	return slot;
+}
+
+static void wal_replay_flush (ph5_t* tree, wal_replay_t* replay)
+{
+	if (replay->count == 0)
+	{
+		return;
+	}
+
+	void* (*element_create) (void* input) = tree->element_create;
+
+	tree->element_create = element_keep;
+	ph5_insert_batch (tree, replay->points, replay->elements, replay->count, replay->out_elements);
+	tree->element_create = element_create;
+
+	// an insert at a point which already had an element did nothing when it was logged either
+	for (size_t iter = 0; iter < replay->count; iter++)
+	{
+		if (replay->out_elements[iter] != replay->elements[iter] && tree->element_destroy)
+		{
+			tree->element_destroy (replay->elements[iter]);
+		}
+	}
+
+	/*
+	 * the slots are cleared one by one, a flush for a single conflicting remove should not clear the whole index
+	 * 	newest first, so every probe sequence is still whole when its point is looked up
+	 */
+	for (size_t iter = replay->count; iter > 0; iter--)
+	{
+		replay->index[wal_replay_slot (replay, &replay->points[iter - 1])] = 0;
+	}
+
+	replay->count = 0;
+}
+
+// a remove or relocate at point has to wait for the collected inserts if one of them is at point
+static void wal_replay_order (ph5_t* tree, wal_replay_t* replay, ph5_point_t* point)
+{
+	if (replay->count > 0 && replay->index[wal_replay_slot (replay, point)])
+	{
+		wal_replay_flush (tree, replay);
+	}
+}
+
+/*
+ * replay every complete record in the log, which is positioned after its header
+ * 	end is set to where the complete records end
+ * returns false if a complete record can not be used
+ */
+static bool wal_replay (ph5_wal_t* wal, FILE* file, long* end)
+{
+	wal_replay_t replay = {
+		malloc (WAL_REPLAY_BATCH * sizeof (ph5_point_t)),
+		malloc (WAL_REPLAY_BATCH * sizeof (void*)),
+		malloc (WAL_REPLAY_BATCH * sizeof (void*)),
+		0,
+		calloc (WAL_REPLAY_INDEX, sizeof (uint32_t))};
+	uint8_t* record = NULL;
+	size_t record_capacity = 0;
+	bool replayed = replay.points && replay.elements && replay.out_elements && replay.index;
+
+	*end = WAL_HEADER_SIZE;
+
+	while (replayed)
+	{
+		uint8_t record_header[WAL_RECORD_HEADER_SIZE];
+		uint32_t length;
+		uint32_t checksum;
+
+		if (fread (record_header, 1, sizeof (record_header), file) != sizeof (record_header))
+		{
+			break;
+		}
+
+		memcpy (&length, record_header, sizeof (length));
+		memcpy (&checksum, record_header + sizeof (length), sizeof (checksum));
+
+		if (length < 1 + sizeof (ph5_point_t) || length > WAL_RECORD_MAX)
+		{
+			break;
+		}
+
+		if (length > record_capacity)
+		{
+			uint8_t* grown = realloc (record, length);
+
+			if (!grown)
+			{
+				replayed = false;
+				break;
+			}
+
+			record = grown;
+			record_capacity = length;
+		}
+
+		if (fread (record, 1, length, file) != length || wal_checksum (record, length) != checksum)
+		{
+			break;
+		}
+
+		uint8_t type = record[0];
+		ph5_point_t point;
+		ph5_point_t to;
+		size_t points_end = 1 + sizeof (ph5_point_t);
+
+		memcpy (&point, record + 1, sizeof (point));
+
+		if (type == WAL_RECORD_INSERT)
+		{
+			wal_reader_t reader = {record, length, points_end};
+			void* element = wal->element_load (wal_record_read, &reader, wal->data);
+
+			if (!element || reader.position != length)
+			{
+				if (element && wal->tree->element_destroy)
+				{
+					wal->tree->element_destroy (element);
+				}
+
+				replayed = false;
+				break;
+			}
+
+			size_t slot = wal_replay_slot (&replay, &point);
+
+			// a second insert at a collected point did nothing
+			if (replay.index[slot])
+			{
+				if (wal->tree->element_destroy)
+				{
+					wal->tree->element_destroy (element);
+				}
+			}
+			else
+			{
+				replay.points[replay.count] = point;
+				replay.elements[replay.count] = element;
+				replay.count++;
+				replay.index[slot] = (uint32_t) replay.count;
+			}
+
+			if (replay.count == WAL_REPLAY_BATCH)
+			{
+				wal_replay_flush (wal->tree, &replay);
+			}
+		}
+		else if (type == WAL_RECORD_REMOVE && length == points_end)
+		{
+			wal_replay_order (wal->tree, &replay, &point);
+			ph5_remove (wal->tree, &point);
+		}
+		else if (type == WAL_RECORD_RELOCATE && length == points_end + sizeof (ph5_point_t))
+		{
+			memcpy (&to, record + points_end, sizeof (to));
+			wal_replay_order (wal->tree, &replay, &point);
+			wal_replay_order (wal->tree, &replay, &to);
+			ph5_relocate (wal->tree, &point, &to);
+		}
+		else
+		{
+			replayed = false;
+			break;
+		}
+
+		*end += (long) (WAL_RECORD_HEADER_SIZE + length);
+		wal->records++;
+	}
+
+	if (replay.points && replay.elements && replay.out_elements && replay.index)
+	{
+		wal_replay_flush (wal->tree, &replay);
+	}
+
+	free (replay.points);
+	free (replay.elements);
+	free (replay.out_elements);
+	free (replay.index);
+	free (record);
+
+	return replayed;
+}
+
+static bool wal_snapshot_load (ph5_wal_t* wal)
+{
+	FILE* file = fopen (wal->snapshot_path, "rb");
+
+	// no snapshot yet, the log starts from an empty tree
+	if (!file)
+	{
+		return true;
+	}
+
+	uint8_t header[WAL_SNAPSHOT_HEADER_SIZE] = {0};
+	uint8_t expected[WAL_SNAPSHOT_HEADER_SIZE];
+	bool loaded = fread (header, 1, sizeof (header), file) == sizeof (header);
+
+	memcpy (&wal->generation, header + 8, sizeof (wal->generation));
+	wal_snapshot_header (expected, wal->generation);
+
+	loaded = loaded && memcmp (header, expected, sizeof (header)) == 0
+		&& ph5_load (wal->tree, file_read, file, wal->element_load, wal->data);
+
+	fclose (file);
+
+	return loaded;
+}
+
+// empty the log and start it with a header for generation
+static bool wal_file_reset (ph5_wal_t* wal, uint64_t generation)
+{
+	uint8_t header[WAL_HEADER_SIZE];
+	wal_header (header, generation);
+
+	// not freopen, which leaves the old stream allocated when it fails
+	if (wal->file)
+	{
+		fclose (wal->file);
+	}
+
+	wal->file = fopen (wal->path, "w+b");
+
+	if (!wal->file || fwrite (header, 1, sizeof (header), wal->file) != sizeof (header) || !wal_file_sync (wal->file))
+	{
+		return false;
+	}
+
+	wal_directory_sync (wal->path);
+
+	return true;
+}
+
+bool ph5_wal_open (
+	ph5_wal_t* wal,
+	ph5_t* tree,
+	const char* path,
+	const char* snapshot_path,
+	phtree_element_save_function_t element_save,
+	phtree_element_load_function_t element_load,
+	void* data,
+	size_t group_size)
+{
+	*wal = (ph5_wal_t) {0};
+
+	if (!tree || !path || !snapshot_path || !element_save || !element_load)
+	{
+		return false;
+	}
+
+	wal->tree = tree;
+	wal->path = wal_string_copy (path, "");
+	wal->snapshot_path = wal_string_copy (snapshot_path, "");
+	wal->element_save = element_save;
+	wal->element_load = element_load;
+	wal->data = data;
+	wal->group_size = group_size ? group_size : PHTREE_WAL_GROUP;
+
+	ph5_clear (tree);
+
+	if (!wal->path || !wal->snapshot_path || !wal_snapshot_load (wal))
+	{
+		ph5_wal_close (wal);
+
+		return false;
+	}
+
+	FILE* file = fopen (path, "r+b");
+	uint8_t header[WAL_HEADER_SIZE] = {0};
+	uint8_t expected[WAL_HEADER_SIZE];
+	uint64_t generation = 0;
+	size_t header_size = file ? fread (header, 1, sizeof (header), file) : 0;
+
+	if (header_size == sizeof (header))
+	{
+		memcpy (&generation, header + 16, sizeof (generation));
+	}
+
+	wal_header (expected, generation);
+	wal->file = file;
+
+	/*
+	 * a log which is missing or stops part way through its header was never written to
+	 * 	and a log older than the snapshot is already in the snapshot
+	 * 		so both start over
+	 * anything else which is not the log following the snapshot is left alone
+	 */
+	size_t compared = header_size < 16 ? header_size : 16;
+	bool matches = memcmp (header, expected, compared) == 0;
+
+	if (!matches || generation > wal->generation)
+	{
+		ph5_wal_close (wal);
+
+		return false;
+	}
+
+	if (header_size < sizeof (header) || generation < wal->generation)
+	{
+		if (!wal_file_reset (wal, wal->generation))
+		{
+			ph5_wal_close (wal);
+
+			return false;
+		}
+
+		return true;
+	}
+
+	long end;
+
+	if (!wal_replay (wal, file, &end))
+	{
+		ph5_wal_close (wal);
+
+		return false;
+	}
+
+	// cut off a record which was not completely written, so new records follow the last complete one
+	if (fseek (file, 0, SEEK_END) != 0 || (ftell (file) != end && !wal_file_truncate (file, end))
+		|| fseek (file, end, SEEK_SET) != 0)
+	{
+		ph5_wal_close (wal);
+
+		return false;
+	}
+
+	return true;
+}
+
+bool ph5_wal_close (ph5_wal_t* wal)
+{
+	if (!wal)
+	{
+		return false;
+	}
+
+	bool committed = ph5_wal_commit (wal);
+
+	if (wal->file)
+	{
+		fclose (wal->file);
+	}
+
+	free (wal->path);
+	free (wal->snapshot_path);
+	free (wal->buffer);
+	*wal = (ph5_wal_t) {0};
+
+	return committed;
+}
+
+void* ph5_wal_insert (ph5_wal_t* wal, ph5_point_t* point, void* input)
+{
+	void* element = ph5_find (wal->tree, point);
+
+	if (element)
+	{
+		return element;
+	}
+
+	element = ph5_insert (wal->tree, point, input);
+
+	if (element)
+	{
+		wal_record (wal, WAL_RECORD_INSERT, point, NULL, element);
+	}
+
+	return element;
+}
+
+void ph5_wal_remove (ph5_wal_t* wal, ph5_point_t* point)
+{
+	if (!ph5_find (wal->tree, point))
+	{
+		return;
+	}
+
+	ph5_remove (wal->tree, point);
+	wal_record (wal, WAL_RECORD_REMOVE, point, NULL, NULL);
+}
+
+void* ph5_wal_relocate (ph5_wal_t* wal, ph5_point_t* from, ph5_point_t* to)
+{
+	void* element = ph5_relocate (wal->tree, from, to);
+
+	if (element && !point_equal (from, to))
+	{
+		wal_record (wal, WAL_RECORD_RELOCATE, from, to, NULL);
+	}
+
+	return element;
+}
+
+bool ph5_wal_commit (ph5_wal_t* wal)
+{
+	if (!wal->file || wal->failed)
+	{
+		return false;
+	}
+
+	if (wal->buffer_size > 0)
+	{
+		if (fwrite (wal->buffer, 1, wal->buffer_size, wal->file) != wal->buffer_size || !wal_file_sync (wal->file))
+		{
+			wal->failed = true;
+
+			return false;
+		}
+
+		wal->buffer_size = 0;
+		wal->commits++;
+	}
+
+	wal->pending = 0;
+
+	return true;
+}
+
+bool ph5_wal_checkpoint (ph5_wal_t* wal)
+{
+	// never opened, or closed
+	if (!wal->tree || !wal->path || !wal->snapshot_path)
+	{
+		return false;
+	}
+
+	/*
+	 * if the log is broken the changes since the last commit are only in the tree, which is what is saved
+	 * 	the file is NULL if the last checkpoint could not reopen the log, wal_file_reset opens it again below
+	 */
+	if (wal->file)
+	{
+		ph5_wal_commit (wal);
+	}
+
+	char* temporary = wal_string_copy (wal->snapshot_path, ".tmp");
+	FILE* file = temporary ? fopen (temporary, "wb") : NULL;
+
+	if (!file)
+	{
+		free (temporary);
+
+		return false;
+	}
+
+	uint8_t header[WAL_SNAPSHOT_HEADER_SIZE];
+	wal_snapshot_header (header, wal->generation + 1);
+
+	bool saved = fwrite (header, 1, sizeof (header), file) == sizeof (header)
+		&& ph5_save (wal->tree, file_write, file, wal->element_save, wal->data)
+		&& wal_file_sync (file);
+
+	saved = (fclose (file) == 0) && saved;
+
+#ifdef _WIN32
+	// rename does not replace files on windows, so there is a moment without a snapshot here
+	if (saved)
+	{
+		remove (wal->snapshot_path);
+	}
+#endif
+
+	if (!saved || rename (temporary, wal->snapshot_path) != 0)
+	{
+		remove (temporary);
+		free (temporary);
+
+		return false;
+	}
+
+	free (temporary);
+	wal_directory_sync (wal->snapshot_path);
+
+	/*
+	 * the snapshot has everything now
+	 * 	if the process dies before the log is reset, the old log is older than the snapshot and is ignored
+	 */
+	wal->generation++;
+	wal->buffer_size = 0;
+	wal->pending = 0;
+	wal->records = 0;
+	wal->failed = !wal_file_reset (wal, wal->generation);
+
+	return !wal->failed;
+}
+#endif
+
+#ifdef PHTREE_THREADS
+// how many times an optimistic read starts over before it locks instead
+#define TS_OPTIMISTIC_RETRIES 4
+// how many elements an optimistic query collects from one partition before it locks instead
+#define TS_OPTIMISTIC_ELEMENTS 256
+// how many retired things a partition collects before its writers try to free them
+#define TS_RECLAIM_THRESHOLD 64
+// the epoch of something retired by a write which has not finished yet
+#define TS_EPOCH_PENDING UINT64_MAX
+
+/*
+ * the tree and retire list of the write running on this thread
+ * 	the retiring functions the tree is given use these
+ * 		because node_children_ and element_destroy functions only get the node or element
+ */
+static _Thread_local ph5_ts_t* ts_writer = NULL;
+static _Thread_local ph5_ts_retire_list_t* ts_retiring = NULL;
+
+// where this thread starts looking for a free reader slot
+static _Thread_local unsigned int ts_reader_hint = 0;
+static atomic_uint ts_reader_hints;
+
+static uint64_t ts_nanoseconds (void)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t) now.tv_sec * 1000000000ull) + (uint64_t) now.tv_nsec;
+}
+
+/*
+ * try the lock first so uncontended acquisitions do not touch the counters or the clock
+ */
+static void ts_read_acquire (ph5_ts_t* tree, pthread_rwlock_t* lock)
+{
+	if (pthread_rwlock_tryrdlock (lock) == 0)
+	{
+		return;
+	}
+
+	uint64_t start = ts_nanoseconds ();
+	pthread_rwlock_rdlock (lock);
+
+	atomic_fetch_add_explicit (&tree->reads_contended, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit (&tree->read_wait_nanoseconds, ts_nanoseconds () - start, memory_order_relaxed);
+}
+
+static void ts_write_acquire (ph5_ts_t* tree, pthread_rwlock_t* lock)
+{
+	if (pthread_rwlock_trywrlock (lock) == 0)
+	{
+		return;
+	}
+
+	uint64_t start = ts_nanoseconds ();
+	pthread_rwlock_wrlock (lock);
+
+	atomic_fetch_add_explicit (&tree->writes_contended, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit (&tree->write_wait_nanoseconds, ts_nanoseconds () - start, memory_order_relaxed);
+}
+
+static void ts_release (pthread_rwlock_t* lock)
+{
+	pthread_rwlock_unlock (lock);
+}
+
+/*
+ * seqlock style versions
+ * 	a writer makes the version odd before changing anything and even again after
+ * 	a reader remembers an even version
+ * 		and only trusts what it read if the version is still the same afterwards
+ */
+static void ts_version_begin (atomic_uint_least64_t* version)
+{
+	uint64_t current = atomic_load_explicit (version, memory_order_relaxed);
+	atomic_store_explicit (version, current + 1, memory_order_relaxed);
+	atomic_thread_fence (memory_order_release);
+}
+
+static void ts_version_end (atomic_uint_least64_t* version)
+{
+	uint64_t current = atomic_load_explicit (version, memory_order_relaxed);
+	atomic_store_explicit (version, current + 1, memory_order_release);
+}
+
+// returns false while a writer is changing what the version covers
+static bool ts_version_read (atomic_uint_least64_t* version, uint64_t* out)
+{
+	*out = atomic_load_explicit (version, memory_order_acquire);
+
+	return (*out & 1) == 0;
+}
+
+// returns true if nothing was written since the version was read
+static bool ts_version_check (atomic_uint_least64_t* version, uint64_t expected)
+{
+	atomic_thread_fence (memory_order_acquire);
+
+	return atomic_load_explicit (version, memory_order_relaxed) == expected;
+}
+
+static void ts_retire (ph5_ts_retire_list_t* list, void* pointer, int capacity)
+{
+	if (list->count >= list->capacity)
+	{
+		list->capacity = list->capacity ? list->capacity * 2 : TS_RECLAIM_THRESHOLD;
+		list->items = realloc (list->items, list->capacity * sizeof (ph5_ts_retired_t));
+	}
+
+	list->items[list->count].pointer = pointer;
+	list->items[list->count].capacity = capacity;
+	list->items[list->count].epoch = TS_EPOCH_PENDING;
+	list->count++;
+}
+
+/*
+ * stamp everything retired by the write which just finished with the current epoch
+ * 	it is stamped after the write instead of when it is retired
+ * 		because it can still be reached until the write is done
+ * the fence makes sure a reader which enters at a later epoch sees the finished write
+ */
+static void ts_retire_stamp (ph5_ts_t* tree, ph5_ts_retire_list_t* list)
+{
+	atomic_thread_fence (memory_order_seq_cst);
+	uint64_t epoch = atomic_load (&tree->epoch);
+
+	for (size_t iter = list->count; iter > 0 && list->items[iter - 1].epoch == TS_EPOCH_PENDING; iter--)
+	{
+		list->items[iter - 1].epoch = epoch;
+	}
+}
+
+static void ts_retired_free (ph5_ts_t* tree, ph5_ts_retired_t* retired)
+{
+	if (retired->capacity < 0)
+	{
+		if (tree->element_destroy)
+		{
+			tree->element_destroy (retired->pointer);
+		}
+
+		return;
+	}
+
+	ph5_node_t node = {0};
+	node.children = retired->pointer;
+	node.child_capacity = retired->capacity;
+
+	tree->node_children_free (&node);
+}
+
+/*
+ * move the epoch on and return the oldest epoch a reader is still in
+ * 	nothing retired before that epoch can be seen by any reader
+ */
+static uint64_t ts_epoch_advance (ph5_ts_t* tree)
+{
+	uint64_t oldest = atomic_fetch_add (&tree->epoch, 1) + 1;
+
+	for (int iter = 0; iter < PHTREE_TS_READERS; iter++)
+	{
+		uint64_t epoch = atomic_load (&tree->readers[iter].epoch);
+
+		if (epoch != 0 && epoch < oldest)
+		{
+			oldest = epoch;
+		}
+	}
+
+	return oldest;
+}
+
+static void ts_retire_list_reclaim (ph5_ts_t* tree, ph5_ts_retire_list_t* list, uint64_t oldest)
+{
+	size_t kept = 0;
+
+	for (size_t iter = 0; iter < list->count; iter++)
+	{
+		if (list->items[iter].epoch < oldest)
+		{
+			ts_retired_free (tree, &list->items[iter]);
+		}
+		else
+		{
+			list->items[kept] = list->items[iter];
+			kept++;
+		}
+	}
+
+	list->count = kept;
+	// what a snapshot keeps alive is kept again next time
+	// 	so while there are snapshots wait until the list has doubled
+	list->reclaim_at = kept * 2;
+}
+
+static bool ts_retire_list_due (ph5_ts_t* tree, ph5_ts_retire_list_t* list)
+{
+	return list->count > 0
+		&& (list->count >= list->reclaim_at || atomic_load_explicit (&tree->snapshots, memory_order_relaxed) == 0);
+}
+
+// only when nothing can be reading the tree
+static void ts_retire_list_free (ph5_ts_t* tree, ph5_ts_retire_list_t* list)
+{
+	for (size_t iter = 0; iter < list->count; iter++)
+	{
+		ts_retired_free (tree, &list->items[iter]);
+	}
+
+	free (list->items);
+	list->items = NULL;
+	list->count = 0;
+	list->capacity = 0;
+	list->reclaim_at = 0;
+}
+
+/*
+ * the functions the tree is given in place of its element_destroy and node_children_ functions
+ * 	so nothing is freed while an optimistic reader might be looking at it
+ */
+static void ts_element_retire (void* element)
+{
+	ts_retire (ts_retiring, element, -1);
+}
+
+static void ts_children_retire (ph5_node_t* node)
+{
+	if (node->children)
+	{
+		ts_retire (ts_retiring, node->children, node->child_capacity);
+	}
+
+	node->child_capacity = 0;
+}
+
+/*
+ * move node's children in to a new array which can hold at least capacity children
+ * 	the old array is retired instead of reallocated
+ * 		because optimistic readers can still be reading it
+ */
+static ph5_node_t* ts_children_move (ph5_ts_t* tree, ph5_node_t* node, int capacity)
+{
+	ph5_node_t moved = *node;
+
+	if (tree->node_children_expand == ph5_default_children_expand)
+	{
+		moved.child_capacity = capacity;
+		moved.children = malloc (moved.child_capacity * sizeof (ph5_node_t));
+	}
+	else
+	{
+		tree->node_children_malloc (&moved);
+
+		while (moved.child_capacity < capacity)
+		{
+			moved.children = tree->node_children_expand (&moved);
+		}
+	}
+
+	if (node->child_count > 0)
+	{
+		memcpy (moved.children, node->children, node->child_count * sizeof (ph5_node_t));
+	}
+
+	ts_children_retire (node);
+	node->child_capacity = moved.child_capacity;
+
+	return moved.children;
+}
+
+static ph5_node_t* ts_children_expand (ph5_node_t* node)
+{
+	ph5_ts_t* tree = ts_writer;
+
+	// grow the same way the tree's own expand would
+	if (tree->node_children_expand == ph5_default_children_expand)
+	{
+		return ts_children_move (tree, node, node->child_capacity + 4);
+	}
+
+	return ts_children_move (tree, node, node->child_capacity + 1);
+}
+
+/*
+ * give every node on the path to point its own copy of its children array
+ * 	so inserting or removing point only changes arrays no snapshot can see
+ * the arrays it replaces are retired and stay alive until the snapshots are released
+ *
+ * the root's array is not copied, snapshots have their own copy of it
+ */
+static void ts_path_copy (ph5_ts_t* tree, ph5_point_t* point)
+{
+	ph5_node_t* node = &tree->tree.root;
+	hypercube_address_t address = calculate_hypercube_address (point, node);
+
+	while (child_active (node, address))
+	{
+		node = &node->children[child_index (node, address)];
+
+		// a point which is not under node is added next to it in its parent's array
+		// 	which is already a copy
+		if (!prefix_equal (point, &node->point, node->postfix_length))
+		{
+			return;
+		}
+
+		node->children = ts_children_move (tree, node, node->child_capacity);
+
+		if (phtree_node_is_leaf (node))
+		{
+			return;
+		}
+
+		address = calculate_hypercube_address (point, node);
+	}
+}
+
+/*
+ * retire everything under node without writing to any of it
+ * 	snapshots can still be reading it
+ */
+static void ts_nodes_retire (ph5_node_t* node)
+{
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		if (phtree_node_is_leaf (node))
+		{
+			if (node->children[iter].children)
+			{
+				ts_retire (ts_retiring, node->children[iter].children, -1);
+			}
+		}
+		else
+		{
+			ts_nodes_retire (&node->children[iter]);
+		}
+	}
+
+	if (node->children)
+	{
+		ts_retire (ts_retiring, node->children, node->child_capacity);
+	}
+}
+
+/*
+ * take a reader slot so writers do not free anything this thread can still see
+ * 	returns NULL if every slot is taken
+ */
+static ph5_ts_reader_t* ts_reader_enter (ph5_ts_t* tree)
+{
+	if (ts_reader_hint == 0)
+	{
+		ts_reader_hint = atomic_fetch_add_explicit (&ts_reader_hints, 1, memory_order_relaxed) + 1;
+	}
+
+	for (int iter = 0; iter < PHTREE_TS_READERS; iter++)
+	{
+		ph5_ts_reader_t* reader = &tree->readers[(ts_reader_hint + iter) % PHTREE_TS_READERS];
+		uint64_t epoch = atomic_load (&tree->epoch);
+		uint64_t free_slot = 0;
+
+		if (atomic_compare_exchange_strong (&reader->epoch, &free_slot, epoch))
+		{
+			uint64_t current;
+
+			// the epoch can move on between reading it and taking the slot
+			while ((current = atomic_load (&tree->epoch)) != epoch)
+			{
+				atomic_store (&reader->epoch, current);
+				epoch = current;
+			}
+
+			return reader;
+		}
+	}
+
+	return NULL;
+}
+
+static void ts_reader_exit (ph5_ts_reader_t* reader)
+{
+	if (reader)
+	{
+		atomic_store_explicit (&reader->epoch, 0, memory_order_release);
+	}
+}
+
+/*
+ * mark a write locked partition as being changed
+ */
+static void ts_partition_change (ph5_ts_t* tree, ph5_ts_partition_t* partition)
+{
+	ts_version_begin (&partition->version);
+	partition->writes++;
+
+	ts_writer = tree;
+	ts_retiring = &partition->retired;
+}
+
+static void ts_partition_write_end (ph5_ts_t* tree, ph5_ts_partition_t* partition)
+{
+	ts_version_end (&partition->version);
+	ts_retire_stamp (tree, &partition->retired);
+
+	if (partition->retired.count >= TS_RECLAIM_THRESHOLD && ts_retire_list_due (tree, &partition->retired))
+	{
+		ts_retire_list_reclaim (tree, &partition->retired, ts_epoch_advance (tree));
+	}
+
+	ts_writer = NULL;
+	ts_retiring = NULL;
+
+	ts_release (&partition->lock);
+}
+
+static void ts_partition_write_begin (ph5_ts_t* tree, ph5_ts_partition_t* partition)
+{
+	ts_write_acquire (tree, &partition->lock);
+	ts_partition_change (tree, partition);
+}
+
+/*
+ * lock the whole tree
+ * 	always the root first and then the partitions in order
+ * 		so threads locking several partitions can not deadlock
+ */
+static void ts_exclusive_acquire (ph5_ts_t* tree)
+{
+	ts_write_acquire (tree, &tree->lock);
+
+	for (int iter = 0; iter < (int) NODE_CHILD_MAX; iter++)
+	{
+		ts_write_acquire (tree, &tree->partitions[iter].lock);
+	}
+
+	ts_version_begin (&tree->version);
+
+	for (int iter = 0; iter < (int) NODE_CHILD_MAX; iter++)
+	{
+		ts_version_begin (&tree->partitions[iter].version);
+	}
+
+	tree->exclusive_writes++;
+
+	ts_writer = tree;
+	ts_retiring = &tree->retired;
+}
+
+static void ts_exclusive_release (ph5_ts_t* tree)
+{
+	// partition writers would race on the recycle pool
+	recycled_children_free (&tree->tree);
+
+	for (int iter = (int) NODE_CHILD_MAX - 1; iter >= 0; iter--)
+	{
+		ts_version_end (&tree->partitions[iter].version);
+	}
+
+	ts_version_end (&tree->version);
+	ts_retire_stamp (tree, &tree->retired);
+
+	// every partition is locked, so this is a good time to free what all of them retired
+	bool retired = ts_retire_list_due (tree, &tree->retired);
+
+	for (int iter = 0; iter < (int) NODE_CHILD_MAX; iter++)
+	{
+		retired = retired || ts_retire_list_due (tree, &tree->partitions[iter].retired);
+	}
+
+	if (retired)
+	{
+		uint64_t oldest = ts_epoch_advance (tree);
+
+		if (ts_retire_list_due (tree, &tree->retired))
+		{
+			ts_retire_list_reclaim (tree, &tree->retired, oldest);
+		}
+
+		for (int iter = 0; iter < (int) NODE_CHILD_MAX; iter++)
+		{
+			if (ts_retire_list_due (tree, &tree->partitions[iter].retired))
+			{
+				ts_retire_list_reclaim (tree, &tree->partitions[iter].retired, oldest);
+			}
+		}
+	}
+
+	ts_writer = NULL;
+	ts_retiring = NULL;
+
+	for (int iter = (int) NODE_CHILD_MAX - 1; iter >= 0; iter--)
+	{
+		ts_release (&tree->partitions[iter].lock);
+	}
+
+	ts_release (&tree->lock);
+}
+
+static void ts_shared_acquire (ph5_ts_t* tree)
+{
+	ts_read_acquire (tree, &tree->lock);
+
+	for (int iter = 0; iter < (int) NODE_CHILD_MAX; iter++)
+	{
+		ts_read_acquire (tree, &tree->partitions[iter].lock);
+	}
+}
+
+static void ts_shared_release (ph5_ts_t* tree)
+{
+	for (int iter = (int) NODE_CHILD_MAX - 1; iter >= 0; iter--)
+	{
+		ts_release (&tree->partitions[iter].lock);
+	}
+
+	ts_release (&tree->lock);
+}
+
+static bool ts_lock_initialize (pthread_rwlock_t* lock)
+{
+	pthread_rwlockattr_t attributes;
+
+	if (pthread_rwlockattr_init (&attributes) != 0)
+	{
+		return false;
+	}
+
+#if defined (__GLIBC__)
+	// glibc prefers readers by default
+	// 	which starves writers when there are many reading threads
+	pthread_rwlockattr_setkind_np (&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+	int result = pthread_rwlock_init (lock, &attributes);
+	pthread_rwlockattr_destroy (&attributes);
+
+	return result == 0;
+}
+
+bool ph5_ts_initialize (
+	ph5_ts_t* tree,
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void* element),
+	ph5_node_t* (*node_children_malloc) (ph5_node_t* node),
+	ph5_node_t* (*node_children_expand) (ph5_node_t* node),
+	ph5_node_t* (*node_children_shrink) (ph5_node_t* node),
+	void (*node_children_free) (ph5_node_t* node))
+{
+	if (!ts_lock_initialize (&tree->lock))
+	{
+		return false;
+	}
+
+	for (int iter = 0; iter < (int) NODE_CHILD_MAX; iter++)
+	{
+		ph5_ts_partition_t* partition = &tree->partitions[iter];
+
+		if (!ts_lock_initialize (&partition->lock))
+		{
+			while (iter > 0)
+			{
+				iter--;
+				pthread_rwlock_destroy (&tree->partitions[iter].lock);
+			}
+
+			pthread_rwlock_destroy (&tree->lock);
+
+			return false;
+		}
+
+		atomic_init (&partition->version, 0);
+		partition->writes = 0;
+		partition->retired = (ph5_ts_retire_list_t) {0};
+	}
+
+	ph5_initialize (&tree->tree, element_create, element_destroy, node_children_malloc, node_children_expand, node_children_shrink, node_children_free);
+
+	// keep the functions the tree ended up with
+	// 	and give it ones which retire instead of freeing
+	tree->element_destroy = tree->tree.element_destroy;
+	tree->node_children_malloc = tree->tree.node_children_malloc;
+	tree->node_children_expand = tree->tree.node_children_expand;
+	tree->node_children_free = tree->tree.node_children_free;
+
+	tree->tree.element_destroy = ts_element_retire;
+	tree->tree.node_children_expand = ts_children_expand;
+	tree->tree.node_children_free = ts_children_retire;
+
+	atomic_init (&tree->version, 0);
+	tree->retired = (ph5_ts_retire_list_t) {0};
+	// 0 marks a free reader slot, so epochs start at 1
+	atomic_init (&tree->epoch, 1);
+
+	for (int iter = 0; iter < PHTREE_TS_READERS; iter++)
+	{
+		atomic_init (&tree->readers[iter].epoch, 0);
+	}
+
+	atomic_init (&tree->snapshots, 0);
+	atomic_init (&tree->reads_retried, 0);
+	atomic_init (&tree->reads_contended, 0);
+	atomic_init (&tree->writes_contended, 0);
+	atomic_init (&tree->read_wait_nanoseconds, 0);
+	atomic_init (&tree->write_wait_nanoseconds, 0);
+	tree->exclusive_writes = 0;
+
+	return true;
+}
+
+void ph5_ts_destroy (ph5_ts_t* tree)
+{
+	ts_writer = tree;
+	ts_retiring = &tree->retired;
+	ph5_clear (&tree->tree);
+	ts_writer = NULL;
+	ts_retiring = NULL;
+
+	ts_retire_list_free (tree, &tree->retired);
+
+	for (int iter = 0; iter < (int) NODE_CHILD_MAX; iter++)
+	{
+		ts_retire_list_free (tree, &tree->partitions[iter].retired);
+		pthread_rwlock_destroy (&tree->partitions[iter].lock);
+	}
+
+	pthread_rwlock_destroy (&tree->lock);
+}
+
+void ph5_ts_clear (ph5_ts_t* tree)
+{
+	ph5_node_t* root = &tree->tree.root;
+
+	ts_exclusive_acquire (tree);
+
+	// ph5_clear writes to the entries it frees
+	// 	which snapshots can still be reading
+	for (int iter = 0; iter < root->child_count; iter++)
+	{
+		ts_nodes_retire (&root->children[iter]);
+	}
+
+	ts_children_retire (root);
+
+	root->children = NULL;
+	root->active_children = 0;
+	root->child_count = 0;
+
+	ts_exclusive_release (tree);
+}
+
+/*
+ * insert or remove point in a write locked tree
+ * 	copying its path first while there are snapshots
+ */
+static void* ts_insert_locked (ph5_ts_t* tree, ph5_point_t* point, void* element)
+{
+	if (atomic_load_explicit (&tree->snapshots, memory_order_relaxed) > 0)
+	{
+		ph5_node_t* entry = ph5_find_entry (&tree->tree, point);
+
+		if (entry)
+		{
+			return entry->children;
+		}
+
+		ts_path_copy (tree, point);
+	}
+
+	return ph5_insert (&tree->tree, point, element);
+}
+
+static void ts_remove_locked (ph5_ts_t* tree, ph5_point_t* point)
+{
+	if (atomic_load_explicit (&tree->snapshots, memory_order_relaxed) > 0)
+	{
+		if (!ph5_find_entry (&tree->tree, point))
+		{
+			return;
+		}
+
+		ts_path_copy (tree, point);
+	}
+
+	ph5_remove (&tree->tree, point);
+}
+
+void* ph5_ts_insert (ph5_ts_t* tree, ph5_point_t* point, void* element)
+{
+	ph5_node_t* root = &tree->tree.root;
+	void* inserted = NULL;
+
+	ts_read_acquire (tree, &tree->lock);
+	hypercube_address_t address = calculate_hypercube_address (point, root);
+
+	// while the root has a child at address
+	// 	inserting only changes that child and what is under it
+	if (child_active (root, address))
+	{
+		ph5_ts_partition_t* partition = &tree->partitions[address];
+
+		ts_partition_write_begin (tree, partition);
+		inserted = ts_insert_locked (tree, point, element);
+		ts_partition_write_end (tree, partition);
+		ts_release (&tree->lock);
+
+		return inserted;
+	}
+
+	ts_release (&tree->lock);
+
+	// adding a child to the root moves every partition's child
+	ts_exclusive_acquire (tree);
+	inserted = ts_insert_locked (tree, point, element);
+	ts_exclusive_release (tree);
+
+	return inserted;
+}
+
+void ph5_ts_insert_batch (ph5_ts_t* tree, ph5_point_t* points, void** inputs, size_t count, void** out_elements)
+{
+	ts_exclusive_acquire (tree);
+
+	if (atomic_load_explicit (&tree->snapshots, memory_order_relaxed) == 0)
+	{
+		ph5_insert_batch (&tree->tree, points, inputs, count, out_elements);
+	}
+	// the batch grows arrays in place, so with snapshots each point copies its own path
+	else
+	{
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			void* inserted = ts_insert_locked (tree, &points[iter], inputs ? inputs[iter] : NULL);
+
+			if (out_elements)
+			{
+				out_elements[iter] = inserted;
+			}
+		}
+	}
+
+	ts_exclusive_release (tree);
+}
+
+void ph5_ts_remove (ph5_ts_t* tree, ph5_point_t* point)
+{
+	ph5_node_t* root = &tree->tree.root;
+
+	ts_read_acquire (tree, &tree->lock);
+	hypercube_address_t address = calculate_hypercube_address (point, root);
+
+	if (!child_active (root, address))
+	{
+		ts_release (&tree->lock);
+
+		return;
+	}
+
+	ph5_ts_partition_t* partition = &tree->partitions[address];
+	ts_write_acquire (tree, &partition->lock);
+
+	ph5_node_t* child = &root->children[child_index (root, address)];
+
+	// removing the last entry of a leaf child of the root
+	// 	is the only remove which takes a child away from the root
+	if (!phtree_node_is_leaf (child) || child->child_count > 1)
+	{
+		ts_partition_change (tree, partition);
+		ts_remove_locked (tree, point);
+		ts_partition_write_end (tree, partition);
+		ts_release (&tree->lock);
+
+		return;
+	}
+
+	ts_release (&partition->lock);
+	ts_release (&tree->lock);
+
+	ts_exclusive_acquire (tree);
+	ts_remove_locked (tree, point);
+	ts_exclusive_release (tree);
+}
+
+typedef struct ts_matches_t
+{
+	ph5_point_t* points;
+	size_t count;
+	size_t capacity;
+} ts_matches_t;
+
+/*
+ * collect the points of every entry under node ph5_remove_if would remove
+ */
+static void ts_matches_collect (ts_matches_t* matches, ph5_node_t* node, ph5_query_t* query, phtree_predicate_function_t predicate, void* data)
+{
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		ph5_node_t* child = &node->children[iter];
+
+		if (!phtree_node_is_leaf (node))
+		{
+			if (!query || prefix_in_window (child, query))
+			{
+				ts_matches_collect (matches, child, query, predicate, data);
+			}
+		}
+		else if ((!query || point_in_window (child, query)) && predicate (child->children, data))
+		{
+			if (matches->count >= matches->capacity)
+			{
+				matches->capacity = matches->capacity ? matches->capacity * 2 : 16;
+				matches->points = realloc (matches->points, matches->capacity * sizeof (ph5_point_t));
+			}
+
+			matches->points[matches->count] = child->point;
+			matches->count++;
+		}
+	}
+}
+
+void ph5_ts_remove_if (ph5_ts_t* tree, ph5_query_t* query, phtree_predicate_function_t predicate, void* data)
+{
+	if (!predicate)
+	{
+		return;
+	}
+
+	ts_exclusive_acquire (tree);
+
+	if (atomic_load_explicit (&tree->snapshots, memory_order_relaxed) == 0)
+	{
+		ph5_remove_if (&tree->tree, query, predicate, data);
+	}
+	// the single pass compacts arrays in place, so with snapshots each match copies its own path
+	else
+	{
+		ts_matches_t matches = {0};
+
+		for (int iter = 0; iter < tree->tree.root.child_count; iter++)
+		{
+			if (!query || prefix_in_window (&tree->tree.root.children[iter], query))
+			{
+				ts_matches_collect (&matches, &tree->tree.root.children[iter], query, predicate, data);
+			}
+		}
+
+		for (size_t iter = 0; iter < matches.count; iter++)
+		{
+			ts_remove_locked (tree, &matches.points[iter]);
+		}
+
+		free (matches.points);
+	}
+
+	ts_exclusive_release (tree);
+}
+
+/*
+ * copy the root's child at address without locking
+ * 	returns false if a writer got in the way
+ *
+ * exists is set to whether the root has a child at address
+ * version is set to the version of the child's partition the copy was made at
+ */
+static bool ts_optimistic_child (ph5_ts_t* tree, hypercube_address_t address, ph5_node_t* child, bool* exists, uint64_t* version)
+{
+	ph5_node_t* root = &tree->tree.root;
+	uint64_t root_version;
+
+	if (!ts_version_read (&tree->version, &root_version))
+	{
+		return false;
+	}
+
+	*exists = child_active (root, address);
+	ph5_node_t* children = root->children;
+	int index = child_index (root, address);
+
+	// children and index can only be trusted once the root version has been checked
+	if (!ts_version_check (&tree->version, root_version))
+	{
+		return false;
+	}
+
+	if (!*exists)
+	{
+		return true;
+	}
+
+	atomic_uint_least64_t* partition_version = &tree->partitions[address].version;
+
+	if (!ts_version_read (partition_version, version))
+	{
+		return false;
+	}
+
+	*child = children[index];
+
+	return ts_version_check (partition_version, *version) && ts_version_check (&tree->version, root_version);
+}
+
+/*
+ * find the element at point without locking
+ * 	returns false if a writer got in the way
+ *
+ * every node is copied and checked against its partition's version before it is used
+ * 	so only pointers out of a consistent node are ever followed
+ */
+static bool ts_optimistic_find (ph5_ts_t* tree, ph5_point_t* point, void** element)
+{
+	hypercube_address_t address = calculate_hypercube_address (point, &tree->tree.root);
+	ph5_node_t node;
+	bool exists = false;
+	uint64_t version = 0;
+
+	*element = NULL;
+
+	if (!ts_optimistic_child (tree, address, &node, &exists, &version))
+	{
+		return false;
+	}
+
+	if (!exists)
+	{
+		return true;
+	}
+
+	atomic_uint_least64_t* partition_version = &tree->partitions[address].version;
+
+	while (!phtree_node_is_leaf (&node))
+	{
+		address = calculate_hypercube_address (point, &node);
+
+		if (!child_active (&node, address)
+			|| !prefix_equal (point, &node.point, node.postfix_length))
+		{
+			return true;
+		}
+
+		node = node.children[child_index (&node, address)];
+
+		if (!ts_version_check (partition_version, version))
+		{
+			return false;
+		}
+	}
+
+	address = calculate_hypercube_address (point, &node);
+
+	if (!child_active (&node, address)
+		|| !prefix_equal (point, &node.point, node.postfix_length))
+	{
+		return true;
+	}
+
+	*element = node.children[child_index (&node, address)].children;
+
+	return ts_version_check (partition_version, version);
+}
+
+/*
+ * read lock the partition point is in and find point's entry
+ * 	the root lock is only held until the partition is locked
+ * 		so finds do not hold up threads which are adding children to the root
+ * returns the locked partition
+ * 	or NULL if the root has no child where point would be
+ */
+static ph5_ts_partition_t* ts_find_locked (ph5_ts_t* tree, ph5_point_t* point, ph5_node_t** entry)
+{
+	ph5_node_t* root = &tree->tree.root;
+
+	ts_read_acquire (tree, &tree->lock);
+	hypercube_address_t address = calculate_hypercube_address (point, root);
+
+	if (!child_active (root, address))
+	{
+		ts_release (&tree->lock);
+
+		return NULL;
+	}
+
+	ph5_ts_partition_t* partition = &tree->partitions[address];
+	ts_read_acquire (tree, &partition->lock);
+
+	// the child itself moves when the root's children array changes
+	// 	but nothing under it can change while its partition is locked
+	ph5_node_t child = root->children[child_index (root, address)];
+	ts_release (&tree->lock);
+
+	*entry = node_find_entry (&child, point);
+
+	return partition;
+}
+
+/*
+ * try to find point's element optimistically a few times
+ * 	returns false if it never got a consistent result
+ */
+static bool ts_find_retrying (ph5_ts_t* tree, ph5_point_t* point, void** element)
+{
+	for (int attempt = 0; attempt < TS_OPTIMISTIC_RETRIES; attempt++)
+	{
+		if (ts_optimistic_find (tree, point, element))
+		{
+			return true;
+		}
+
+		atomic_fetch_add_explicit (&tree->reads_retried, 1, memory_order_relaxed);
+	}
+
+	return false;
+}
+
+void* ph5_ts_find (ph5_ts_t* tree, ph5_point_t* point)
+{
+	void* element = NULL;
+	ph5_ts_reader_t* reader = ts_reader_enter (tree);
+
+	if (reader)
+	{
+		bool found = ts_find_retrying (tree, point, &element);
+		ts_reader_exit (reader);
+
+		if (found)
+		{
+			return element;
+		}
+	}
+
+	ph5_node_t* entry = NULL;
+	ph5_ts_partition_t* partition = ts_find_locked (tree, point, &entry);
+
+	if (!partition)
+	{
+		return NULL;
+	}
+
+	element = entry ? entry->children : NULL;
+	ts_release (&partition->lock);
+
+	return element;
+}
+
+bool ph5_ts_find_apply (ph5_ts_t* tree, ph5_point_t* point, phtree_iteration_function_t function, void* data)
+{
+	void* element = NULL;
+	ph5_ts_reader_t* reader = ts_reader_enter (tree);
+
+	// the reader slot keeps the element from being destroyed until function is done
+	if (reader)
+	{
+		bool found = ts_find_retrying (tree, point, &element);
+
+		if (found && element)
+		{
+			function (element, data);
+		}
+
+		ts_reader_exit (reader);
+
+		if (found)
+		{
+			return element != NULL;
+		}
+	}
+
+	ph5_node_t* entry = NULL;
+	ph5_ts_partition_t* partition = ts_find_locked (tree, point, &entry);
+
+	if (!partition)
+	{
+		return false;
+	}
+
+	if (entry)
+	{
+		function (entry->children, data);
+	}
+
+	ts_release (&partition->lock);
+
+	return entry != NULL;
+}
+
+bool ph5_ts_empty (ph5_ts_t* tree)
+{
+	uint64_t version;
+
+	// the root's children only change while the whole tree is locked
+	if (ts_version_read (&tree->version, &version))
+	{
+		bool empty = tree->tree.root.child_count == 0;
+
+		if (ts_version_check (&tree->version, version))
+		{
+			return empty;
+		}
+	}
+
+	ts_read_acquire (tree, &tree->lock);
+	bool empty = ph5_empty (&tree->tree);
+	ts_release (&tree->lock);
+
+	return empty;
+}
+
+void ph5_ts_for_each (ph5_ts_t* tree, phtree_iteration_function_t function, void* data)
+{
+	ph5_node_t* root = &tree->tree.root;
+
+	ts_read_acquire (tree, &tree->lock);
+
+	// only one partition is locked at a time
+	// 	so writers in the other partitions keep going
+	for (hypercube_address_t address = 0; address < NODE_CHILD_MAX; address++)
+	{
+		if (child_active (root, address))
+		{
+			ts_read_acquire (tree, &tree->partitions[address].lock);
+			for_each (&tree->tree, &root->children[child_index (root, address)], function, data);
+			ts_release (&tree->partitions[address].lock);
+		}
+	}
+
+	ts_release (&tree->lock);
+}
+
+/*
+ * an optimistic query of one partition
+ * 	elements are collected and only handed to the query function
+ * 		once the whole partition has been read without a writer getting in the way
+ */
+typedef struct ts_optimistic_query_t
+{
+	atomic_uint_least64_t* version;
+	uint64_t expected;
+	void* elements[TS_OPTIMISTIC_ELEMENTS];
+	int count;
+	bool failed;
+	// more elements than fit in elements
+	bool overflowed;
+} ts_optimistic_query_t;
+
+static void ts_optimistic_query_node (ts_optimistic_query_t* context, ph5_node_t* node, ph5_query_t* query)
+{
+	if (!prefix_in_window (node, query))
+	{
+		return;
+	}
+
+	phtree_key_t mask_lower;
+	phtree_key_t mask_upper;
+	node_query_masks (node, query, &mask_lower, &mask_upper);
+
+	for (unsigned int iter = 0; iter < NODE_CHILD_MAX && !context->failed; iter++)
+	{
+		if (!child_active (node, iter) || ((iter | mask_lower) & mask_upper) != iter)
+		{
+			continue;
+		}
+
+		ph5_node_t child = node->children[child_index (node, iter)];
+
+		if (!ts_version_check (context->version, context->expected))
+		{
+			context->failed = true;
+
+			return;
+		}
+
+		if (!phtree_node_is_leaf (node))
+		{
+			ts_optimistic_query_node (context, &child, query);
+		}
+		else if (point_in_window (&child, query))
+		{
+			if (context->count >= TS_OPTIMISTIC_ELEMENTS)
+			{
+				context->failed = true;
+				context->overflowed = true;
+
+				return;
+			}
+
+			context->elements[context->count] = child.children;
+			context->count++;
+		}
+	}
+}
+
+/*
+ * query one partition optimistically a few times
+ * 	returns false if it never got a consistent result
+ */
+static bool ts_query_partition_optimistic (ph5_ts_t* tree, hypercube_address_t address, ph5_query_t* query, void* data)
+{
+	ts_optimistic_query_t context;
+	context.version = &tree->partitions[address].version;
+
+	for (int attempt = 0; attempt < TS_OPTIMISTIC_RETRIES; attempt++)
+	{
+		ph5_node_t child;
+		bool exists = false;
+
+		context.count = 0;
+		context.failed = false;
+		context.overflowed = false;
+
+		if (ts_optimistic_child (tree, address, &child, &exists, &context.expected))
+		{
+			if (!exists)
+			{
+				return true;
+			}
+
+			ts_optimistic_query_node (&context, &child, query);
+
+			if (!context.failed)
+			{
+				for (int iter = 0; iter < context.count; iter++)
+				{
+					query->function (context.elements[iter], data);
+				}
+
+				return true;
+			}
+
+			// a big result is cheaper to get under a lock than to collect again
+			if (context.overflowed)
+			{
+				return false;
+			}
+		}
+
+		atomic_fetch_add_explicit (&tree->reads_retried, 1, memory_order_relaxed);
+	}
+
+	return false;
+}
+
+static void ts_query_partition_locked (ph5_ts_t* tree, hypercube_address_t address, ph5_query_t* query, void* data)
+{
+	ph5_node_t* root = &tree->tree.root;
+
+	ts_read_acquire (tree, &tree->lock);
+
+	if (child_active (root, address))
+	{
+		ts_read_acquire (tree, &tree->partitions[address].lock);
+		node_query_window (&root->children[child_index (root, address)], query, data);
+		ts_release (&tree->partitions[address].lock);
+	}
+
+	ts_release (&tree->lock);
+}
+
+void ph5_ts_query (ph5_ts_t* tree, ph5_query_t* query, void* data)
+{
+	if (!query || !query->function)
+	{
+		return;
+	}
+
+	// the reader slot also keeps collected elements alive until the query function is done with them
+	ph5_ts_reader_t* reader = ts_reader_enter (tree);
+
+	for (hypercube_address_t address = 0; address < NODE_CHILD_MAX; address++)
+	{
+		if (!reader || !ts_query_partition_optimistic (tree, address, query, data))
+		{
+			ts_query_partition_locked (tree, address, query, data);
+		}
+	}
+
+	ts_reader_exit (reader);
+}
+
+ph5_t* ph5_ts_read_lock (ph5_ts_t* tree)
+{
+	ts_shared_acquire (tree);
+
+	return &tree->tree;
+}
+
+void ph5_ts_read_unlock (ph5_ts_t* tree)
+{
+	ts_shared_release (tree);
+}
+
+ph5_t* ph5_ts_write_lock (ph5_ts_t* tree)
+{
+	ts_exclusive_acquire (tree);
+
+	return &tree->tree;
+}
+
+void ph5_ts_write_unlock (ph5_ts_t* tree)
+{
+	ts_exclusive_release (tree);
+}
+
+void ph5_ts_stats (ph5_ts_t* tree, ph5_ts_stats_t* stats)
+{
+	stats->reads_contended = atomic_load_explicit (&tree->reads_contended, memory_order_relaxed);
+	stats->writes_contended = atomic_load_explicit (&tree->writes_contended, memory_order_relaxed);
+	stats->read_wait_nanoseconds = atomic_load_explicit (&tree->read_wait_nanoseconds, memory_order_relaxed);
+	stats->write_wait_nanoseconds = atomic_load_explicit (&tree->write_wait_nanoseconds, memory_order_relaxed);
+	stats->reads_retried = atomic_load_explicit (&tree->reads_retried, memory_order_relaxed);
+
+	// the write counts are only written while their lock is write locked
+	ts_shared_acquire (tree);
+
+	stats->exclusive_writes = tree->exclusive_writes;
+	stats->writes = tree->exclusive_writes;
+
+	for (int iter = 0; iter < (int) NODE_CHILD_MAX; iter++)
+	{
+		stats->writes += tree->partitions[iter].writes;
+	}
+
+	stats->retired = tree->retired.count;
+
+	for (int iter = 0; iter < (int) NODE_CHILD_MAX; iter++)
+	{
+		stats->retired += tree->partitions[iter].retired.count;
+	}
+
+	ts_shared_release (tree);
+}
+
+/*
+ * a snapshot is the root of the tree with its own copy of the root's children array
+ * 	everything under the root is shared with the tree
+ * 		writers copy what they change instead while the snapshot is alive
+ * 	and the snapshot's reader slot keeps what they replace from being freed
+ */
+bool ph5_ts_snapshot_take (ph5_ts_t* tree, ph5_ts_snapshot_t* snapshot)
+{
+	ph5_node_t* root = &tree->tree.root;
+
+	ts_shared_acquire (tree);
+
+	snapshot->reader = ts_reader_enter (tree);
+
+	if (!snapshot->reader)
+	{
+		ts_shared_release (tree);
+
+		return false;
+	}
+
+	snapshot->source = tree;
+	snapshot->tree = tree->tree;
+	snapshot->tree.recycled_children = NULL;
+	snapshot->tree.root.children = NULL;
+	snapshot->tree.root.child_capacity = 0;
+
+	if (root->child_count > 0)
+	{
+		snapshot->tree.root.children = malloc (root->child_count * sizeof (ph5_node_t));
+		snapshot->tree.root.child_capacity = root->child_count;
+		memcpy (snapshot->tree.root.children, root->children, root->child_count * sizeof (ph5_node_t));
+	}
+
+	// writers wait for the partition locks, so they all see the snapshot
+	atomic_fetch_add (&tree->snapshots, 1);
+
+	ts_shared_release (tree);
+
+	return true;
+}
+
+void ph5_ts_snapshot_release (ph5_ts_snapshot_t* snapshot)
 {
-	ph5_query_t query;
-	ph5_query_set (&query, min, max, function);
+	free (snapshot->tree.root.children);
+	snapshot->tree.root.children = NULL;
+	snapshot->tree.root.active_children = 0;
+	snapshot->tree.root.child_count = 0;
+	snapshot->tree.root.child_capacity = 0;
+
+	atomic_fetch_sub (&snapshot->source->snapshots, 1);
+	ts_reader_exit (snapshot->reader);
+	snapshot->reader = NULL;
+}
+
+static void* pool_worker (void* data)
+{
+	phtree_pool_t* pool = data;
+	uint64_t generation = 0;
+
+	pthread_mutex_lock (&pool->lock);
+	pool->workers_started++;
+	int thread = pool->workers_started;
+
+	while (true)
+	{
+		while (pool->generation == generation && !pool->stopping)
+		{
+			pthread_cond_wait (&pool->start, &pool->lock);
+		}
+
+		if (pool->stopping)
+		{
+			break;
+		}
+
+		generation = pool->generation;
+		phtree_job_function_t job = pool->job;
+		void* job_data = pool->job_data;
+		pthread_mutex_unlock (&pool->lock);
+
+		job (job_data, thread);
+
+		pthread_mutex_lock (&pool->lock);
+		pool->running--;
+
+		if (pool->running == 0)
+		{
+			pthread_cond_broadcast (&pool->finish);
+		}
+	}
+
+	pthread_mutex_unlock (&pool->lock);
+
+	return NULL;
+}
+
+static void pool_run (phtree_pool_t* pool, phtree_job_function_t job, void* data)
+{
+	pthread_mutex_lock (&pool->lock);
+
+	// one job at a time
+	while (pool->busy)
+	{
+		pthread_cond_wait (&pool->finish, &pool->lock);
+	}
+
+	pool->busy = true;
+	pool->job = job;
+	pool->job_data = data;
+	pool->running = pool->thread_count - 1;
+	pool->generation++;
+	pthread_cond_broadcast (&pool->start);
+	pthread_mutex_unlock (&pool->lock);
+
+	job (data, 0);
+
+	pthread_mutex_lock (&pool->lock);
+
+	while (pool->running > 0)
+	{
+		pthread_cond_wait (&pool->finish, &pool->lock);
+	}
+
+	pool->busy = false;
+	pthread_cond_broadcast (&pool->finish);
+	pthread_mutex_unlock (&pool->lock);
+}
+
+bool ph5_pool_initialize (phtree_pool_t* pool, int thread_count)
+{
+	*pool = (phtree_pool_t) {0};
+
+	if (thread_count < 1)
+	{
+		thread_count = 1;
+	}
+
+	pool->run = pool_run;
+	pool->workers = malloc ((thread_count - 1) * sizeof (pthread_t) + 1);
+
+	if (!pool->workers
+		|| pthread_mutex_init (&pool->lock, NULL) != 0)
+	{
+		free (pool->workers);
+
+		return false;
+	}
+
+	if (pthread_cond_init (&pool->start, NULL) != 0
+		|| pthread_cond_init (&pool->finish, NULL) != 0)
+	{
+		pthread_mutex_destroy (&pool->lock);
+		free (pool->workers);
+
+		return false;
+	}
+
+	// thread_count only counts the workers which actually started
+	pool->thread_count = 1;
+
+	for (int iter = 0; iter < thread_count - 1; iter++)
+	{
+		if (pthread_create (&pool->workers[iter], NULL, pool_worker, pool) != 0)
+		{
+			ph5_pool_destroy (pool);
+
+			return false;
+		}
+
+		pool->thread_count++;
+	}
+
+	return true;
+}
+
+void ph5_pool_destroy (phtree_pool_t* pool)
+{
+	if (!pool->workers)
+	{
+		return;
+	}
+
+	pthread_mutex_lock (&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast (&pool->start);
+	pthread_mutex_unlock (&pool->lock);
+
+	for (int iter = 0; iter < pool->thread_count - 1; iter++)
+	{
+		pthread_join (pool->workers[iter], NULL);
+	}
+
+	pthread_cond_destroy (&pool->finish);
+	pthread_cond_destroy (&pool->start);
+	pthread_mutex_destroy (&pool->lock);
+	free (pool->workers);
+
+	*pool = (phtree_pool_t) {0};
+}
+
+typedef struct parallel_context_t
+{
+	ph5_t* tree;
+	ph5_query_t* query;
+	phtree_iteration_function_t function;
+	void** thread_data;
+
+	// the nodes whose entries are a task, in z-order
+	ph5_node_t** tasks;
+	size_t task_count;
+	size_t task_capacity;
+	// set if a task could still be split by going deeper
+	bool splittable;
+
+	atomic_size_t next_task;
+} parallel_context_t;
+
+static void parallel_task_add (parallel_context_t* context, ph5_node_t* node)
+{
+	if (context->task_count >= context->task_capacity)
+	{
+		context->task_capacity = context->task_capacity ? context->task_capacity * 2 : NODE_CHILD_MAX;
+		context->tasks = realloc (context->tasks, context->task_capacity * sizeof (ph5_node_t*));
+	}
+
+	context->tasks[context->task_count] = node;
+	context->task_count++;
+}
+
+/*
+ * make a task of every node depth levels below node
+ * 	or of leaves above that
+ * 		skipping nodes which are outside of the query window
+ */
+static void parallel_tasks_collect (parallel_context_t* context, ph5_node_t* node, int depth)
+{
+	if (context->query && !prefix_in_window (node, context->query))
+	{
+		return;
+	}
+
+	if (phtree_node_is_leaf (node))
+	{
+		parallel_task_add (context, node);
+
+		return;
+	}
+
+	if (depth <= 1)
+	{
+		parallel_task_add (context, node);
+		context->splittable = true;
+
+		return;
+	}
+
+	phtree_key_t mask_lower = 0;
+	phtree_key_t mask_upper = NODE_CHILD_MAX - 1;
+
+	if (context->query)
+	{
+		node_query_masks (node, context->query, &mask_lower, &mask_upper);
+	}
+
+	for (unsigned int iter = 0; iter < NODE_CHILD_MAX; iter++)
+	{
+		if (child_active (node, iter) && ((iter | mask_lower) & mask_upper) == iter)
+		{
+			parallel_tasks_collect (context, &node->children[child_index (node, iter)], depth - 1);
+		}
+	}
+}
+
+static void parallel_tasks_split (parallel_context_t* context, int split_depth, int thread_count)
+{
+	bool automatic = split_depth <= 0;
+	int depth = automatic ? 1 : split_depth;
+
+	while (true)
+	{
+		context->task_count = 0;
+		context->splittable = false;
+
+		for (int iter = 0; iter < context->tree->root.child_count; iter++)
+		{
+			parallel_tasks_collect (context, &context->tree->root.children[iter], depth);
+		}
+
+		// a few tasks per thread so threads which finish early have something to take
+		if (!automatic || !context->splittable || context->task_count >= (size_t) thread_count * 4)
+		{
+			return;
+		}
+
+		depth++;
+	}
+}
+
+static void parallel_job (void* data, int thread)
+{
+	parallel_context_t* context = data;
+	void* thread_data = context->thread_data ? context->thread_data[thread] : NULL;
+	size_t task;
+
+	while ((task = atomic_fetch_add_explicit (&context->next_task, 1, memory_order_relaxed)) < context->task_count)
+	{
+		if (context->query)
+		{
+			node_query_window (context->tasks[task], context->query, thread_data);
+		}
+		else
+		{
+			for_each (context->tree, context->tasks[task], context->function, thread_data);
+		}
+	}
+}
+
+static void parallel_run (ph5_t* tree, ph5_query_t* query, phtree_iteration_function_t function, phtree_pool_t* pool, int split_depth, void** thread_data)
+{
+	parallel_context_t context = {0};
+	context.tree = tree;
+	context.query = query;
+	context.function = function;
+	context.thread_data = thread_data;
+
+	parallel_tasks_split (&context, split_depth, pool->thread_count);
+	atomic_init (&context.next_task, 0);
+
+	pool->run (pool, parallel_job, &context);
+
+	free (context.tasks);
+}
+
+void ph5_query_parallel (ph5_t* tree, ph5_query_t* query, phtree_pool_t* pool, int split_depth, void** thread_data)
+{
+	if (!tree || !query || !query->function)
+	{
+		return;
+	}
+
+	if (!pool || pool->thread_count <= 1)
+	{
+		ph5_query (tree, query, thread_data ? thread_data[0] : NULL);
+
+		return;
+	}
+
+	parallel_run (tree, query, NULL, pool, split_depth, thread_data);
+}
+
+void ph5_for_each_parallel (ph5_t* tree, phtree_iteration_function_t function, phtree_pool_t* pool, int split_depth, void** thread_data)
+{
+	if (!tree || !function)
+	{
+		return;
+	}
+
+	if (!pool || pool->thread_count <= 1)
+	{
+		ph5_for_each (tree, function, thread_data ? thread_data[0] : NULL);
+
+		return;
+	}
+
+	parallel_run (tree, NULL, function, pool, split_depth, thread_data);
+}
+
+// the first bits bits of point's z-order key, which picks its bucket in the parallel build and its shard
+static size_t point_z_bucket (ph5_point_t* point, int bits)
+{
+	size_t bucket = 0;
+
+	for (int iter = 0; iter < bits; iter++)
+	{
+		int shift = PHTREE_DEPTH - 1 - iter / DIMENSIONS;
+		bucket = (bucket << 1) | ((point->values[iter % DIMENSIONS] >> shift) & 1);
+	}
+
+	return bucket;
+}
+
+#ifndef PHTREE_NO_STDLIB
+typedef struct build_task_t
+{
+	ph5_node_t* node;
+	size_t first;
+	size_t last;
+} build_task_t;
+
+typedef struct parallel_build_t
+{
+	ph5_t* tree;
+	ph5_point_t* points;
+	void** inputs;
+	size_t count;
+	int thread_count;
+	ph5_point_t** order;
+
+	/*
+	 * the points are split in to buckets by the first bucket_bits bits of their z-order key
+	 * 	so every bucket can be sorted on its own
+	 * bucket_offsets[thread * bucket_count + bucket] is where thread puts its points of bucket
+	 */
+	int bucket_bits;
+	size_t bucket_count;
+	size_t* bucket_offsets;
+	size_t* bucket_starts;
+
+	build_task_t* tasks;
+	size_t task_count;
+	size_t task_capacity;
+	atomic_size_t next_task;
+} parallel_build_t;
+
+// the slice of the points each thread counts and scatters
+static void build_slice (parallel_build_t* build, int thread, size_t* first, size_t* last)
+{
+	*first = build->count * thread / build->thread_count;
+	*last = build->count * (thread + 1) / build->thread_count;
+}
+
+static void build_count_job (void* data, int thread)
+{
+	parallel_build_t* build = data;
+	size_t* counts = &build->bucket_offsets[thread * build->bucket_count];
+	size_t first;
+	size_t last;
+	build_slice (build, thread, &first, &last);
+
+	for (size_t iter = first; iter < last; iter++)
+	{
+		counts[point_z_bucket (&build->points[iter], build->bucket_bits)]++;
+	}
+}
+
+static void build_scatter_job (void* data, int thread)
+{
+	parallel_build_t* build = data;
+	size_t* offsets = &build->bucket_offsets[thread * build->bucket_count];
+	size_t first;
+	size_t last;
+	build_slice (build, thread, &first, &last);
+
+	for (size_t iter = first; iter < last; iter++)
+	{
+		size_t bucket = point_z_bucket (&build->points[iter], build->bucket_bits);
+		build->order[offsets[bucket]] = &build->points[iter];
+		offsets[bucket]++;
+	}
+}
+
+static void build_sort_job (void* data, int thread)
+{
+	parallel_build_t* build = data;
+	size_t bucket;
+	(void) thread;
+
+	while ((bucket = atomic_fetch_add_explicit (&build->next_task, 1, memory_order_relaxed)) < build->bucket_count)
+	{
+		size_t first = build->bucket_starts[bucket];
+		size_t last = build->bucket_starts[bucket + 1];
+
+		qsort (build->order + first, last - first, sizeof (ph5_point_t*), point_pointer_z_compare);
+	}
+}
+
+static void build_subtree_job (void* data, int thread)
+{
+	parallel_build_t* build = data;
+	size_t task;
+	(void) thread;
+
+	while ((task = atomic_fetch_add_explicit (&build->next_task, 1, memory_order_relaxed)) < build->task_count)
+	{
+		build_task_t* subtree = &build->tasks[task];
+		node_build (build->tree, subtree->node, build->order, build->points, build->inputs, subtree->first, subtree->last);
+	}
+}
+
+static void build_task_add (build_task_t** tasks, size_t* count, size_t* capacity, ph5_node_t* node, size_t first, size_t last)
+{
+	if (*count >= *capacity)
+	{
+		*capacity = *capacity ? *capacity * 2 : NODE_CHILD_MAX;
+		*tasks = realloc (*tasks, *capacity * sizeof (build_task_t));
+	}
+
+	(*tasks)[*count] = (build_task_t) {node, first, last};
+	(*count)++;
+}
+
+/*
+ * build the top of the tree on this thread, a level at a time
+ * 	until there are a few subtrees per thread left to build
+ */
+static void build_top (parallel_build_t* build)
+{
+	build_task_add (&build->tasks, &build->task_count, &build->task_capacity, &build->tree->root, 0, build->count);
+
+	while (build->task_count < (size_t) build->thread_count * 4)
+	{
+		build_task_t* next = NULL;
+		size_t next_count = 0;
+		size_t next_capacity = 0;
+		bool split = false;
+
+		for (size_t iter = 0; iter < build->task_count; iter++)
+		{
+			build_task_t* task = &build->tasks[iter];
+
+			// the entries of a leaf are built by its task
+			if (phtree_node_is_leaf (task->node))
+			{
+				build_task_add (&next, &next_count, &next_capacity, task->node, task->first, task->last);
+
+				continue;
+			}
+
+			size_t group_starts[NODE_CHILD_MAX + 1];
+			int group_count = node_build_children (build->tree, task->node, build->order, build->points, build->inputs, task->first, task->last, group_starts);
+
+			for (int group = 0; group < group_count; group++)
+			{
+				build_task_add (&next, &next_count, &next_capacity, &task->node->children[group], group_starts[group], group_starts[group + 1]);
+			}
+
+			split = true;
+		}
+
+		free (build->tasks);
+		build->tasks = next;
+		build->task_count = next_count;
+		build->task_capacity = next_capacity;
+
+		if (!split)
+		{
+			break;
+		}
+	}
+}
+
+void ph5_build_parallel (ph5_t* tree, ph5_point_t* points, void** inputs, size_t count, phtree_pool_t* pool)
+{
+	if (!tree || !points || count == 0)
+	{
+		return;
+	}
 
-	return query;
+	if (!pool || pool->thread_count <= 1 || !ph5_empty (tree))
+	{
+		ph5_build (tree, points, inputs, count);
+
+		return;
+	}
+
+	parallel_build_t build = {0};
+	build.tree = tree;
+	build.points = points;
+	build.inputs = inputs;
+	build.count = count;
+	build.thread_count = pool->thread_count;
+
+	// a few buckets per thread, so threads which finish sorting early have more to take
+	int max_bits = DIMENSIONS * PHTREE_DEPTH < 16 ? DIMENSIONS * PHTREE_DEPTH : 16;
+	build.bucket_bits = 1;
+
+	while (build.bucket_bits < max_bits && ((size_t) 1 << build.bucket_bits) < (size_t) build.thread_count * 4)
+	{
+		build.bucket_bits++;
+	}
+
+	build.bucket_count = (size_t) 1 << build.bucket_bits;
+	build.order = malloc (count * sizeof (ph5_point_t*));
+	build.bucket_offsets = calloc (build.bucket_count * build.thread_count, sizeof (size_t));
+	build.bucket_starts = malloc ((build.bucket_count + 1) * sizeof (size_t));
+
+	if (!build.order || !build.bucket_offsets || !build.bucket_starts)
+	{
+		free (build.order);
+		free (build.bucket_offsets);
+		free (build.bucket_starts);
+
+		ph5_build (tree, points, inputs, count);
+
+		return;
+	}
+
+	pool->run (pool, build_count_job, &build);
+
+	// turn the counts in to offsets
+	// 	buckets in z-order, and each bucket's points in thread order
+	size_t offset = 0;
+
+	for (size_t bucket = 0; bucket < build.bucket_count; bucket++)
+	{
+		build.bucket_starts[bucket] = offset;
+
+		for (int thread = 0; thread < build.thread_count; thread++)
+		{
+			size_t* slot = &build.bucket_offsets[thread * build.bucket_count + bucket];
+			size_t bucket_size = *slot;
+
+			*slot = offset;
+			offset += bucket_size;
+		}
+	}
+
+	build.bucket_starts[build.bucket_count] = offset;
+
+	pool->run (pool, build_scatter_job, &build);
+
+	atomic_init (&build.next_task, 0);
+	pool->run (pool, build_sort_job, &build);
+
+	build_top (&build);
+
+	// the recycle pool can not be shared between threads
+	ph5_node_t* recycled_children = tree->recycled_children;
+	tree->recycled_children = NULL;
+
+	atomic_store_explicit (&build.next_task, 0, memory_order_relaxed);
+	pool->run (pool, build_subtree_job, &build);
+
+	tree->recycled_children = recycled_children;
+	hash_refresh (tree, NULL);
+
+	free (build.tasks);
+	free (build.bucket_starts);
+	free (build.bucket_offsets);
+	free (build.order);
 }
+#endif
+
+static int sharded_bits_clamp (int shard_bits)
+{
+	int max_bits = DIMENSIONS * PHTREE_DEPTH < PHTREE_SHARD_BITS_MAX ? DIMENSIONS * PHTREE_DEPTH : PHTREE_SHARD_BITS_MAX;
 
+	if (shard_bits < 0)
+	{
+		return 0;
+	}
+
+	return shard_bits > max_bits ? max_bits : shard_bits;
+}
 
 /*
- * clear a window query
+ * the box of points the shard at index holds when there are 1 << shard_bits shards
+ * 	the bits of index are the first bits of the z-order key of every point in the box
  */
-void ph5_query_clear (ph5_query_t* query)
+static void shard_region (int shard_bits, size_t index, ph5_point_t* min, ph5_point_t* max)
 {
 	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
 	{
-		query->min.values[dimension] = 0;
-		query->max.values[dimension] = 0;
+		min->values[dimension] = 0;
+		max->values[dimension] = ~((phtree_key_t) 0);
 	}
 
-	query->function = NULL;
+	for (int iter = 0; iter < shard_bits; iter++)
+	{
+		int dimension = iter % DIMENSIONS;
+		phtree_key_t bit = ((phtree_key_t) 1) << (PHTREE_DEPTH - 1 - iter / DIMENSIONS);
+
+		if ((index >> (shard_bits - 1 - iter)) & 1)
+		{
+			min->values[dimension] |= bit;
+		}
+		else
+		{
+			max->values[dimension] &= ~bit;
+		}
+	}
 }
 
-/*
- * convenience function for setting the values of a ph5_point_t
- */
-void ph5_point_set (ph5_point_t* point, phtree_key_t a, phtree_key_t b, phtree_key_t c, phtree_key_t d, phtree_key_t e)
+static bool shard_in_window (int shard_bits, size_t index, ph5_query_t* query)
 {
-	point->values[0] = a;
-	point->values[1] = b;
-	point->values[2] = c;
-	point->values[3] = d;
-	point->values[4] = e;
+	ph5_point_t min;
+	ph5_point_t max;
+	shard_region (shard_bits, index, &min, &max);
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		if (query->min.values[dimension] > max.values[dimension] || query->max.values[dimension] < min.values[dimension])
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static ph5_shard_t* sharded_shard (ph5_sharded_t* tree, ph5_point_t* point)
+{
+	return &tree->shards[point_z_bucket (point, tree->shard_bits)];
+}
+
+static void shard_write_lock (ph5_sharded_t* tree, ph5_shard_t* shard)
+{
+	if (pthread_rwlock_trywrlock (&shard->lock) != 0)
+	{
+		atomic_fetch_add_explicit (&tree->writes_contended, 1, memory_order_relaxed);
+		pthread_rwlock_wrlock (&shard->lock);
+	}
+
+	shard->writes++;
+}
+
+static void shard_read_lock (ph5_shard_t* shard)
+{
+	pthread_rwlock_rdlock (&shard->lock);
+	atomic_fetch_add_explicit (&shard->reads, 1, memory_order_relaxed);
+}
+
+// only when nothing can be using the shards
+static void shards_free (ph5_shard_t* shards, size_t shard_count)
+{
+	for (size_t iter = 0; iter < shard_count; iter++)
+	{
+		ph5_clear (&shards[iter].tree);
+		pthread_rwlock_destroy (&shards[iter].lock);
+	}
+
+	free (shards);
+}
+
+static ph5_shard_t* shards_create (ph5_sharded_t* tree, size_t shard_count)
+{
+	// every shard's lock is on its own cache line
+	ph5_shard_t* shards = aligned_alloc (_Alignof (ph5_shard_t), shard_count * sizeof (ph5_shard_t));
+
+	if (!shards)
+	{
+		return NULL;
+	}
+
+	for (size_t iter = 0; iter < shard_count; iter++)
+	{
+		ph5_shard_t* shard = &shards[iter];
+
+		if (!ts_lock_initialize (&shard->lock))
+		{
+			shards_free (shards, iter);
+
+			return NULL;
+		}
+
+		ph5_initialize (&shard->tree, tree->element_create, tree->element_destroy, tree->node_children_malloc, tree->node_children_expand, tree->node_children_shrink, tree->node_children_free);
+		shard->count = 0;
+		shard->writes = 0;
+		atomic_init (&shard->reads, 0);
+	}
+
+	return shards;
+}
+
+static void shard_count_entry (void* element, void* data)
+{
+	(void) element;
+	(*(size_t*) data)++;
+}
+
+bool ph5_sharded_initialize (
+	ph5_sharded_t* tree,
+	int shard_bits,
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void* element),
+	ph5_node_t* (*node_children_malloc) (ph5_node_t* node),
+	ph5_node_t* (*node_children_expand) (ph5_node_t* node),
+	ph5_node_t* (*node_children_shrink) (ph5_node_t* node),
+	void (*node_children_free) (ph5_node_t* node))
+{
+	tree->element_create = element_create;
+	tree->element_destroy = element_destroy;
+	tree->node_children_malloc = node_children_malloc;
+	tree->node_children_expand = node_children_expand;
+	tree->node_children_shrink = node_children_shrink;
+	tree->node_children_free = node_children_free;
+
+	tree->shard_bits = sharded_bits_clamp (shard_bits);
+	atomic_init (&tree->writes_contended, 0);
+	tree->reshards = 0;
+
+	if (!ts_lock_initialize (&tree->lock))
+	{
+		return false;
+	}
+
+	tree->shards = shards_create (tree, (size_t) 1 << tree->shard_bits);
+
+	if (!tree->shards)
+	{
+		pthread_rwlock_destroy (&tree->lock);
+
+		return false;
+	}
+
+	return true;
+}
+
+void ph5_sharded_destroy (ph5_sharded_t* tree)
+{
+	shards_free (tree->shards, (size_t) 1 << tree->shard_bits);
+	tree->shards = NULL;
+
+	pthread_rwlock_destroy (&tree->lock);
+}
+
+void* ph5_sharded_insert (ph5_sharded_t* tree, ph5_point_t* point, void* element)
+{
+	pthread_rwlock_rdlock (&tree->lock);
+
+	ph5_shard_t* shard = sharded_shard (tree, point);
+	shard_write_lock (tree, shard);
+
+	// the same as ph5_insert, but we need to know whether the entry is new
+	ph5_node_t* entry = insert_entry (&shard->tree, point);
+
+	if (!entry->children)
+	{
+		entry->children = shard->tree.element_create (element);
+		shard->count++;
+	}
+
+	void* inserted = entry->children;
+
+	pthread_rwlock_unlock (&shard->lock);
+	pthread_rwlock_unlock (&tree->lock);
+
+	return inserted;
+}
+
+void ph5_sharded_remove (ph5_sharded_t* tree, ph5_point_t* point)
+{
+	pthread_rwlock_rdlock (&tree->lock);
+
+	ph5_shard_t* shard = sharded_shard (tree, point);
+	shard_write_lock (tree, shard);
+
+	if (ph5_find_entry (&shard->tree, point))
+	{
+		ph5_remove (&shard->tree, point);
+		shard->count--;
+	}
+
+	pthread_rwlock_unlock (&shard->lock);
+	pthread_rwlock_unlock (&tree->lock);
+}
+
+void* ph5_sharded_find (ph5_sharded_t* tree, ph5_point_t* point)
+{
+	pthread_rwlock_rdlock (&tree->lock);
+
+	ph5_shard_t* shard = sharded_shard (tree, point);
+	shard_read_lock (shard);
+
+	void* element = ph5_find (&shard->tree, point);
+
+	pthread_rwlock_unlock (&shard->lock);
+	pthread_rwlock_unlock (&tree->lock);
+
+	return element;
+}
+
+bool ph5_sharded_find_apply (ph5_sharded_t* tree, ph5_point_t* point, phtree_iteration_function_t function, void* data)
+{
+	pthread_rwlock_rdlock (&tree->lock);
+
+	ph5_shard_t* shard = sharded_shard (tree, point);
+	shard_read_lock (shard);
+
+	void* element = ph5_find (&shard->tree, point);
+
+	if (element)
+	{
+		function (element, data);
+	}
+
+	pthread_rwlock_unlock (&shard->lock);
+	pthread_rwlock_unlock (&tree->lock);
+
+	return element != NULL;
+}
+
+void ph5_sharded_query (ph5_sharded_t* tree, ph5_query_t* query, void* data)
+{
+	if (!query || !query->function)
+	{
+		return;
+	}
+
+	pthread_rwlock_rdlock (&tree->lock);
+
+	size_t shard_count = (size_t) 1 << tree->shard_bits;
+
+	for (size_t iter = 0; iter < shard_count; iter++)
+	{
+		if (!shard_in_window (tree->shard_bits, iter, query))
+		{
+			continue;
+		}
+
+		shard_read_lock (&tree->shards[iter]);
+		ph5_query (&tree->shards[iter].tree, query, data);
+		pthread_rwlock_unlock (&tree->shards[iter].lock);
+	}
+
+	pthread_rwlock_unlock (&tree->lock);
+}
+
+void ph5_sharded_for_each (ph5_sharded_t* tree, phtree_iteration_function_t function, void* data)
+{
+	if (!function)
+	{
+		return;
+	}
+
+	pthread_rwlock_rdlock (&tree->lock);
+
+	size_t shard_count = (size_t) 1 << tree->shard_bits;
+
+	for (size_t iter = 0; iter < shard_count; iter++)
+	{
+		shard_read_lock (&tree->shards[iter]);
+		ph5_for_each (&tree->shards[iter].tree, function, data);
+		pthread_rwlock_unlock (&tree->shards[iter].lock);
+	}
+
+	pthread_rwlock_unlock (&tree->lock);
+}
+
+size_t ph5_sharded_size (ph5_sharded_t* tree)
+{
+	ph5_sharded_stats_t stats;
+	ph5_sharded_stats (tree, &stats);
+
+	return stats.size;
+}
+
+void ph5_sharded_stats (ph5_sharded_t* tree, ph5_sharded_stats_t* stats)
+{
+	*stats = (ph5_sharded_stats_t) {0};
+
+	pthread_rwlock_rdlock (&tree->lock);
+
+	size_t shard_count = (size_t) 1 << tree->shard_bits;
+	stats->shard_count = (int) shard_count;
+	stats->smallest_shard = SIZE_MAX;
+
+	for (size_t iter = 0; iter < shard_count; iter++)
+	{
+		ph5_shard_t* shard = &tree->shards[iter];
+
+		// the counts are only written while their shard is write locked
+		pthread_rwlock_rdlock (&shard->lock);
+
+		stats->size += shard->count;
+		stats->largest_shard = shard->count > stats->largest_shard ? shard->count : stats->largest_shard;
+		stats->smallest_shard = shard->count < stats->smallest_shard ? shard->count : stats->smallest_shard;
+		stats->writes += shard->writes;
+		stats->reads += atomic_load_explicit (&shard->reads, memory_order_relaxed);
+
+		pthread_rwlock_unlock (&shard->lock);
+	}
+
+	stats->writes_contended = atomic_load_explicit (&tree->writes_contended, memory_order_relaxed);
+	stats->reshards = tree->reshards;
+
+	pthread_rwlock_unlock (&tree->lock);
 }
 
+bool ph5_sharded_reshard (ph5_sharded_t* tree, int shard_bits)
+{
+	shard_bits = sharded_bits_clamp (shard_bits);
+
+	pthread_rwlock_wrlock (&tree->lock);
+
+	if (shard_bits == tree->shard_bits)
+	{
+		pthread_rwlock_unlock (&tree->lock);
+
+		return true;
+	}
+
+	size_t old_count = (size_t) 1 << tree->shard_bits;
+	size_t new_count = (size_t) 1 << shard_bits;
+	ph5_shard_t* old_shards = tree->shards;
+	ph5_shard_t* new_shards = shards_create (tree, new_count);
+
+	if (!new_shards)
+	{
+		pthread_rwlock_unlock (&tree->lock);
+
+		return false;
+	}
+
+	if (shard_bits > tree->shard_bits)
+	{
+		// every old shard is split in to the new shards whose boxes are inside of it
+		int extra_bits = shard_bits - tree->shard_bits;
+
+		for (size_t iter = 0; iter < new_count; iter++)
+		{
+			ph5_query_t region;
+			ph5_point_t min;
+			ph5_point_t max;
+
+			shard_region (shard_bits, iter, &min, &max);
+			ph5_query_set (&region, &min, &max, NULL);
+			ph5_split (&old_shards[iter >> extra_bits].tree, &region, &new_shards[iter].tree);
+			ph5_for_each (&new_shards[iter].tree, shard_count_entry, &new_shards[iter].count);
+		}
+	}
+	else
+	{
+		// every new shard is the old shards whose boxes are inside of it merged together
+		int fewer_bits = tree->shard_bits - shard_bits;
+
+		for (size_t iter = 0; iter < old_count; iter++)
+		{
+			ph5_shard_t* shard = &new_shards[iter >> fewer_bits];
+
+			ph5_merge (&shard->tree, &old_shards[iter].tree, NULL, NULL);
+			shard->count += old_shards[iter].count;
+		}
+	}
+
+	// every old shard is empty now
+	shards_free (old_shards, old_count);
+
+	tree->shards = new_shards;
+	tree->shard_bits = shard_bits;
+	tree->reshards++;
+
+	pthread_rwlock_unlock (&tree->lock);
+
+	return true;
+}
+#endif
 
 #undef child_index
 #undef child_active
 
+#undef RECYCLE_SEARCH_MAX
+
+#ifdef PHTREE_THREADS
+#undef TS_OPTIMISTIC_RETRIES
+#undef TS_OPTIMISTIC_ELEMENTS
+#undef TS_RECLAIM_THRESHOLD
+#undef TS_EPOCH_PENDING
+#endif
+
+#ifdef WINDOW_VECTORS
+#undef WINDOW_VECTORS
+#undef POINT_VECTORS
+#undef lanes_set
+#undef lanes_greater
+#endif
+
 #undef DIMENSIONS
 #undef NODE_CHILD_MAX
 #undef CHILD_SHIFT